@@ -22,21 +22,109 @@
 #include "config.h"
 #endif
 
+#define PY_SSIZE_T_CLEAN
+
 #include <slp.h>
 #include <Python.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #if PY_MAJOR_VERSION >= 3
 #define PyInt_FromLong		PyLong_FromLong
 #endif
 
+/**
+ * One result gathered by the collecting callbacks.
+ */
+typedef struct {
+	char *str;
+	size_t len;
+	unsigned short lifetime;
+} slp_result_t;
+
+/**
+ * Results of one query gathered in C without calling into python. The query
+ * stops at the next result once *cancel (if set) becomes non-zero. The
+ * complete flag is set once the library reported SLP_LAST_CALL, i.e. the
+ * results were not cut short. The partial flag is set if the query was
+ * stopped once limit results came (if set) or by a result coming after the
+ * slp_monotonic() deadline (if set).
+ *
+ * With dedupe set each URL is added once, with the longest lifetime seen;
+ * set is then an open addressing hash table of the item indexes plus one.
+ */
+typedef struct {
+	slp_result_t *items;
+	size_t count;
+	size_t alloc;
+	SLPError err;
+	volatile int *cancel;
+	int complete;
+	size_t limit;
+	double deadline;
+	int partial;
+	int dedupe;
+	size_t *set;
+	size_t setsize;
+} slp_results_t;
+
+#define SLP_RESULTS_INIT	{ NULL, 0, 0, SLP_OK, NULL, 0, 0, 0, 0, 0, NULL, 0 }
+
 struct _cb_cookie_s {
 	PyObject *py_handle;
 	PyObject *py_cookie;
 	PyObject *py_callback;
+	/* batched delivery, see batch_url_cb() */
+	int batch_size;
+	double flush_interval;
+	double batch_start;
+	slp_results_t batch;
+	/* copy of the results for the discovery cache, see record_url_cb() */
+	slp_results_t *record;
+	/* early stop, see srv_url_cb(); partial may be NULL */
+	size_t limit;
+	double deadline;
+	size_t delivered;
+	int *partial;
+	/* replies merged in C before the callback, see collect_srvs() */
+	int dedupe;
+	/* where reg_report_cb() stores the error code, may be NULL */
+	SLPError *report;
 };
 
 typedef struct _cb_cookie_s cb_cookie_t;
 
+typedef struct _async_op_s async_op_t;
+typedef struct _async_event_s async_event_t;
+
+/* registry of the live registrations, see reg_track() */
+static void reg_registered(const char *srvurl, const char *srvtype,
+		const char *attrs, const char *lang, unsigned short lifetime,
+		SLPBoolean fresh);
+static void reg_amend(const char *srvurl, const char *srvtype,
+		const char *add, const char *del, const char *lang,
+		unsigned short lifetime);
+static void reg_forget(const char *srvurl);
+
+#define RET_OK 0
+#define RET_ERROR -1
+
 /**
  * Translates the numeric error codes to strings for use in python exceptions.
  *
@@ -79,522 +167,9582 @@ static const char *get_slp_error_msg(SLPError err)
 }
 
 /**
- * Helper function to convert the python object to SLPHandle.
+ * Calls the python callable with the arguments in a C array. Uses the
+ * vectorcall protocol where available so no argument tuple is allocated.
  *
- * @param py_handle The python handle.
- * @return SLPHandle or NULL on error.
- */
-static inline SLPHandle get_slp_handle(PyObject *py_handle)
-{
-	SLPHandle hslp = NULL;
-
-	if (PyCapsule_IsValid(py_handle, NULL))
-		hslp = PyCapsule_GetPointer(py_handle, NULL);
-
-	return hslp;
-}
-
-/**
- * Common part for all the callback functions; calls the python callback.
- * @param py_args	The python objects to be passed to the python callback.
- * @param cookie 	cb_cookie_t storing the python SLP handle, callback function
- * 					and the python callback cookie.
- * @param cleanup	If set to 1 then the return value of the python function is
- * 					not taken in account and the cookie is freed and the callback
- * 					reference count decreased. If set to 0 then the cleanup
- * 					happens only when the python callback returns "False".
- * @return	SLPBoolean value indicating if the callback wants to process more
- * 			data -- taken from the called python function.
+ * @param callable	The python callable.
+ * @param args		The arguments (borrowed references, none may be NULL).
+ * @param nargs		Number of the arguments.
+ * @return	New reference to the result, NULL with an exception raised on
+ * 			error.
  */
-static inline SLPBoolean cb_common(PyObject *py_args, void *cookie, int cleanup)
+static inline PyObject *slp_call(PyObject *callable, PyObject *const *args,
+		size_t nargs)
 {
-	PyObject *py_result;
-	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
-	SLPBoolean ret;
+#if PY_VERSION_HEX >= 0x03090000
+	return PyObject_Vectorcall(callable, args, nargs, NULL);
+#elif PY_VERSION_HEX >= 0x03080000
+	return _PyObject_Vectorcall(callable, args, nargs, NULL);
+#else
+	PyObject *py_args;
+	PyObject *ret;
+	size_t i;
 
-	py_result = PyObject_CallObject(cb_data->py_callback, py_args);
-	Py_DECREF(py_args);
-	if (!py_result) {
-		PyErr_SetString(PyExc_RuntimeError,
-				"The SLP callback did not return a boolean value.");
-		ret = 0;
-	} else if (cleanup || !(ret = PyObject_IsTrue(py_result))) {
-		Py_DECREF(cb_data->py_callback);
-		free(cookie);
+	if (!(py_args = PyTuple_New(nargs)))
+		return NULL;
+	for (i = 0; i < nargs; i++) {
+		Py_INCREF(args[i]);
+		PyTuple_SET_ITEM(py_args, i, args[i]);
 	}
+	ret = PyObject_Call(callable, py_args, NULL);
+	Py_DECREF(py_args);
 
 	return ret;
+#endif
 }
 
 /**
- * Callback for the SLPFindSrvs() as defined by RFC 2614.
- * @param hslp 		The language specific SLPHandle on which to register
- * 					the service.
- * @param srvurl 	Pointer to the SLP Service URL of the requested service.
- * @param lifetime 	The lifetime of the service in seconds.
- * @param errcode 	An error code indicating if an error occurred during
- * 					the operation.
- * @param cookie 	cb_cookie_t storing the python SLP handle, callback function
- * 					and the python callback cookie.
- * @return	SLPBoolean value indicating if the callback wants to process more
- * 			data.
+ * Converts the C string coming from the library to a python string.
+ *
+ * @param str	The string, may be NULL.
+ * @param len	Length of the string if known, -1 otherwise.
+ * @return	New reference to the string or None, NULL with an exception raised
+ * 			on error.
  */
-static SLPBoolean srv_url_cb(SLPHandle hslp, const char* srvurl,
-		unsigned short lifetime, SLPError errcode, void* cookie)
+static inline PyObject *slp_string(const char *str, Py_ssize_t len)
 {
-	PyObject *py_args;
-	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
-
-	py_args = Py_BuildValue("OziiO", cb_data->py_handle, srvurl, lifetime,
-			errcode, cb_data->py_cookie);
-
-	return cb_common(py_args, cookie, 0);
+	if (!str) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	if (len < 0)
+		len = strlen(str);
+#if PY_MAJOR_VERSION >= 3
+	return PyUnicode_DecodeUTF8(str, len, NULL);
+#else
+	return PyString_FromStringAndSize(str, len);
+#endif
 }
 
+/* Set by slp_at_exit() once the interpreter starts exiting. */
+static volatile int slp_exiting;
+
 /**
- * Callback for the SLPFindSrvTypes() and SLPFindAttrs().
- *
- * RFC 2641 distinguishes between SLPAttrCallback and SLPSrvTypeCallback.
- * However they both have the same argument types and it's up to the python
- * caller to process the data coming from the library anyway.
+ * Takes the GIL in a detached native thread which may outlive the
+ * interpreter. Once the interpreter started exiting the thread must not call
+ * into python any more: it leaks its references instead.
  *
- * @param hslp 		The language specific SLPHandle on which to register
- * 					the service.
- * @param values	For SLPFindAttrs(): Pointer to a buffer containing a comma
- * 					separated null terminated list of attribute id/value
- * 					assignments in SLP wire format "(attr-id=attr-value-list)".
- * 					For SLPFindSrvTypes(): Pointer to a comma separated list of
- * 					service types.
- * @param errcode 	An error code indicating if an error occurred during
- * 					the operation.
- * @param cookie 	cb_cookie_t storing the python SLP handle, callback function
- * 					and the python callback cookie.
- * @return	SLPBoolean value indicating if the callback wants to process more
- * 			data.
+ * @param gstate	Where to store the state for PyGILState_Release().
+ * @return	RET_OK with the GIL held, RET_ERROR if the interpreter is
+ * 			exiting.
  */
-static SLPBoolean srv_attr_type_cb(SLPHandle hslp, const char* values,
-		SLPError errcode, void* cookie)
+static int slp_gil_ensure(PyGILState_STATE *gstate)
 {
-	PyObject *py_args;
-	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
+	if (__atomic_load_n(&slp_exiting, __ATOMIC_ACQUIRE))
+		return RET_ERROR;
+	*gstate = PyGILState_Ensure();
+	/* slp_at_exit() sets the flag with the GIL held. */
+	if (slp_exiting) {
+		PyGILState_Release(*gstate);
+		return RET_ERROR;
+	}
 
-	py_args = Py_BuildValue("OziO", cb_data->py_handle, values, errcode,
-			cb_data->py_cookie);
-	
-	return cb_common(py_args, cookie, 0);
+	return RET_OK;
 }
 
 /**
- * Callback for the SLPReg(), SLPDeReg() and SLPDelAttrs() functions.
+ * atexit hook, called with the GIL held before the interpreter is finalized:
+ * see slp_gil_ensure().
  *
- * @param hslp 		The language specific SLPHandle on which to register
- * 					the service.
- * @param errcode 	An error code indicating if an error occurred during
- * 					the operation.
- * @param cookie 	cb_cookie_t storing the python SLP handle, callback function
- * 					and the python callback cookie.
- * @return Nothing.
+ * @param self		Unused. Mandated by the Python C API.
+ * @param unused	Unused.
+ * @return	None.
  */
-static void reg_report_cb(SLPHandle hslp, SLPError errcode, void* cookie)
+static PyObject *slp_at_exit(PyObject *self, PyObject *unused)
 {
-	PyObject *py_args;
-	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
+	__atomic_store_n(&slp_exiting, 1, __ATOMIC_RELEASE);
 
-	py_args = Py_BuildValue("OiO", cb_data->py_handle, errcode,
-			cb_data->py_cookie);
-	
-	cb_common(py_args, cookie, 1);
+	Py_INCREF(Py_None);
+
+	return Py_None;
 }
 
+static PyMethodDef slp_at_exit_def = {
+	"_at_exit", (PyCFunction) slp_at_exit, METH_NOARGS, NULL
+};
+
+#if PY_VERSION_HEX >= 0x03070000
+/* The module functions use the METH_FASTCALL calling convention: the
+ * positional arguments come in a C array followed by the keyword argument
+ * values, kwnames holds the keyword names. */
+#define SLP_FASTCALL_ARGS	PyObject *const *args, Py_ssize_t nargs, \
+	PyObject *kwnames
+#define SLP_FASTCALL_PASS	args, nargs, kwnames
+#define SLP_FASTCALL_FLAGS	(METH_FASTCALL | METH_KEYWORDS)
+#else
+#define SLP_FASTCALL_ARGS	PyObject *args, PyObject *kwargs
+#define SLP_FASTCALL_PASS	args, kwargs
+#define SLP_FASTCALL_FLAGS	(METH_VARARGS | METH_KEYWORDS)
+#endif
+
+/* Maximum number of the arguments slp_parse_args() handles. */
+#define SLP_MAX_ARGS	16
+
 /**
- * Helper function to extract the SLPHandle and wrap the python objects required
- * for every callback function.
+ * Parses the arguments of the module functions.
  *
- * @param py_handle		The python object for passing the SLPHandle pointer
- * 						through python code. PyCapsule in fact, opaque for the
- * 						python code.
- * @param py_callback	Python object representing the python function to be
- *						called.
- * @param py_cookie		Arbitrary data to be passed to the python callback.
- * @param ret_hslp		Pointer to the memory where the SLPHandle should be
- * 						"extracted". Inside the py_handle capsule.
- * @param ret_cookie	Newly allocated cb_cookie_t structure pointer. Will hold
- * 						the python handle, callback function and cookie objects.
- * @return	RET_OK (0) on success, RET_ERROR (-1) otherwise.
+ * Understands the subset of the PyArg_ParseTupleAndKeywords() format used by
+ * the module: "O", "s", "z", "i", "H", "d", "|" before the optional
+ * arguments and ":name" at the end. The METH_FASTCALL arguments are parsed
+ * directly, without building the argument tuple and the keyword dictionary;
+ * on the python versions without METH_FASTCALL the call is passed to
+ * PyArg_VaParseTupleAndKeywords().
+ *
+ * @param format	The format string.
+ * @param kwlist	The names of the arguments, all the arguments have one.
+ * @param ...		Where to store the values, as for PyArg_ParseTuple().
+ * 					Nothing is stored for the optional arguments not given.
+ * @return RET_OK (0) on success, RET_ERROR (-1) + exception raised otherwise.
  */
-#define RET_OK 0
-#define RET_ERROR -1
-static inline int slpfunc_prep_args(PyObject *py_handle, PyObject *py_callback,
-		PyObject *py_cookie, SLPHandle *ret_hslp, cb_cookie_t **ret_cookie)
+static int slp_parse_args(SLP_FASTCALL_ARGS, const char *format,
+		char **kwlist, ...)
 {
-	if (!(*ret_hslp = get_slp_handle(py_handle))) {
-		PyErr_SetString(PyExc_TypeError, "Invalid SLP handle");
-		return RET_ERROR;
+	va_list va;
+#if PY_VERSION_HEX >= 0x03070000
+	PyObject *objs[SLP_MAX_ARGS];
+	PyObject *obj;
+	const char *fname;
+	const char *f;
+	Py_ssize_t nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+	Py_ssize_t found = 0;
+	Py_ssize_t len;
+	Py_ssize_t k;
+	int required = -1;
+	int n = 0;
+	int i;
+	long val;
+
+	fname = (fname = strchr(format, ':')) ? fname + 1 : "function";
+	for (f = format; *f && *f != ':'; f++) {
+		if (*f == '|')
+			required = n;
+		else
+			n++;
 	}
-	if (!PyCallable_Check(py_callback)) {
-		PyErr_SetString(PyExc_TypeError, "Callback must be callable");
+	if (required < 0)
+		required = n;
+	if (nargs > n) {
+		PyErr_Format(PyExc_TypeError, "%s() takes at most %d positional "
+				"arguments (%zd given)", fname, n, nargs);
 		return RET_ERROR;
 	}
-	if (!(*ret_cookie = malloc(sizeof(cb_cookie_t)))) {
-		PyErr_NoMemory();
+
+	for (i = 0; i < n; i++) {
+		objs[i] = i < nargs ? args[i] : NULL;
+		for (k = 0; k < nkw; k++) {
+			if (PyUnicode_CompareWithASCIIString(
+						PyTuple_GET_ITEM(kwnames, k), kwlist[i]))
+				continue;
+			if (objs[i]) {
+				PyErr_Format(PyExc_TypeError, "argument for %s() given by "
+						"name ('%s') and position (%d)", fname, kwlist[i],
+						i + 1);
+				return RET_ERROR;
+			}
+			objs[i] = args[nargs + k];
+			found++;
+			break;
+		}
+		if (!objs[i] && i < required) {
+			PyErr_Format(PyExc_TypeError, "%s() missing required argument "
+					"'%s' (pos %d)", fname, kwlist[i], i + 1);
+			return RET_ERROR;
+		}
+	}
+	if (found < nkw) {
+		for (k = 0; k < nkw; k++) {
+			for (i = 0; i < n; i++)
+				if (!PyUnicode_CompareWithASCIIString(
+							PyTuple_GET_ITEM(kwnames, k), kwlist[i]))
+					break;
+			if (i == n)
+				break;
+		}
+		PyErr_Format(PyExc_TypeError, "'%U' is an invalid keyword argument "
+				"for %s()", PyTuple_GET_ITEM(kwnames, k), fname);
 		return RET_ERROR;
 	}
-	
-	/* Decreased in the callback when no longer needed */
-	Py_XINCREF(py_callback);
 
-	(*ret_cookie)->py_handle = py_handle;
-	(*ret_cookie)->py_cookie = py_cookie;
-	(*ret_cookie)->py_callback = py_callback;
+	va_start(va, kwlist);
+	for (f = format, i = 0; *f && *f != ':'; f++) {
+		if (*f == '|')
+			continue;
+		obj = objs[i++];
+		switch (*f) {
+		case 'O': {
+			PyObject **ptr = va_arg(va, PyObject **);
+
+			if (obj)
+				*ptr = obj;
+			break;
+		}
+		case 's':
+		case 'z': {
+			char **ptr = va_arg(va, char **);
+
+			if (!obj)
+				break;
+			if (*f == 'z' && obj == Py_None) {
+				*ptr = NULL;
+				break;
+			}
+			if (!PyUnicode_Check(obj)) {
+				PyErr_Format(PyExc_TypeError, "%s() argument '%s' must be "
+						"%s, not %.50s", fname, kwlist[i - 1],
+						*f == 'z' ? "str or None" : "str",
+						Py_TYPE(obj)->tp_name);
+				goto error;
+			}
+			if (!(*ptr = (char *) PyUnicode_AsUTF8AndSize(obj, &len)))
+				goto error;
+			if (strlen(*ptr) != (size_t) len) {
+				PyErr_SetString(PyExc_ValueError, "embedded null character");
+				goto error;
+			}
+			break;
+		}
+		case 'i':
+		case 'H': {
+			void *ptr = va_arg(va, void *);
+
+			if (!obj)
+				break;
+			if (PyFloat_Check(obj)) {
+				PyErr_Format(PyExc_TypeError, "%s() argument '%s' must be "
+						"int, not float", fname, kwlist[i - 1]);
+				goto error;
+			}
+			if ((val = PyLong_AsLong(obj)) == -1 && PyErr_Occurred())
+				goto error;
+			if (*f == 'H') {
+				/* No overflow checking, as PyArg_ParseTuple() does. */
+				*(unsigned short *) ptr = (unsigned short) val;
+				break;
+			}
+			if (val > INT_MAX || val < INT_MIN) {
+				PyErr_Format(PyExc_OverflowError, "%s() argument '%s' does "
+						"not fit in C int", fname, kwlist[i - 1]);
+				goto error;
+			}
+			*(int *) ptr = (int) val;
+			break;
+		}
+		case 'd': {
+			double *ptr = va_arg(va, double *);
+			double dval;
+
+			if (!obj)
+				break;
+			if ((dval = PyFloat_AsDouble(obj)) == -1 && PyErr_Occurred())
+				goto error;
+			*ptr = dval;
+			break;
+		}
+		default:
+			PyErr_Format(PyExc_SystemError, "bad format char '%c' for %s()",
+					*f, fname);
+			goto error;
+		}
+	}
+	va_end(va);
 
 	return RET_OK;
+
+error:
+	va_end(va);
+
+	return RET_ERROR;
+#else
+	int ret;
+
+	va_start(va, kwlist);
+	ret = PyArg_VaParseTupleAndKeywords(args, kwargs, format, kwlist, va);
+	va_end(va);
+
+	return ret ? RET_OK : RET_ERROR;
+#endif
 }
 
 /**
- * Helper function for the py_slp_findsrvs() and py_slp_findsttrs -- extracts
- * the arguments.
+ * The python SLP handle object.
  *
- * @param args	The python object holding the parameters from the python caller
- *				code.
- * @param hslp	Will hold the SLPHandle to be used with the SLP functions.
- * @param str_arg_1	Where to put the first extracted string
- * @param str_arg_2	Where to put the second extracted string
- * @param str_arg_3	Where to put the third extracted string
- * @param cb_cookie	Where to allocate the cb_cookie_t structure wrapping the
- *					python objects.
- * @return RET_OK (0) on success, RET_ERROR (-1) otherwise.
+ * Wraps the SLPHandle returned by SLPOpen(). The library refuses to run two
+ * operations on one handle at the same time (SLP_HANDLE_IN_USE), so every
+ * interface function takes the handle with slp_handle_acquire() and the
+ * callers from other threads are queued on the cond variable instead of
+ * failing. The busy flag is used instead of locking the mutex for the whole
+ * call so that the handle may be released from a different thread.
+ *
+ * The asynchronous handles do not use the busy flag; see async_submit().
  */
-static int location_func_prep(PyObject *args, SLPHandle *hslp,
-		char **str_arg_1, char **str_arg_2, char **str_arg_3,
-		cb_cookie_t **cb_cookie)
-{
-	PyObject *py_handle;
-	PyObject *py_callback;
-	PyObject *py_cookie;
-	
-	if (!PyArg_ParseTuple(args, "OzzzOO", &py_handle, str_arg_1, str_arg_2,
-				str_arg_3, &py_callback, &py_cookie)) {
-		return RET_ERROR;
-	}
+typedef struct {
+	PyObject_HEAD
+	SLPHandle hslp;
+	char *lang;
+	SLPBoolean isasync;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int busy;
+	pthread_t owner;
+	/* asynchronous handles only */
+	int rfd;
+	int wfd;
+	async_event_t *events_head;
+	async_event_t *events_tail;
+	async_op_t *running;
+	async_op_t *queued_head;
+	async_op_t *queued_tail;
+	int pending;
+	int dispatching;
+} SLPHandleObject;
 
-	return slpfunc_prep_args(py_handle, py_callback, py_cookie,
-			hslp, cb_cookie);
-}
+static PyTypeObject SLPHandle_Type;
+
+#define SLPHandle_Check(__o)	PyObject_TypeCheck(__o, &SLPHandle_Type)
 
 /**
- * Interface function for SLPOpen().
+ * Opens a new SLP handle and wraps it into the python handle object.
  *
- * @param self	Unused. Mandated by the Python C API.
- * @param args	Wrapping the SLPOpen arguments:
- * 				lang: String according to RFC 1766, may be None or "".
- * 				isasync: Boolean indicating whether to open for async
- * 				operations.
- * @return	PyObject wrapping a tuple of a SLPHandle wrapper capsule.
- * 			On error returns NULL and raises an exception.
+ * @param lang		String according to RFC 1766, may be NULL or "".
+ * @param isasync	Whether to open the handle for async operations.
+ * @return	New reference to the handle object. On error returns NULL and
+ * 			raises an exception.
  */
-static PyObject *py_slp_open(PyObject *self, PyObject *args)
+static PyObject *slp_handle_open(const char *lang, SLPBoolean isasync)
 {
-	char *lang;
-	SLPBoolean isasync;
+	SLPHandleObject *handle;
 	SLPHandle hslp;
 	SLPError err;
-	PyObject *py_handle;
+	int fds[2] = { -1, -1 };
 
-	if (!PyArg_ParseTuple(args, "zi", &lang, &isasync))
+	if (isasync && pipe(fds) < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
 		return NULL;
-	if ((err = SLPOpen(lang, isasync, &hslp)) != SLP_OK) {
+	}
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPOpen(lang, isasync, &hslp);
+	Py_END_ALLOW_THREADS
+	if (err != SLP_OK) {
 		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
-		return NULL;
+		goto err_close;
 	}
-	if (!(py_handle = PyCapsule_New(hslp, NULL, NULL))) {
+	if (!(handle = PyObject_GC_New(SLPHandleObject, &SLPHandle_Type))) {
 		SLPClose(hslp);
-		return NULL;
+		goto err_close;
+	}
+	handle->hslp = hslp;
+	handle->lang = lang ? strdup(lang) : NULL;
+	handle->isasync = isasync;
+	handle->busy = 0;
+	pthread_mutex_init(&handle->lock, NULL);
+	pthread_cond_init(&handle->cond, NULL);
+	handle->rfd = fds[0];
+	handle->wfd = fds[1];
+	if (isasync) {
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
 	}
-		
-	return Py_BuildValue("O", py_handle);
+	handle->events_head = handle->events_tail = NULL;
+	handle->running = handle->queued_head = handle->queued_tail = NULL;
+	handle->pending = 0;
+	handle->dispatching = 0;
+	PyObject_GC_Track(handle);
+
+	return (PyObject *) handle;
+
+err_close:
+	if (isasync) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	return NULL;
 }
 
 /**
- * Interface function for SLPClose().
+ * Takes the exclusive use of the handle for one libslp call, waiting while
+ * another thread is using it. Does not need the GIL.
  *
- * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject capsule storing the SLPHandle pointer.
- * @return	None.
+ * @param handle	The python handle object.
+ * @return	SLP_OK on success, SLP_HANDLE_IN_USE if the calling thread already
+ * 			uses the handle (a python callback calling back into the same
+ * 			handle would deadlock otherwise) or SLP_PARAMETER_BAD if the handle
+ * 			is closed.
  */
-static PyObject *py_slp_close(PyObject *self, PyObject *args)
+static SLPError slp_handle_wait(SLPHandleObject *handle)
 {
-	PyObject *py_handle;
-	SLPHandle hslp = NULL;
+	SLPError err = SLP_OK;
 
-	if (!PyArg_ParseTuple(args, "O", &py_handle))
-		return NULL;
-	if ((hslp = get_slp_handle(py_handle))) {
-		SLPClose(hslp);
-		Py_DECREF(py_handle);
+	pthread_mutex_lock(&handle->lock);
+	if (handle->busy && pthread_equal(handle->owner, pthread_self())) {
+		err = SLP_HANDLE_IN_USE;
 	} else {
-		PyErr_SetString(PyExc_TypeError, "The argument to SLPClose doesn't "
-				"seem to be a valid SLP handle");
-		return NULL;
+		while (handle->busy)
+			pthread_cond_wait(&handle->cond, &handle->lock);
+		if (handle->hslp) {
+			handle->busy = 1;
+			handle->owner = pthread_self();
+		} else {
+			err = SLP_PARAMETER_BAD;
+		}
 	}
-	
-	Py_INCREF(Py_None);
-	
-	return Py_None;
+	pthread_mutex_unlock(&handle->lock);
+
+	return err;
 }
 
 /**
- * Interface function for SLPFindSrvs().
+ * Raises the python exception for a slp_handle_wait() failure.
  *
- * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
- * 				hslp: SLPHandle returned from SLPOpen
- *				srvtype: The service type string -- may be None or ""
- *				scopelist: Comma separated list of scope names -- may be ""
- *				filter: A query formulated of attribute pattern matching
- *				expressions in the form of an LDAPv3 search filter.
- *				callback: te python object representing the callback function to
- *				be called.
- *				cookie: arbitrary data to be passed to the callback.
- * @return	None on success, NULL + exception raised on error.
+ * @param err	The slp_handle_wait() return value.
  */
-static PyObject *py_slp_findsrvs(PyObject *self, PyObject *args)
+static void slp_handle_wait_error(SLPError err)
+{
+	if (err == SLP_HANDLE_IN_USE)
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+	else
+		PyErr_SetString(PyExc_ValueError, "The SLP handle is closed");
+}
+
+/**
+ * Takes the exclusive use of the handle for one libslp call. Waits with the
+ * GIL released while another thread is using the handle.
+ *
+ * @param handle	The python handle object.
+ * @return	RET_OK (0) on success, RET_ERROR (-1) with an exception raised if
+ * 			slp_handle_wait() fails.
+ */
+static int slp_handle_acquire(SLPHandleObject *handle)
 {
-	SLPHandle hslp;
-	char *srvtype;
-	char *scopetype;
-	char *filter;
 	SLPError err;
-	cb_cookie_t *cookie;
 
-	if (location_func_prep(args, &hslp, &srvtype, &scopetype, &filter, &cookie)
-			!= RET_OK)
-		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	err = slp_handle_wait(handle);
+	Py_END_ALLOW_THREADS
 
-	if ((err = SLPFindSrvs(hslp, srvtype, scopetype, filter, srv_url_cb,
-					(void *)cookie)) != SLP_OK) {
-		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
-		return NULL;
+	if (err != SLP_OK) {
+		slp_handle_wait_error(err);
+		return RET_ERROR;
 	}
 
-	Py_INCREF(Py_None);
-
-	return Py_None;
+	return RET_OK;
 }
 
 /**
- * Interface function for SLPFindSrvTypes().
+ * Gives up the handle taken by slp_handle_acquire() and wakes up the next
+ * waiting thread. Does not need the GIL.
  *
- * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
- * 				hslp: SLPHandle returned from SLPOpen
- *				namingauth: The naming authorities to search. "*" for all
- *				authorities, "" for the default (IANA)
- *				scopelist: Comma separated list of scope names -- may be ""
- *				callback: te python object representing the callback function to
- *				be called.
- *				cookie: arbitrary data to be passed to the callback.
- * @return	None on success, NULL + exception raised on error.
+ * @param handle	The python handle object.
  */
-static PyObject *py_slp_findsrvtypes(PyObject *self, PyObject *args)
+static void slp_handle_release(SLPHandleObject *handle)
 {
-	SLPHandle hslp;
-	PyObject *py_handle;
-	PyObject *py_callback;
-	PyObject *py_cookie;
+	pthread_mutex_lock(&handle->lock);
+	handle->busy = 0;
+	pthread_cond_signal(&handle->cond);
+	pthread_mutex_unlock(&handle->lock);
+}
+
+/*
+ * Asynchronous handles.
+ *
+ * For the handles opened with isasync set libslp returns from the calls
+ * immediately and runs the callbacks in its own thread. The callbacks below
+ * never call into python: they queue the results as events on the handle and
+ * write a byte to the handle pipe. The python code watches handle.fileno()
+ * and calls handle.process_events() to run the python callbacks. The library
+ * still runs one operation per handle at a time so the operations issued
+ * while another one is in progress are queued and started by
+ * process_events() once the running one is over.
+ *
+ * The queues of the operations are protected by the GIL, the event queue is
+ * shared with the libslp thread and protected by the handle mutex.
+ */
+
+typedef enum {
+	ASYNC_FIND_SRVS,
+	ASYNC_FIND_SRVTYPES,
+	ASYNC_FIND_ATTRS,
+	ASYNC_REG,
+	ASYNC_DEREG,
+	ASYNC_DELATTRS
+} async_kind_t;
+
+/**
+ * One callback invocation queued by the libslp thread.
+ */
+struct _async_event_s {
+	struct _async_event_s *next;
+	async_op_t *op;
+	char *str;
+	unsigned short lifetime;
+	SLPError errcode;
+	int final;
+	int internal;
+};
+
+/**
+ * One operation on an asynchronous handle. Owns the references in the cookie.
+ * The last event is queued in place if it cannot be allocated: the operation
+ * has to end even when out of memory.
+ */
+struct _async_op_s {
+	struct _async_op_s *next;
+	async_kind_t kind;
+	SLPHandleObject *handle;
+	cb_cookie_t *cookie;
+	char *args[3];
+	unsigned short lifetime;
+	SLPBoolean fresh;
+	volatile int stopped;
+	async_event_t last;
+};
+
+/**
+ * Frees the event. Must be called before async_op_free() of its operation.
+ *
+ * @param event	The event.
+ */
+static void async_event_free(async_event_t *event)
+{
+	free(event->str);
+	if (event != &event->op->last)
+		free(event);
+}
+
+/**
+ * Frees the operation and drops the python references it holds. Needs the
+ * GIL.
+ *
+ * @param op	The operation.
+ */
+static void async_op_free(async_op_t *op)
+{
+	int i;
+
+	Py_DECREF(op->cookie->py_handle);
+	Py_DECREF(op->cookie->py_callback);
+	Py_DECREF(op->cookie->py_cookie);
+	free(op->cookie);
+	for (i = 0; i < 3; i++)
+		free(op->args[i]);
+	free(op);
+}
+
+/**
+ * Queues one event for process_events() and wakes up the poller. Called by
+ * the libslp thread without the GIL.
+ *
+ * @param op		The operation the event belongs to.
+ * @param str		The URL, attribute or service type list, may be NULL.
+ * @param lifetime	The lifetime of the URL.
+ * @param errcode	The error code passed to the callback.
+ * @param final		Whether it is the last event of the operation.
+ * @param internal	Whether the event only marks the end of the operation
+ * 					and is not to be passed to the python callback.
+ */
+static void async_push_event(async_op_t *op, const char *str,
+		unsigned short lifetime, SLPError errcode, int final, int internal)
+{
+	SLPHandleObject *handle = op->handle;
+	async_event_t *event;
+	ssize_t ret;
+
+	if (!(event = calloc(1, sizeof(async_event_t)))) {
+		if (!final)
+			return;
+		event = &op->last;
+		str = NULL;
+		if (errcode == SLP_OK || errcode == SLP_LAST_CALL)
+			errcode = SLP_MEMORY_ALLOC_FAILED;
+	}
+	if (str && !(event->str = strdup(str)))
+		errcode = SLP_MEMORY_ALLOC_FAILED;
+	event->op = op;
+	event->lifetime = lifetime;
+	event->errcode = errcode;
+	event->final = final;
+	event->internal = internal;
+
+	pthread_mutex_lock(&handle->lock);
+	if (handle->events_tail)
+		handle->events_tail->next = event;
+	else
+		handle->events_head = event;
+	handle->events_tail = event;
+	pthread_mutex_unlock(&handle->lock);
+	do {
+		ret = write(handle->wfd, "", 1);
+	} while (ret < 0 && errno == EINTR);
+}
+
+/**
+ * SLPFindSrvs() callback for the asynchronous handles.
+ */
+static SLPBoolean async_url_cb(SLPHandle hslp, const char* srvurl,
+		unsigned short lifetime, SLPError errcode, void* cookie)
+{
+	async_op_t *op = (async_op_t *) cookie;
+
+	/* The python callback returned False meanwhile. */
+	if (op->stopped) {
+		async_push_event(op, NULL, 0, SLP_OK, 1, 1);
+		return SLP_FALSE;
+	}
+	async_push_event(op, srvurl, lifetime, errcode, errcode != SLP_OK, 0);
+
+	return errcode == SLP_OK ? SLP_TRUE : SLP_FALSE;
+}
+
+/**
+ * SLPFindAttrs() and SLPFindSrvTypes() callback for the asynchronous handles.
+ */
+static SLPBoolean async_str_cb(SLPHandle hslp, const char* values,
+		SLPError errcode, void* cookie)
+{
+	return async_url_cb(hslp, values, 0, errcode, cookie);
+}
+
+/**
+ * SLPReg(), SLPDereg() and SLPDelAttrs() callback for the asynchronous
+ * handles.
+ */
+static void async_report_cb(SLPHandle hslp, SLPError errcode, void* cookie)
+{
+	async_op_t *op = (async_op_t *) cookie;
+
+	if (errcode == SLP_OK && op->kind == ASYNC_REG)
+		reg_registered(op->args[0], op->args[1], op->args[2],
+				op->handle->lang, op->lifetime, op->fresh);
+	else if (errcode == SLP_OK && op->kind == ASYNC_DEREG)
+		reg_forget(op->args[0]);
+	else if (errcode == SLP_OK && op->kind == ASYNC_DELATTRS)
+		reg_amend(op->args[0], NULL, NULL, op->args[1], NULL, 0);
+	async_push_event(op, NULL, 0, errcode, 1, 0);
+}
+
+/* Longest pause between two tries of async_start(), in nanoseconds. */
+#define ASYNC_RETRY_MAX_NS	10000000
+/* Total time async_start() keeps trying, in nanoseconds. */
+#define ASYNC_RETRY_TOTAL_NS	1000000000
+
+/**
+ * Issues the libslp call of the operation. Needs the GIL which is released
+ * for the call. Retries if the library still considers the handle busy with
+ * the previous operation whose last callback has just returned: the library
+ * thread is about to finish, so the pause starts at 50us and doubles up to
+ * ASYNC_RETRY_MAX_NS.
+ *
+ * @param op	The operation.
+ * @return	The error code returned by the library.
+ */
+static SLPError async_start(async_op_t *op)
+{
+	SLPHandle hslp = op->handle->hslp;
+	struct timespec delay = { 0, 50000 };
+	SLPError err = SLP_OK;
+	long waited;
+
+	op->handle->running = op;
+	Py_BEGIN_ALLOW_THREADS
+	for (waited = 0; waited < ASYNC_RETRY_TOTAL_NS;
+			waited += delay.tv_nsec) {
+		switch (op->kind) {
+		case ASYNC_FIND_SRVS:
+			err = SLPFindSrvs(hslp, op->args[0], op->args[1], op->args[2],
+					async_url_cb, (void *)op);
+			break;
+		case ASYNC_FIND_SRVTYPES:
+			err = SLPFindSrvTypes(hslp, op->args[0], op->args[1],
+					async_str_cb, (void *)op);
+			break;
+		case ASYNC_FIND_ATTRS:
+			err = SLPFindAttrs(hslp, op->args[0], op->args[1], op->args[2],
+					async_str_cb, (void *)op);
+			break;
+		case ASYNC_REG:
+			err = SLPReg(hslp, op->args[0], op->lifetime, op->args[1],
+					op->args[2], op->fresh, async_report_cb, (void *)op);
+			break;
+		case ASYNC_DEREG:
+			err = SLPDereg(hslp, op->args[0], async_report_cb, (void *)op);
+			break;
+		case ASYNC_DELATTRS:
+			err = SLPDelAttrs(hslp, op->args[0], op->args[1],
+					async_report_cb, (void *)op);
+			break;
+		}
+		if (err != SLP_HANDLE_IN_USE)
+			break;
+		nanosleep(&delay, NULL);
+		if (delay.tv_nsec < ASYNC_RETRY_MAX_NS)
+			delay.tv_nsec *= 2;
+	}
+	Py_END_ALLOW_THREADS
+	if (err != SLP_OK)
+		op->handle->running = NULL;
+
+	return err;
+}
+
+/**
+ * Queues an operation on the asynchronous handle, or starts it right away if
+ * the handle is idle. Takes over the cookie prepared by slpfunc_prep_args().
+ *
+ * @param handle	The asynchronous python handle object.
+ * @param kind		What libslp function to call.
+ * @param cookie	The callback cookie.
+ * @param arg0, arg1, arg2	The string arguments of the libslp function, may
+ * 					be NULL.
+ * @param lifetime	The lifetime for SLPReg().
+ * @param fresh		The fresh flag for SLPReg().
+ * @return	None on success, NULL + exception raised on error.
+ */
+static PyObject *async_submit(SLPHandleObject *handle, async_kind_t kind,
+		cb_cookie_t *cookie, const char *arg0, const char *arg1,
+		const char *arg2, unsigned short lifetime, SLPBoolean fresh)
+{
+	const char *args[3] = { arg0, arg1, arg2 };
+	async_op_t *op;
+	SLPError err;
+	int i;
+
+	Py_INCREF(cookie->py_handle);
+	Py_INCREF(cookie->py_cookie);
+	if (!(op = calloc(1, sizeof(async_op_t)))) {
+		Py_DECREF(cookie->py_handle);
+		Py_DECREF(cookie->py_cookie);
+		Py_DECREF(cookie->py_callback);
+		free(cookie);
+		return PyErr_NoMemory();
+	}
+	op->kind = kind;
+	op->handle = handle;
+	op->cookie = cookie;
+	op->lifetime = lifetime;
+	op->fresh = fresh;
+	for (i = 0; i < 3; i++) {
+		if (args[i] && !(op->args[i] = strdup(args[i]))) {
+			async_op_free(op);
+			return PyErr_NoMemory();
+		}
+	}
+	if (!handle->hslp) {
+		async_op_free(op);
+		PyErr_SetString(PyExc_ValueError, "The SLP handle is closed");
+		return NULL;
+	}
+
+	handle->pending++;
+	if (handle->running || handle->queued_head) {
+		if (handle->queued_tail)
+			handle->queued_tail->next = op;
+		else
+			handle->queued_head = op;
+		handle->queued_tail = op;
+	} else if ((err = async_start(op)) != SLP_OK) {
+		handle->pending--;
+		async_op_free(op);
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+/**
+ * Calls the python callback of the operation for one event.
+ *
+ * @param op		The operation.
+ * @param str		The URL, attribute or service type list, may be NULL.
+ * @param lifetime	The lifetime of the URL.
+ * @param errcode	The error code to pass.
+ * @return	SLPBoolean value returned by the callback (always SLP_FALSE for
+ * 			the registration callbacks), -1 with an exception raised on error.
+ */
+static int async_call(async_op_t *op, const char *str,
+		unsigned short lifetime, SLPError errcode)
+{
+	cb_cookie_t *cookie = op->cookie;
+	PyObject *py_args[5];
+	PyObject *py_result = NULL;
+	size_t nargs = 0;
+	size_t i;
+	int ret;
+
+	py_args[nargs++] = cookie->py_handle;
+	if (op->kind == ASYNC_FIND_SRVS || op->kind == ASYNC_FIND_SRVTYPES ||
+			op->kind == ASYNC_FIND_ATTRS)
+		py_args[nargs++] = slp_string(str, -1);
+	if (op->kind == ASYNC_FIND_SRVS)
+		py_args[nargs++] = PyInt_FromLong(lifetime);
+	py_args[nargs++] = PyInt_FromLong(errcode);
+	py_args[nargs++] = cookie->py_cookie;
+
+	for (i = 1; i < nargs - 1; i++)
+		if (!py_args[i])
+			break;
+	if (i == nargs - 1)
+		py_result = slp_call(cookie->py_callback, py_args, nargs);
+	for (i = 1; i < nargs - 1; i++)
+		Py_XDECREF(py_args[i]);
+	if (!py_result)
+		return -1;
+	ret = PyObject_IsTrue(py_result);
+	Py_DECREF(py_result);
+
+	return ret;
+}
+
+/**
+ * Starts the queued operations once the handle is idle. The operations the
+ * library refuses to start get their python callback called with the error.
+ *
+ * @param handle	The asynchronous python handle object.
+ * @return	Number of the python callbacks called, -1 with an exception raised
+ * 			if one of them failed.
+ */
+static int async_start_next(SLPHandleObject *handle)
+{
+	async_op_t *op;
+	SLPError err;
+	int ncalls = 0;
+
+	while (!handle->running && (op = handle->queued_head) && handle->hslp) {
+		if (!(handle->queued_head = op->next))
+			handle->queued_tail = NULL;
+		op->next = NULL;
+		if ((err = async_start(op)) == SLP_OK)
+			break;
+		handle->pending--;
+		ncalls++;
+		if (async_call(op, NULL, 0, err) < 0) {
+			async_op_free(op);
+			return -1;
+		}
+		async_op_free(op);
+	}
+
+	return ncalls;
+}
+
+/**
+ * Drops all the operations and events of a closed asynchronous handle. Needs
+ * the GIL.
+ *
+ * @param handle	The python handle object.
+ */
+static void async_flush(SLPHandleObject *handle)
+{
+	async_event_t *event;
+	async_op_t *op;
+
+	while ((event = handle->events_head)) {
+		handle->events_head = event->next;
+		async_event_free(event);
+	}
+	handle->events_tail = NULL;
+	while ((op = handle->queued_head)) {
+		handle->queued_head = op->next;
+		async_op_free(op);
+	}
+	handle->queued_tail = NULL;
+	if ((op = handle->running)) {
+		handle->running = NULL;
+		async_op_free(op);
+	}
+	handle->pending = 0;
+}
+
+/**
+ * Runs the python callbacks for the events queued by the libslp thread and
+ * starts the queued operations. Does not block.
+ *
+ * A callback closing the handle does not free the operations while the
+ * events taken off the queue still point to them: the remaining events are
+ * dropped and async_flush() runs once the loop is over. A nested call from a
+ * callback does nothing.
+ *
+ * @return	Number of the python callbacks called. If a callback raises, its
+ * 			operation is stopped and the exception is propagated after all
+ * 			the events are processed.
+ */
+static PyObject *slp_handle_process_events(SLPHandleObject *self,
+		PyObject *unused)
+{
+	PyObject *exc_type = NULL, *exc_value = NULL, *exc_tb = NULL;
+	async_event_t *events;
+	async_event_t *event;
+	async_op_t *op;
+	char buf[256];
+	int ncalls = 0;
+	int final;
+	int ret;
+
+	if (!self->isasync) {
+		PyErr_SetString(PyExc_ValueError,
+				"The SLP handle is not asynchronous");
+		return NULL;
+	}
+	if (!self->hslp || self->dispatching)
+		return PyInt_FromLong(0);
+
+	while (read(self->rfd, buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&self->lock);
+	events = self->events_head;
+	self->events_head = self->events_tail = NULL;
+	pthread_mutex_unlock(&self->lock);
+
+	/* The callbacks may close the handle and drop its last reference. */
+	Py_INCREF(self);
+	self->dispatching = 1;
+	while ((event = events)) {
+		events = event->next;
+		op = event->op;
+		if (!self->hslp) {
+			/* Closed by a callback, see async_flush(). */
+			async_event_free(event);
+			continue;
+		}
+		if (!event->internal && !op->stopped) {
+			ncalls++;
+			if ((ret = async_call(op, event->str, event->lifetime,
+							event->errcode)) <= 0) {
+				op->stopped = 1;
+				if (ret < 0 && !exc_type)
+					PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+				PyErr_Clear();
+			}
+		}
+		final = event->final;
+		async_event_free(event);
+		if (final && op == self->running) {
+			self->running = NULL;
+			self->pending--;
+			async_op_free(op);
+		}
+		if (self->hslp && !self->running) {
+			if ((ret = async_start_next(self)) < 0) {
+				if (!exc_type)
+					PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+				PyErr_Clear();
+			} else {
+				ncalls += ret;
+			}
+		}
+	}
+	self->dispatching = 0;
+	if (!self->hslp)
+		async_flush(self);
+	Py_DECREF(self);
+
+	if (exc_type) {
+		PyErr_Restore(exc_type, exc_value, exc_tb);
+		return NULL;
+	}
+
+	return PyInt_FromLong(ncalls);
+}
+
+static PyObject *slp_handle_fileno(SLPHandleObject *self, PyObject *unused)
+{
+	if (!self->isasync) {
+		PyErr_SetString(PyExc_ValueError,
+				"The SLP handle is not asynchronous");
+		return NULL;
+	}
+
+	return PyInt_FromLong(self->rfd);
+}
+
+static PyObject *slp_handle_get_pending(SLPHandleObject *self, void *closure)
+{
+	return PyInt_FromLong(self->pending);
+}
+
+/**
+ * Closes the SLPHandle once the running operation (if any) finishes. Closing
+ * an already closed handle does nothing.
+ *
+ * @param handle	The python handle object.
+ * @return	RET_OK (0) on success, RET_ERROR (-1) with an exception raised
+ * 			when called from a callback running on the same handle.
+ */
+static int slp_handle_close(SLPHandleObject *handle)
+{
+	SLPHandle hslp;
+
+	if (!handle->hslp)
+		return RET_OK;
+	if (handle->isasync) {
+		/* SLPClose() waits for the running operation. */
+		hslp = handle->hslp;
+		handle->hslp = NULL;
+		Py_BEGIN_ALLOW_THREADS
+		SLPClose(hslp);
+		Py_END_ALLOW_THREADS
+		/* Otherwise done by process_events() once its loop is over. */
+		if (!handle->dispatching)
+			async_flush(handle);
+		return RET_OK;
+	}
+	if (slp_handle_acquire(handle) != RET_OK) {
+		if (PyErr_ExceptionMatches(PyExc_ValueError)) {
+			/* Closed by another thread meanwhile. */
+			PyErr_Clear();
+			return RET_OK;
+		}
+		return RET_ERROR;
+	}
+
+	hslp = handle->hslp;
+	handle->hslp = NULL;
+	Py_BEGIN_ALLOW_THREADS
+	SLPClose(hslp);
+	Py_END_ALLOW_THREADS
+	pthread_mutex_lock(&handle->lock);
+	handle->busy = 0;
+	pthread_cond_broadcast(&handle->cond);
+	pthread_mutex_unlock(&handle->lock);
+
+	return RET_OK;
+}
+
+static PyObject *slp_handle_tp_new(PyTypeObject *type, PyObject *args,
+		PyObject *kwargs)
+{
+	static char *kwlist[] = { "lang", "isasync", NULL };
+	char *lang = NULL;
+	PyObject *py_isasync = Py_False;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zO", kwlist, &lang,
+				&py_isasync))
+		return NULL;
+
+	return slp_handle_open(lang, PyObject_IsTrue(py_isasync));
+}
+
+static int slp_handle_tp_traverse(SLPHandleObject *self, visitproc visit,
+		void *arg)
+{
+	async_op_t *op;
+
+	for (op = self->queued_head; op; op = op->next) {
+		Py_VISIT(op->cookie->py_handle);
+		Py_VISIT(op->cookie->py_callback);
+		Py_VISIT(op->cookie->py_cookie);
+	}
+	if ((op = self->running)) {
+		Py_VISIT(op->cookie->py_handle);
+		Py_VISIT(op->cookie->py_callback);
+		Py_VISIT(op->cookie->py_cookie);
+	}
+
+	return 0;
+}
+
+static int slp_handle_tp_clear(SLPHandleObject *self)
+{
+	async_op_t *op;
+
+	/* The running operation is referenced by the libslp thread. */
+	while ((op = self->queued_head)) {
+		self->queued_head = op->next;
+		self->pending--;
+		async_op_free(op);
+	}
+	self->queued_tail = NULL;
+
+	return 0;
+}
+
+static void slp_handle_tp_dealloc(SLPHandleObject *self)
+{
+	PyObject_GC_UnTrack(self);
+	slp_handle_tp_clear(self);
+	/* Nobody else can hold the handle once the last reference is gone. */
+	if (self->hslp) {
+		Py_BEGIN_ALLOW_THREADS
+		SLPClose(self->hslp);
+		Py_END_ALLOW_THREADS
+	}
+	if (self->isasync) {
+		async_flush(self);
+		close(self->rfd);
+		close(self->wfd);
+	}
+	free(self->lang);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	PyObject_GC_Del(self);
+}
+
+static PyObject *slp_handle_close_meth(SLPHandleObject *self,
+		PyObject *unused)
+{
+	if (slp_handle_close(self) != RET_OK)
+		return NULL;
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+static PyObject *slp_handle_enter(SLPHandleObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+
+	return (PyObject *) self;
+}
+
+static PyObject *slp_handle_exit(SLPHandleObject *self, PyObject *args)
+{
+	if (slp_handle_close(self) != RET_OK)
+		return NULL;
+
+	Py_INCREF(Py_False);
+
+	return Py_False;
+}
+
+static PyObject *slp_handle_get_closed(SLPHandleObject *self, void *closure)
+{
+	return PyBool_FromLong(self->hslp == NULL);
+}
+
+static PyObject *slp_handle_get_lang(SLPHandleObject *self, void *closure)
+{
+	return Py_BuildValue("z", self->lang);
+}
+
+static PyObject *slp_handle_get_isasync(SLPHandleObject *self, void *closure)
+{
+	return PyBool_FromLong(self->isasync);
+}
+
+static PyMethodDef slp_handle_methods[] = {
+	{ "close", (PyCFunction) slp_handle_close_meth, METH_NOARGS, NULL },
+	{ "fileno", (PyCFunction) slp_handle_fileno, METH_NOARGS, NULL },
+	{ "process_events", (PyCFunction) slp_handle_process_events,
+		METH_NOARGS, NULL },
+	{ "__enter__", (PyCFunction) slp_handle_enter, METH_NOARGS, NULL },
+	{ "__exit__", (PyCFunction) slp_handle_exit, METH_VARARGS, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef slp_handle_getset[] = {
+	{ "closed", (getter) slp_handle_get_closed, NULL, NULL, NULL },
+	{ "lang", (getter) slp_handle_get_lang, NULL, NULL, NULL },
+	{ "isasync", (getter) slp_handle_get_isasync, NULL, NULL, NULL },
+	{ "pending", (getter) slp_handle_get_pending, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject SLPHandle_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "slp.Handle",
+	.tp_basicsize = sizeof(SLPHandleObject),
+	.tp_dealloc = (destructor) slp_handle_tp_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_traverse = (traverseproc) slp_handle_tp_traverse,
+	.tp_clear = (inquiry) slp_handle_tp_clear,
+	.tp_methods = slp_handle_methods,
+	.tp_getset = slp_handle_getset,
+	.tp_new = slp_handle_tp_new,
+};
+
+/**
+ * Returns the value of the monotonic clock in seconds.
+ */
+static double slp_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns the wall clock time in seconds (same as time.time()).
+ */
+static double slp_walltime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Converts a relative timeout to the absolute time for
+ * pthread_cond_timedwait().
+ *
+ * @param timeout	Timeout in seconds.
+ * @param ts		Where to store the absolute time.
+ */
+static void slp_abstime(double timeout, struct timespec *ts)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += (time_t) timeout;
+	ts->tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/**
+ * One idle handle stored in the pool.
+ */
+typedef struct {
+	SLPHandleObject *handle;
+	unsigned long thread;
+	double last_used;
+} pool_slot_t;
+
+/**
+ * The python SLP handle pool object.
+ *
+ * Keeps up to max_size handles opened with the same parameters. The first
+ * "size" handles are opened up front so the discovery calls don't pay the
+ * SLPOpen() latency; more are opened on demand and the surplus ones are
+ * closed after being idle for idle_timeout seconds. The handles are handed
+ * out wrapped in a lease which puts them back when released, when leaving
+ * the "with" block or when garbage collected (e.g. when the thread holding it
+ * dies). A thread gets back the handle it used last time if it is idle.
+ *
+ * The pool state is guarded by the mutex which is never held while waiting
+ * for the GIL.
+ */
+typedef struct {
+	PyObject_HEAD
+	char *lang;
+	SLPBoolean isasync;
+	int size;
+	int max_size;
+	double idle_timeout;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pool_slot_t *idle;
+	int nidle;
+	int nopen;
+	int closed;
+} SLPHandlePoolObject;
+
+/**
+ * The lease of one pool handle.
+ */
+typedef struct {
+	PyObject_HEAD
+	SLPHandlePoolObject *pool;
+	SLPHandleObject *handle;
+} SLPHandleLeaseObject;
+
+static PyTypeObject SLPHandlePool_Type;
+static PyTypeObject SLPHandleLease_Type;
+
+/**
+ * Closes the handles which were idle longer than the idle timeout as long as
+ * there are more than "size" handles opened. Must be called with the GIL held
+ * and the pool mutex unlocked.
+ *
+ * @param pool	The python pool object.
+ */
+static void slp_pool_shrink(SLPHandlePoolObject *pool)
+{
+	SLPHandleObject *expired;
+	double now = slp_monotonic();
+
+	do {
+		expired = NULL;
+		pthread_mutex_lock(&pool->lock);
+		/* The oldest slots are at the beginning of the array. */
+		if (pool->nidle > 0 && pool->nopen > pool->size &&
+				now - pool->idle[0].last_used > pool->idle_timeout) {
+			expired = pool->idle[0].handle;
+			memmove(pool->idle, pool->idle + 1,
+					--pool->nidle * sizeof(pool_slot_t));
+			pool->nopen--;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		Py_XDECREF(expired);
+	} while (expired);
+}
+
+/**
+ * Takes a handle from the pool: the idle one last used by the calling thread,
+ * the most recently used idle one or a newly opened one if the pool may
+ * grow. Otherwise waits with the GIL released.
+ *
+ * @param pool		The python pool object.
+ * @param timeout	Maximum time to wait in seconds, negative for no limit.
+ * @return	New reference to the handle, NULL with an exception raised on
+ * 			error.
+ */
+static SLPHandleObject *slp_pool_get(SLPHandlePoolObject *pool,
+		double timeout)
+{
+	SLPHandleObject *handle = NULL;
+	unsigned long thread = PyThread_get_thread_ident();
+	struct timespec deadline;
+	int timedout = 0;
+	int grow = 0;
+	int i;
+
+	if (timeout >= 0)
+		slp_abstime(timeout, &deadline);
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->closed) {
+			pthread_mutex_unlock(&pool->lock);
+			PyErr_SetString(PyExc_ValueError, "The SLP handle pool is closed");
+			return NULL;
+		}
+		if (pool->nidle > 0) {
+			for (i = pool->nidle - 1; i > 0; i--)
+				if (pool->idle[i].thread == thread)
+					break;
+			if (pool->idle[i].thread != thread)
+				i = pool->nidle - 1;
+			handle = pool->idle[i].handle;
+			memmove(pool->idle + i, pool->idle + i + 1,
+					(--pool->nidle - i) * sizeof(pool_slot_t));
+		} else if (pool->nopen < pool->max_size) {
+			pool->nopen++;
+			grow = 1;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		if (handle || grow || timedout)
+			break;
+
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->closed && !pool->nidle &&
+				pool->nopen >= pool->max_size && !timedout) {
+			if (timeout < 0)
+				pthread_cond_wait(&pool->cond, &pool->lock);
+			else
+				timedout = pthread_cond_timedwait(&pool->cond, &pool->lock,
+						&deadline) != 0;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		Py_END_ALLOW_THREADS
+	}
+
+	if (grow) {
+		handle = (SLPHandleObject *) slp_handle_open(pool->lang,
+				pool->isasync);
+		if (!handle) {
+			pthread_mutex_lock(&pool->lock);
+			pool->nopen--;
+			pthread_cond_signal(&pool->cond);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	} else if (!handle) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"Timed out waiting for a handle from the SLP handle pool");
+	}
+
+	return handle;
+}
+
+/**
+ * Returns the handle to the pool. Closes it if the pool is closed meanwhile
+ * or if the handle was closed by the user.
+ *
+ * @param pool		The python pool object.
+ * @param handle	The handle taken by slp_pool_get(); the reference is
+ * 					stolen.
+ */
+static void slp_pool_put(SLPHandlePoolObject *pool, SLPHandleObject *handle)
+{
+	int keep;
+
+	pthread_mutex_lock(&pool->lock);
+	keep = !pool->closed && handle->hslp;
+	if (keep) {
+		pool->idle[pool->nidle].handle = handle;
+		pool->idle[pool->nidle].thread = PyThread_get_thread_ident();
+		pool->idle[pool->nidle].last_used = slp_monotonic();
+		pool->nidle++;
+	} else {
+		pool->nopen--;
+	}
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!keep)
+		Py_DECREF(handle);
+	slp_pool_shrink(pool);
+}
+
+/**
+ * Closes all the idle handles and makes the pool refuse new requests. The
+ * leased handles are closed when returned.
+ *
+ * @param pool	The python pool object.
+ */
+static void slp_pool_close(SLPHandlePoolObject *pool)
+{
+	pool_slot_t *idle;
+	int nidle;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->closed = 1;
+	idle = pool->idle;
+	nidle = pool->nidle;
+	pool->idle = NULL;
+	pool->nidle = 0;
+	pool->nopen -= nidle;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < nidle; i++)
+		Py_DECREF(idle[i].handle);
+	free(idle);
+}
+
+static PyObject *slp_pool_tp_new(PyTypeObject *type, PyObject *args,
+		PyObject *kwargs)
+{
+	static char *kwlist[] = { "size", "lang", "isasync", "max_size",
+		"idle_timeout", NULL };
+	SLPHandlePoolObject *pool;
+	SLPHandleObject *handle;
+	PyObject *py_isasync = Py_False;
+	char *lang = NULL;
+	int size;
+	int max_size = -1;
+	double idle_timeout = 60.0;
+	int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|zOid", kwlist, &size,
+				&lang, &py_isasync, &max_size, &idle_timeout))
+		return NULL;
+	if (max_size < 0)
+		max_size = size;
+	if (size < 0 || max_size < 1 || max_size < size) {
+		PyErr_SetString(PyExc_ValueError, "Invalid SLP handle pool size");
+		return NULL;
+	}
+
+	if (!(pool = (SLPHandlePoolObject *) type->tp_alloc(type, 0)))
+		return NULL;
+	pool->lang = lang ? strdup(lang) : NULL;
+	pool->isasync = PyObject_IsTrue(py_isasync);
+	pool->size = size;
+	pool->max_size = max_size;
+	pool->idle_timeout = idle_timeout;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	if (!(pool->idle = calloc(max_size, sizeof(pool_slot_t)))) {
+		Py_DECREF(pool);
+		return PyErr_NoMemory();
+	}
+
+	/* Pre-warm the pool; each SLPOpen() runs with the GIL released. */
+	for (i = 0; i < size; i++) {
+		if (!(handle = (SLPHandleObject *) slp_handle_open(lang,
+						pool->isasync))) {
+			Py_DECREF(pool);
+			return NULL;
+		}
+		pool->idle[i].handle = handle;
+		pool->idle[i].thread = 0;
+		pool->idle[i].last_used = slp_monotonic();
+		pool->nidle = pool->nopen = i + 1;
+	}
+
+	return (PyObject *) pool;
+}
+
+static int slp_pool_tp_traverse(SLPHandlePoolObject *self, visitproc visit,
+		void *arg)
+{
+	int i;
+
+	for (i = 0; i < self->nidle; i++)
+		Py_VISIT(self->idle[i].handle);
+
+	return 0;
+}
+
+static int slp_pool_tp_clear(SLPHandlePoolObject *self)
+{
+	slp_pool_close(self);
+
+	return 0;
+}
+
+static void slp_pool_tp_dealloc(SLPHandlePoolObject *self)
+{
+	PyObject_GC_UnTrack(self);
+	slp_pool_close(self);
+	free(self->lang);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *slp_pool_acquire(SLPHandlePoolObject *self, PyObject *args,
+		PyObject *kwargs)
+{
+	static char *kwlist[] = { "timeout", NULL };
+	SLPHandleLeaseObject *lease;
+	SLPHandleObject *handle;
+	PyObject *py_timeout = Py_None;
+	double timeout = -1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &py_timeout))
+		return NULL;
+	if (py_timeout != Py_None &&
+			(timeout = PyFloat_AsDouble(py_timeout)) == -1 && PyErr_Occurred())
+		return NULL;
+
+	if (!(handle = slp_pool_get(self, timeout)))
+		return NULL;
+	if (!(lease = PyObject_GC_New(SLPHandleLeaseObject,
+					&SLPHandleLease_Type))) {
+		slp_pool_put(self, handle);
+		return NULL;
+	}
+	Py_INCREF(self);
+	lease->pool = self;
+	lease->handle = handle;
+	PyObject_GC_Track(lease);
+
+	return (PyObject *) lease;
+}
+
+static PyObject *slp_pool_close_meth(SLPHandlePoolObject *self,
+		PyObject *unused)
+{
+	slp_pool_close(self);
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+static PyObject *slp_pool_enter(SLPHandlePoolObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+
+	return (PyObject *) self;
+}
+
+static PyObject *slp_pool_exit(SLPHandlePoolObject *self, PyObject *args)
+{
+	slp_pool_close(self);
+
+	Py_INCREF(Py_False);
+
+	return Py_False;
+}
+
+static PyObject *slp_pool_get_stats(SLPHandlePoolObject *self, void *closure)
+{
+	PyObject *ret;
+
+	pthread_mutex_lock(&self->lock);
+	ret = Py_BuildValue("{s:i,s:i,s:i,s:i}", "size", self->size,
+			"max_size", self->max_size, "open", self->nopen,
+			"idle", self->nidle);
+	pthread_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+static PyMethodDef slp_pool_methods[] = {
+	{ "acquire", (PyCFunction) slp_pool_acquire,
+		METH_VARARGS | METH_KEYWORDS, NULL },
+	{ "close", (PyCFunction) slp_pool_close_meth, METH_NOARGS, NULL },
+	{ "__enter__", (PyCFunction) slp_pool_enter, METH_NOARGS, NULL },
+	{ "__exit__", (PyCFunction) slp_pool_exit, METH_VARARGS, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef slp_pool_getset[] = {
+	{ "stats", (getter) slp_pool_get_stats, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject SLPHandlePool_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "slp.HandlePool",
+	.tp_basicsize = sizeof(SLPHandlePoolObject),
+	.tp_dealloc = (destructor) slp_pool_tp_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_traverse = (traverseproc) slp_pool_tp_traverse,
+	.tp_clear = (inquiry) slp_pool_tp_clear,
+	.tp_methods = slp_pool_methods,
+	.tp_getset = slp_pool_getset,
+	.tp_new = slp_pool_tp_new,
+};
+
+/**
+ * Returns the leased handle to its pool; does nothing if already returned.
+ *
+ * @param lease	The python lease object.
+ */
+static void slp_lease_release(SLPHandleLeaseObject *lease)
+{
+	SLPHandleObject *handle = lease->handle;
+
+	if (handle) {
+		lease->handle = NULL;
+		slp_pool_put(lease->pool, handle);
+	}
+}
+
+static int slp_lease_tp_traverse(SLPHandleLeaseObject *self, visitproc visit,
+		void *arg)
+{
+	Py_VISIT(self->pool);
+	Py_VISIT(self->handle);
+
+	return 0;
+}
+
+static int slp_lease_tp_clear(SLPHandleLeaseObject *self)
+{
+	if (self->pool)
+		slp_lease_release(self);
+	Py_CLEAR(self->pool);
+
+	return 0;
+}
+
+static void slp_lease_tp_dealloc(SLPHandleLeaseObject *self)
+{
+	PyObject_GC_UnTrack(self);
+	slp_lease_tp_clear(self);
+	PyObject_GC_Del(self);
+}
+
+static PyObject *slp_lease_release_meth(SLPHandleLeaseObject *self,
+		PyObject *unused)
+{
+	slp_lease_release(self);
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+static PyObject *slp_lease_get_handle(SLPHandleLeaseObject *self,
+		void *closure)
+{
+	if (!self->handle) {
+		PyErr_SetString(PyExc_ValueError, "The SLP handle was released");
+		return NULL;
+	}
+	Py_INCREF(self->handle);
+
+	return (PyObject *) self->handle;
+}
+
+static PyObject *slp_lease_enter(SLPHandleLeaseObject *self, PyObject *unused)
+{
+	return slp_lease_get_handle(self, NULL);
+}
+
+static PyObject *slp_lease_exit(SLPHandleLeaseObject *self, PyObject *args)
+{
+	slp_lease_release(self);
+
+	Py_INCREF(Py_False);
+
+	return Py_False;
+}
+
+static PyMethodDef slp_lease_methods[] = {
+	{ "release", (PyCFunction) slp_lease_release_meth, METH_NOARGS, NULL },
+	{ "__enter__", (PyCFunction) slp_lease_enter, METH_NOARGS, NULL },
+	{ "__exit__", (PyCFunction) slp_lease_exit, METH_VARARGS, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef slp_lease_getset[] = {
+	{ "handle", (getter) slp_lease_get_handle, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject SLPHandleLease_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "slp.HandleLease",
+	.tp_basicsize = sizeof(SLPHandleLeaseObject),
+	.tp_dealloc = (destructor) slp_lease_tp_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_traverse = (traverseproc) slp_lease_tp_traverse,
+	.tp_clear = (inquiry) slp_lease_tp_clear,
+	.tp_methods = slp_lease_methods,
+	.tp_getset = slp_lease_getset,
+};
+
+/**
+ * Common part for all the callback functions; calls the python callback.
+ * @param py_args	The python objects to be passed to the python callback
+ * 					(borrowed references). If one of them is NULL, the
+ * 					exception raised when creating it is kept and the
+ * 					cookie is freed.
+ * @param nargs		Number of the arguments.
+ * @param cookie 	cb_cookie_t storing the python SLP handle, callback function
+ * 					and the python callback cookie.
+ * @param cleanup	If set to 1 then the return value of the python function is
+ * 					not taken in account and the cookie is freed and the callback
+ * 					reference count decreased. If set to 0 then the cleanup
+ * 					happens only when the python callback returns "False".
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data -- taken from the called python function.
+ *
+ * The caller has to hold the GIL: the libslp callbacks below run while the
+ * interface functions have released it and re-acquire it around this call.
+ */
+static inline SLPBoolean cb_common(PyObject *const *py_args, size_t nargs,
+		void *cookie, int cleanup)
+{
+	PyObject *py_result = NULL;
+	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
+	SLPBoolean ret = SLP_FALSE;
+	size_t i;
+
+	for (i = 0; i < nargs; i++)
+		if (!py_args[i])
+			break;
+	/* An exception raised by the callback stays set for the caller. */
+	if (i == nargs &&
+			(py_result = slp_call(cb_data->py_callback, py_args, nargs))) {
+		ret = PyObject_IsTrue(py_result) > 0 ? SLP_TRUE : SLP_FALSE;
+		Py_DECREF(py_result);
+	}
+	if (cleanup || !ret) {
+		Py_DECREF(cb_data->py_callback);
+		free(cookie);
+	}
+
+	return ret;
+}
+
+/**
+ * Whether a result coming now is past the deadline of the query; if so the
+ * results are recorded as partial.
+ *
+ * @param cookie	cb_cookie_t of the query.
+ */
+static int cb_past_deadline(cb_cookie_t *cookie)
+{
+	if (cookie->deadline <= 0 || slp_monotonic() < cookie->deadline)
+		return 0;
+	if (cookie->partial)
+		*cookie->partial = 1;
+
+	return 1;
+}
+
+/**
+ * Counts a delivered result. Whether the limit of the results of the query
+ * was reached; if so the results are recorded as partial.
+ *
+ * @param cookie	cb_cookie_t of the query.
+ */
+static int cb_limit_reached(cb_cookie_t *cookie)
+{
+	if (!cookie->limit || ++cookie->delivered < cookie->limit)
+		return 0;
+	if (cookie->partial)
+		*cookie->partial = 1;
+
+	return 1;
+}
+
+/**
+ * Callback for the SLPFindSrvs() as defined by RFC 2614.
+ * @param hslp 		The language specific SLPHandle on which to register
+ * 					the service.
+ * @param srvurl 	Pointer to the SLP Service URL of the requested service.
+ * @param lifetime 	The lifetime of the service in seconds.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	cb_cookie_t storing the python SLP handle, callback function
+ * 					and the python callback cookie.
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data.
+ *
+ * The query stops early once the limit of results was passed to the python
+ * callback or when a result comes after the deadline (which is dropped); the
+ * python callback gets SLP_LAST_CALL then as if the query was over.
+ */
+static SLPBoolean srv_url_cb(SLPHandle hslp, const char* srvurl,
+		unsigned short lifetime, SLPError errcode, void* cookie)
+{
+	PyObject *py_args[5];
+	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
+	PyGILState_STATE gstate;
+	SLPBoolean ret;
+	int late = 0;
+	int stop;
+
+	if (errcode == SLP_OK && (late = cb_past_deadline(cb_data))) {
+		srvurl = NULL;
+		lifetime = 0;
+		errcode = SLP_LAST_CALL;
+	}
+	gstate = PyGILState_Ensure();
+	py_args[0] = cb_data->py_handle;
+	py_args[1] = slp_string(srvurl, -1);
+	py_args[2] = PyInt_FromLong(lifetime);
+	py_args[3] = PyInt_FromLong(errcode);
+	py_args[4] = cb_data->py_cookie;
+	/* Nothing comes after SLP_LAST_CALL or an error. */
+	ret = cb_common(py_args, 5, cookie, errcode != SLP_OK);
+	stop = ret && errcode == SLP_OK && cb_limit_reached(cb_data);
+	Py_XDECREF(py_args[1]);
+	Py_XDECREF(py_args[2]);
+	Py_XDECREF(py_args[3]);
+	if (stop) {
+		py_args[1] = Py_None;
+		py_args[2] = PyInt_FromLong(0);
+		py_args[3] = PyInt_FromLong(SLP_LAST_CALL);
+		cb_common(py_args, 5, cookie, 1);
+		Py_XDECREF(py_args[2]);
+		Py_XDECREF(py_args[3]);
+	}
+	PyGILState_Release(gstate);
+
+	return late || stop ? SLP_FALSE : ret;
+}
+
+/**
+ * Callback for the SLPFindSrvTypes() and SLPFindAttrs().
+ *
+ * RFC 2641 distinguishes between SLPAttrCallback and SLPSrvTypeCallback.
+ * However they both have the same argument types and it's up to the python
+ * caller to process the data coming from the library anyway.
+ *
+ * @param hslp 		The language specific SLPHandle on which to register
+ * 					the service.
+ * @param values	For SLPFindAttrs(): Pointer to a buffer containing a comma
+ * 					separated null terminated list of attribute id/value
+ * 					assignments in SLP wire format "(attr-id=attr-value-list)".
+ * 					For SLPFindSrvTypes(): Pointer to a comma separated list of
+ * 					service types.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	cb_cookie_t storing the python SLP handle, callback function
+ * 					and the python callback cookie.
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data.
+ */
+static SLPBoolean srv_attr_type_cb(SLPHandle hslp, const char* values,
+		SLPError errcode, void* cookie)
+{
+	PyObject *py_args[4];
+	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
+	PyGILState_STATE gstate;
+	SLPBoolean ret;
+
+	gstate = PyGILState_Ensure();
+	py_args[0] = cb_data->py_handle;
+	py_args[1] = slp_string(values, -1);
+	py_args[2] = PyInt_FromLong(errcode);
+	py_args[3] = cb_data->py_cookie;
+	ret = cb_common(py_args, 4, cookie, errcode != SLP_OK);
+	Py_XDECREF(py_args[1]);
+	Py_XDECREF(py_args[2]);
+	PyGILState_Release(gstate);
+
+	return ret;
+}
+
+/**
+ * Callback for the SLPReg(), SLPDeReg() and SLPDelAttrs() functions.
+ *
+ * @param hslp 		The language specific SLPHandle on which to register
+ * 					the service.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	cb_cookie_t storing the python SLP handle, callback function
+ * 					and the python callback cookie.
+ * @return Nothing.
+ */
+static void reg_report_cb(SLPHandle hslp, SLPError errcode, void* cookie)
+{
+	PyObject *py_args[3];
+	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
+	PyGILState_STATE gstate;
+
+	if (cb_data->report)
+		*cb_data->report = errcode;
+	gstate = PyGILState_Ensure();
+	py_args[0] = cb_data->py_handle;
+	py_args[1] = PyInt_FromLong(errcode);
+	py_args[2] = cb_data->py_cookie;
+	cb_common(py_args, 3, cookie, 1);
+	Py_XDECREF(py_args[1]);
+	PyGILState_Release(gstate);
+}
+
+/**
+ * Appends a copy of the string to the results. Does not need the GIL.
+ *
+ * @param res		The results.
+ * @param str		The URL, attribute list or service type list.
+ * @param lifetime	Lifetime of the URL in seconds, 0 for the other kinds.
+ * @return	RET_OK (0) on success, RET_ERROR (-1) when out of memory.
+ */
+static int slp_results_add(slp_results_t *res, const char *str,
+		unsigned short lifetime)
+{
+	slp_result_t *items;
+	size_t len = strlen(str);
+	char *copy;
+
+	if (res->count == res->alloc) {
+		res->alloc = res->alloc ? res->alloc * 2 : 16;
+		if (!(items = realloc(res->items, res->alloc * sizeof(slp_result_t))))
+			return RET_ERROR;
+		res->items = items;
+	}
+	if (!(copy = malloc(len + 1)))
+		return RET_ERROR;
+	memcpy(copy, str, len + 1);
+	res->items[res->count].str = copy;
+	res->items[res->count].len = len;
+	res->items[res->count].lifetime = lifetime;
+	res->count++;
+
+	return RET_OK;
+}
+
+/**
+ * FNV-1a hash of the cache keys and of the URLs.
+ */
+static unsigned long cache_hash(const char *key, size_t keylen)
+{
+	unsigned long hash = 2166136261UL;
+	size_t i;
+
+	for (i = 0; i < keylen; i++)
+		hash = (hash ^ (unsigned char) key[i]) * 16777619UL;
+
+	return hash;
+}
+
+/**
+ * Adds a result unless already there; a duplicate only gets the longer of
+ * the two lifetimes. Does not need the GIL.
+ *
+ * @param res		The results with dedupe set.
+ * @param str		The result.
+ * @param lifetime	Its lifetime.
+ * @return	RET_OK on success, RET_ERROR if out of memory.
+ */
+static int slp_results_add_unique(slp_results_t *res, const char *str,
+		unsigned short lifetime)
+{
+	slp_result_t *item;
+	size_t len = strlen(str);
+	size_t *set;
+	size_t size;
+	size_t mask;
+	size_t i;
+	size_t k;
+
+	/* Keep the table at most half full. */
+	if (2 * (res->count + 1) > res->setsize) {
+		size = res->setsize ? 2 * res->setsize : 64;
+		if (!(set = calloc(size, sizeof(size_t))))
+			return RET_ERROR;
+		for (k = 0; k < res->count; k++) {
+			item = &res->items[k];
+			for (i = cache_hash(item->str, item->len) & (size - 1); set[i];
+					i = (i + 1) & (size - 1))
+				;
+			set[i] = k + 1;
+		}
+		free(res->set);
+		res->set = set;
+		res->setsize = size;
+	}
+	mask = res->setsize - 1;
+	for (i = cache_hash(str, len) & mask; res->set[i]; i = (i + 1) & mask) {
+		item = &res->items[res->set[i] - 1];
+		if (item->len == len && !memcmp(item->str, str, len)) {
+			if (lifetime > item->lifetime)
+				item->lifetime = lifetime;
+			return RET_OK;
+		}
+	}
+	if (slp_results_add(res, str, lifetime) != RET_OK)
+		return RET_ERROR;
+	res->set[i] = res->count;
+
+	return RET_OK;
+}
+
+/**
+ * Copies the results without the duplicates.
+ *
+ * @param src	The results.
+ * @param dst	Where to copy them, initialized by SLP_RESULTS_INIT.
+ * @return	RET_OK on success, RET_ERROR if out of memory.
+ */
+static int slp_results_dedupe(const slp_results_t *src, slp_results_t *dst)
+{
+	size_t i;
+
+	dst->dedupe = 1;
+	dst->err = src->err;
+	for (i = 0; i < src->count; i++)
+		if (slp_results_add_unique(dst, src->items[i].str,
+					src->items[i].lifetime) != RET_OK)
+			return RET_ERROR;
+
+	return RET_OK;
+}
+
+/**
+ * Frees the gathered results. Does not need the GIL.
+ *
+ * @param res	The results.
+ */
+static void slp_results_clear(slp_results_t *res)
+{
+	size_t i;
+
+	for (i = 0; i < res->count; i++)
+		free(res->items[i].str);
+	free(res->items);
+	free(res->set);
+	res->items = NULL;
+	res->set = NULL;
+	res->count = res->alloc = res->setsize = 0;
+}
+
+/**
+ * Converts the gathered results to a python list.
+ *
+ * @param res			The results.
+ * @param with_lifetime	If set then the items are (url, lifetime) tuples,
+ * 						plain strings otherwise.
+ * @return	New reference to the list, NULL with an exception raised on error.
+ */
+static PyObject *slp_results_to_list(const slp_results_t *res,
+		int with_lifetime)
+{
+	PyObject *list;
+	PyObject *item;
+	size_t i;
+
+	if (!(list = PyList_New(res->count)))
+		return NULL;
+	for (i = 0; i < res->count; i++) {
+		if (with_lifetime)
+			item = Py_BuildValue("(s#i)", res->items[i].str,
+					(Py_ssize_t) res->items[i].len, res->items[i].lifetime);
+		else
+			item = Py_BuildValue("s#", res->items[i].str,
+					(Py_ssize_t) res->items[i].len);
+		if (!item) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+
+	return list;
+}
+
+/**
+ * SLPFindSrvs() callback gathering the URLs into slp_results_t. Runs without
+ * the GIL.
+ *
+ * @param hslp 		The SLPHandle used for the query.
+ * @param srvurl 	The URL of the found service.
+ * @param lifetime 	The lifetime of the service in seconds.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	The slp_results_t to fill.
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data.
+ */
+static SLPBoolean collect_url_cb(SLPHandle hslp, const char* srvurl,
+		unsigned short lifetime, SLPError errcode, void* cookie)
+{
+	slp_results_t *res = (slp_results_t *) cookie;
+
+	if (res->cancel && *res->cancel)
+		return SLP_FALSE;
+	if (errcode == SLP_OK && res->deadline > 0 &&
+			slp_monotonic() >= res->deadline) {
+		res->partial = 1;
+		return SLP_FALSE;
+	}
+	if (errcode == SLP_OK) {
+		if ((res->dedupe ? slp_results_add_unique(res, srvurl, lifetime) :
+					slp_results_add(res, srvurl, lifetime)) != RET_OK) {
+			errcode = SLP_MEMORY_ALLOC_FAILED;
+		} else if (res->limit && res->count >= res->limit) {
+			res->partial = 1;
+			return SLP_FALSE;
+		} else {
+			return SLP_TRUE;
+		}
+	}
+	if (errcode == SLP_LAST_CALL)
+		res->complete = 1;
+	else if (res->err == SLP_OK)
+		res->err = errcode;
+
+	return SLP_FALSE;
+}
+
+/**
+ * Runs SLPFindSrvs() gathering the URLs into slp_results_t. The whole scope
+ * list goes in the one query: with dedupe set in the results the replies of
+ * all the scopes are merged by collect_url_cb(), so that a service advertised
+ * in several scopes comes once. Does not need the GIL.
+ *
+ * @param hslp		The SLPHandle to use.
+ * @param srvtype	The service type.
+ * @param scopelist	The scope list, may be NULL.
+ * @param filter	The LDAPv3 filter, may be NULL.
+ * @param res		The results to fill.
+ * @return	Return value of SLPFindSrvs().
+ */
+static SLPError collect_srvs(SLPHandle hslp, const char *srvtype,
+		const char *scopelist, const char *filter, slp_results_t *res)
+{
+	return SLPFindSrvs(hslp, srvtype, scopelist, filter, collect_url_cb,
+			(void *)res);
+}
+
+/**
+ * SLPFindAttrs() and SLPFindSrvTypes() callback gathering the strings into
+ * slp_results_t. Runs without the GIL.
+ *
+ * @param hslp 		The SLPHandle used for the query.
+ * @param values	The attribute list or the service types list.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	The slp_results_t to fill.
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data.
+ */
+static SLPBoolean collect_str_cb(SLPHandle hslp, const char* values,
+		SLPError errcode, void* cookie)
+{
+	return collect_url_cb(hslp, values, 0, errcode, cookie);
+}
+
+/**
+ * SLPReg(), SLPDereg() and SLPDelAttrs() callback storing the error code into
+ * slp_results_t. Runs without the GIL.
+ *
+ * @param hslp 		The SLPHandle used for the operation.
+ * @param errcode 	The result of the operation.
+ * @param cookie 	The slp_results_t.
+ */
+static void collect_report_cb(SLPHandle hslp, SLPError errcode, void* cookie)
+{
+	((slp_results_t *) cookie)->err = errcode;
+}
+
+/**
+ * Passes the buffered results to the python callback as one list.
+ *
+ * @param cookie		cb_cookie_t with the buffered results; freed by
+ * 						cb_common() unless the callback wants more data.
+ * @param errcode		SLP_OK for an intermediate batch, the final error code
+ * 						(SLP_LAST_CALL on success) for the last one.
+ * @param with_lifetime	Whether the results are URLs with lifetimes.
+ * @return	SLPBoolean value returned by the python callback.
+ */
+static SLPBoolean batch_flush(cb_cookie_t *cookie, SLPError errcode,
+		int with_lifetime)
+{
+	PyGILState_STATE gstate;
+	PyObject *py_args[4];
+	SLPBoolean ret;
+
+	gstate = PyGILState_Ensure();
+	py_args[0] = cookie->py_handle;
+	py_args[1] = slp_results_to_list(&cookie->batch, with_lifetime);
+	py_args[2] = PyInt_FromLong(errcode);
+	py_args[3] = cookie->py_cookie;
+	slp_results_clear(&cookie->batch);
+	cookie->batch_start = 0;
+	ret = cb_common(py_args, 4, cookie, errcode != SLP_OK);
+	Py_XDECREF(py_args[1]);
+	Py_XDECREF(py_args[2]);
+	PyGILState_Release(gstate);
+
+	return ret;
+}
+
+/**
+ * Common part of the batching callbacks.
+ *
+ * @param cookie		cb_cookie_t storing the python objects and the buffer.
+ * @param str			The URL or the attribute list.
+ * @param lifetime		The lifetime of the URL.
+ * @param errcode		The error code passed by the library.
+ * @param with_lifetime	Whether the results are URLs with lifetimes.
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data.
+ */
+static SLPBoolean batch_common(cb_cookie_t *cookie, const char *str,
+		unsigned short lifetime, SLPError errcode, int with_lifetime)
+{
+	double now;
+
+	if (errcode == SLP_OK && cb_past_deadline(cookie)) {
+		batch_flush(cookie, SLP_LAST_CALL, with_lifetime);
+		return SLP_FALSE;
+	}
+	if (errcode != SLP_OK)
+		return batch_flush(cookie, errcode, with_lifetime);
+	if (slp_results_add(&cookie->batch, str, lifetime) != RET_OK)
+		return batch_flush(cookie, SLP_MEMORY_ALLOC_FAILED, with_lifetime);
+	if (cb_limit_reached(cookie)) {
+		batch_flush(cookie, SLP_LAST_CALL, with_lifetime);
+		return SLP_FALSE;
+	}
+
+	if (cookie->batch_size > 0 &&
+			cookie->batch.count >= (size_t) cookie->batch_size)
+		return batch_flush(cookie, SLP_OK, with_lifetime);
+	if (cookie->flush_interval > 0) {
+		now = slp_monotonic();
+		if (!cookie->batch_start)
+			cookie->batch_start = now;
+		else if (now - cookie->batch_start >= cookie->flush_interval)
+			return batch_flush(cookie, SLP_OK, with_lifetime);
+	}
+
+	return SLP_TRUE;
+}
+
+/**
+ * SLPFindSrvs() callback for the batched delivery. Buffers the URLs without
+ * the GIL and calls the python callback with a list of (url, lifetime)
+ * tuples once batch_size results are buffered, once flush_interval seconds
+ * passed since the first buffered one (checked when a result comes) and at
+ * the end of the query.
+ *
+ * @param hslp 		The SLPHandle used for the query.
+ * @param srvurl 	The URL of the found service.
+ * @param lifetime 	The lifetime of the service in seconds.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	cb_cookie_t storing the python objects and the buffer.
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data.
+ */
+static SLPBoolean batch_url_cb(SLPHandle hslp, const char* srvurl,
+		unsigned short lifetime, SLPError errcode, void* cookie)
+{
+	return batch_common((cb_cookie_t *) cookie, srvurl, lifetime, errcode, 1);
+}
+
+/**
+ * SLPFindAttrs() callback for the batched delivery; see batch_url_cb().
+ */
+static SLPBoolean batch_attr_cb(SLPHandle hslp, const char* values,
+		SLPError errcode, void* cookie)
+{
+	return batch_common((cb_cookie_t *) cookie, values, 0, errcode, 0);
+}
+
+/* Number of the discovery cache hash buckets. */
+#define CACHE_BUCKETS	1024
+
+/* The first byte of the cache keys: SLPFindSrvs() and SLPFindAttrs() results */
+#define CACHE_SRVS	'S'
+#define CACHE_ATTRS	'A'
+
+/**
+ * Results stored in the discovery cache. Immutable once stored, shared by the
+ * cache entry and the readers holding a reference. The negative entries have
+ * no results; res.err is SLP_OK for an empty result and
+ * SLP_NETWORK_TIMED_OUT for a timed out query.
+ */
+typedef struct {
+	int refs;				/* protected by cache_lock */
+	double stored;			/* slp_monotonic() time of the query */
+	slp_results_t res;
+} cache_data_t;
+
+/**
+ * Entry of the discovery cache. The entries are chained in the hash buckets
+ * and in the LRU list, the most recently used first.
+ */
+typedef struct _cache_entry_s {
+	struct _cache_entry_s *chain;
+	struct _cache_entry_s *lru_prev;
+	struct _cache_entry_s *lru_next;
+	unsigned long hash;
+	char *key;
+	size_t keylen;
+	double expires;
+	/* number of the negative results in a row, 0 for the positive entries */
+	unsigned int streak;
+	cache_data_t *data;
+} cache_entry_t;
+
+/**
+ * Query in progress for a cache key; the identical queries wait for its
+ * results instead of asking the network again.
+ */
+typedef struct _cache_flight_s {
+	struct _cache_flight_s *next;
+	char *key;
+	size_t keylen;
+	int refs;				/* the query and the waiters */
+	int done;
+	int led;				/* run by the leader thread, not a refresh */
+	pthread_t leader;
+	cache_data_t *data;		/* the results, NULL if the query failed */
+} cache_flight_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_flight_cond = PTHREAD_COND_INITIALIZER;
+static cache_flight_t *cache_flights;
+static cache_entry_t *cache_buckets[CACHE_BUCKETS];
+static cache_entry_t *cache_lru_head;
+static cache_entry_t *cache_lru_tail;
+static size_t cache_count;
+/* configuration, see py_slp_cache_configure() */
+static volatile int cache_enabled;
+static size_t cache_max_entries = 1024;
+static double cache_max_ttl;
+static double cache_stale_ttl;
+static double cache_attr_ttl;
+static double cache_negative_ttl;
+static double cache_negative_max_ttl = 300;
+static double cache_negative_flush_interval;
+static double cache_negative_flushed;
+static size_t cache_negative_count;
+/* statistics */
+static unsigned long cache_hits;
+static unsigned long cache_negative_hits;
+static unsigned long cache_projections;
+static unsigned long cache_misses;
+static unsigned long cache_evictions;
+static unsigned long cache_expirations;
+static unsigned long cache_stale_hits;
+static unsigned long cache_coalesced;
+static unsigned long cache_refreshes;
+
+/**
+ * Builds the cache key of a query. The parts are separated by the NUL
+ * characters, None is the same as "" for the library.
+ *
+ * @param kind		CACHE_SRVS or CACHE_ATTRS.
+ * @param srvtype	The service type or the service URL.
+ * @param scopelist	The scopes.
+ * @param filter	The LDAP filter or the attribute ids.
+ * @param lang		Language of the handle.
+ * @param keylen	Where to store the length of the key.
+ * @return	The malloc()ed key, NULL if out of memory.
+ */
+static char *cache_key(char kind, const char *srvtype,
+		const char *scopelist, const char *filter, const char *lang,
+		size_t *keylen)
+{
+	const char *parts[4];
+	size_t lens[4];
+	char *key;
+	char *p;
+	int i;
+
+	parts[0] = srvtype;
+	parts[1] = scopelist;
+	parts[2] = filter;
+	parts[3] = lang;
+	*keylen = 1;
+	for (i = 0; i < 4; i++) {
+		lens[i] = parts[i] ? strlen(parts[i]) : 0;
+		*keylen += lens[i] + 1;
+	}
+	if (!(p = key = malloc(*keylen)))
+		return NULL;
+	*p++ = kind;
+	for (i = 0; i < 4; i++) {
+		memcpy(p, parts[i] ? parts[i] : "", lens[i]);
+		p += lens[i];
+		*p++ = '\0';
+	}
+
+	return key;
+}
+
+/**
+ * Drops a reference to the cached results.
+ *
+ * @param data	The results returned by cache_get().
+ */
+static void cache_data_unref(cache_data_t *data)
+{
+	int refs;
+
+	pthread_mutex_lock(&cache_lock);
+	refs = --data->refs;
+	pthread_mutex_unlock(&cache_lock);
+	if (!refs) {
+		slp_results_clear(&data->res);
+		free(data);
+	}
+}
+
+/**
+ * Unlinks the entry from the hash chain and the LRU list and frees it. Called
+ * with cache_lock held; the results are freed once the last reader is done.
+ *
+ * @param entry	The entry to remove.
+ */
+static void cache_remove(cache_entry_t *entry)
+{
+	cache_entry_t **pp = &cache_buckets[entry->hash % CACHE_BUCKETS];
+
+	while (*pp != entry)
+		pp = &(*pp)->chain;
+	*pp = entry->chain;
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache_lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache_lru_tail = entry->lru_prev;
+	cache_count--;
+	if (entry->streak)
+		cache_negative_count--;
+	if (!--entry->data->refs) {
+		slp_results_clear(&entry->data->res);
+		free(entry->data);
+	}
+	free(entry->key);
+	free(entry);
+}
+
+/**
+ * Finds the entry of the key. Called with cache_lock held.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @return	The entry or NULL.
+ */
+static cache_entry_t *cache_find(const char *key, size_t keylen,
+		unsigned long hash)
+{
+	cache_entry_t *entry;
+
+	for (entry = cache_buckets[hash % CACHE_BUCKETS]; entry;
+			entry = entry->chain) {
+		if (entry->hash == hash && entry->keylen == keylen &&
+				!memcmp(entry->key, key, keylen))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Drops the negative entries. Called with cache_lock held.
+ */
+static void cache_remove_negative(void)
+{
+	cache_entry_t *entry;
+	cache_entry_t *next;
+
+	for (entry = cache_lru_head; entry && cache_negative_count;
+			entry = next) {
+		next = entry->lru_next;
+		if (entry->streak)
+			cache_remove(entry);
+	}
+}
+
+/**
+ * Looks up the results of a query in the cache. Called with cache_lock held.
+ *
+ * Expired positive entries are served for cache_stale_ttl more seconds (the
+ * caller is expected to refresh them) and dropped afterwards. The expired
+ * negative ones are kept so that the next negative result of the query gets
+ * a longer lifetime. All the negative entries are dropped every
+ * cache_negative_flush_interval seconds.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @param stale		Set to non-zero if the returned results expired.
+ * @return	The results to be released by cache_data_unref(), NULL if there
+ * 			are none.
+ */
+static cache_data_t *cache_get(const char *key, size_t keylen,
+		unsigned long hash, int *stale)
+{
+	cache_entry_t *entry;
+	cache_data_t *data = NULL;
+	double now = slp_monotonic();
+
+	*stale = 0;
+	if (cache_negative_flush_interval > 0 &&
+			now - cache_negative_flushed >= cache_negative_flush_interval) {
+		cache_remove_negative();
+		cache_negative_flushed = now;
+	}
+	if ((entry = cache_find(key, keylen, hash)) && entry->expires <= now) {
+		if (!entry->streak && now < entry->expires + cache_stale_ttl) {
+			*stale = 1;
+		} else {
+			if (!entry->streak)
+				cache_remove(entry);
+			cache_expirations++;
+			entry = NULL;
+		}
+	}
+	if (entry) {
+		if (entry != cache_lru_head) {
+			entry->lru_prev->lru_next = entry->lru_next;
+			if (entry->lru_next)
+				entry->lru_next->lru_prev = entry->lru_prev;
+			else
+				cache_lru_tail = entry->lru_prev;
+			entry->lru_prev = NULL;
+			entry->lru_next = cache_lru_head;
+			cache_lru_head->lru_prev = entry;
+			cache_lru_head = entry;
+		}
+		data = entry->data;
+		data->refs++;
+		cache_hits++;
+		if (entry->streak)
+			cache_negative_hits++;
+		if (*stale)
+			cache_stale_hits++;
+	} else {
+		cache_misses++;
+	}
+
+	return data;
+}
+
+/**
+ * Wraps the results of a query for the cache.
+ *
+ * @param res		The results; taken over and cleared unless empty. The
+ * 					empty results keep their error code.
+ * @param stored	slp_monotonic() time the query started at.
+ * @return	The results with one reference, NULL if out of memory.
+ */
+static cache_data_t *cache_data_new(slp_results_t *res, double stored)
+{
+	cache_data_t *data;
+
+	if (!(data = calloc(1, sizeof(cache_data_t))))
+		return NULL;
+	data->refs = 1;
+	data->stored = stored;
+	if (res->count) {
+		data->res = *res;
+		memset(res, 0, sizeof(slp_results_t));
+	} else {
+		data->res.err = res->err;
+		/* The negative entries count from the end of the query which may
+		 * have taken the whole timeout. */
+		data->stored = slp_monotonic();
+	}
+
+	return data;
+}
+
+/**
+ * Stores the results of a query. The entry expires when the shortest
+ * lifetime of the URLs does (or after cache_max_ttl if set and shorter).
+ * Nothing is stored for the results without any lifetime.
+ *
+ * The negative results (no URLs) are stored only if cache_negative_ttl is
+ * set. Their lifetime doubles with each negative result of the query in a row
+ * up to cache_negative_max_ttl.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param data		The results; the cache takes its own reference.
+ * @return	slp_monotonic() time the entry expires at, 0 if not stored.
+ */
+static double cache_insert(const char *key, size_t keylen, cache_data_t *data)
+{
+	unsigned long hash = cache_hash(key, keylen);
+	const slp_results_t *res = &data->res;
+	cache_entry_t *entry;
+	cache_entry_t *old;
+	double expires;
+	double ttl = 0;
+	size_t i;
+
+	for (i = 0; i < res->count; i++)
+		if (!i || res->items[i].lifetime < ttl)
+			ttl = res->items[i].lifetime;
+	if (cache_max_ttl > 0 && ttl > cache_max_ttl)
+		ttl = cache_max_ttl;
+	if (res->count ? ttl <= 0 : cache_negative_ttl <= 0)
+		return 0;
+
+	if (!(entry = calloc(1, sizeof(cache_entry_t))) ||
+			!(entry->key = malloc(keylen))) {
+		free(entry);
+		return 0;
+	}
+	memcpy(entry->key, key, keylen);
+	entry->keylen = keylen;
+	entry->hash = hash;
+	entry->data = data;
+
+	pthread_mutex_lock(&cache_lock);
+	data->refs++;
+	if ((old = cache_find(key, keylen, hash))) {
+		if (!res->count)
+			entry->streak = old->streak;
+		cache_remove(old);
+	}
+	if (!res->count) {
+		entry->streak++;
+		for (ttl = cache_negative_ttl, i = 1; i < entry->streak &&
+				ttl < cache_negative_max_ttl; i++)
+			ttl *= 2;
+		if (ttl > cache_negative_max_ttl)
+			ttl = cache_negative_max_ttl;
+		cache_negative_count++;
+	}
+	expires = entry->expires = data->stored + ttl;
+	while (cache_count && cache_count >= cache_max_entries) {
+		cache_remove(cache_lru_tail);
+		cache_evictions++;
+	}
+	entry->chain = cache_buckets[hash % CACHE_BUCKETS];
+	cache_buckets[hash % CACHE_BUCKETS] = entry;
+	entry->lru_next = cache_lru_head;
+	if (cache_lru_head)
+		cache_lru_head->lru_prev = entry;
+	else
+		cache_lru_tail = entry;
+	cache_lru_head = entry;
+	cache_count++;
+	pthread_mutex_unlock(&cache_lock);
+
+	return expires;
+}
+
+/**
+ * Finds the query in progress for the key. Called with cache_lock held.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @return	The query or NULL.
+ */
+static cache_flight_t *cache_flight_find(const char *key, size_t keylen)
+{
+	cache_flight_t *flight;
+
+	for (flight = cache_flights; flight; flight = flight->next)
+		if (flight->keylen == keylen && !memcmp(flight->key, key, keylen))
+			return flight;
+
+	return NULL;
+}
+
+/**
+ * Whether the calling thread leads a query in progress, i.e. runs a lookup
+ * from a python callback of its query. Such a thread must not wait for
+ * another query: the leader of that one may be waiting for it in turn.
+ * Called with cache_lock held.
+ */
+static int cache_flight_leading(void)
+{
+	cache_flight_t *flight;
+
+	for (flight = cache_flights; flight; flight = flight->next)
+		if (flight->led && pthread_equal(flight->leader, pthread_self()))
+			return 1;
+
+	return 0;
+}
+
+/**
+ * Registers the query in progress for the key. Called with cache_lock held.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @return	The query with one reference for the caller, NULL if out of
+ * 			memory.
+ */
+static cache_flight_t *cache_flight_new(const char *key, size_t keylen)
+{
+	cache_flight_t *flight;
+
+	if (!(flight = calloc(1, sizeof(cache_flight_t))) ||
+			!(flight->key = malloc(keylen))) {
+		free(flight);
+		return NULL;
+	}
+	memcpy(flight->key, key, keylen);
+	flight->keylen = keylen;
+	flight->refs = 1;
+	flight->next = cache_flights;
+	cache_flights = flight;
+
+	return flight;
+}
+
+/**
+ * Drops a reference to the query. Called with cache_lock held.
+ *
+ * @param flight	The query.
+ */
+static void cache_flight_unref(cache_flight_t *flight)
+{
+	if (--flight->refs)
+		return;
+	if (flight->data && !--flight->data->refs) {
+		slp_results_clear(&flight->data->res);
+		free(flight->data);
+	}
+	free(flight->key);
+	free(flight);
+}
+
+/**
+ * Ends a query registered by cache_flight_new() without results and drops
+ * its reference: the waiting threads run it themselves. Called with
+ * cache_lock held.
+ *
+ * @param flight	The query.
+ */
+static void cache_flight_drop(cache_flight_t *flight)
+{
+	cache_flight_t **pp;
+
+	for (pp = &cache_flights; *pp != flight; pp = &(*pp)->next)
+		;
+	*pp = flight->next;
+	flight->done = 1;
+	pthread_cond_broadcast(&cache_flight_cond);
+	cache_flight_unref(flight);
+}
+
+/**
+ * Publishes the results of the query to the waiting threads and drops the
+ * reference of the query.
+ *
+ * @param flight	The query.
+ * @param data		The results, NULL if the query failed.
+ */
+static void cache_flight_finish(cache_flight_t *flight, cache_data_t *data)
+{
+	cache_flight_t **pp;
+
+	pthread_mutex_lock(&cache_lock);
+	for (pp = &cache_flights; *pp != flight; pp = &(*pp)->next)
+		;
+	*pp = flight->next;
+	if ((flight->data = data))
+		data->refs++;
+	flight->done = 1;
+	pthread_cond_broadcast(&cache_flight_cond);
+	cache_flight_unref(flight);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Shared memory cache.
+ *
+ * A file mapped by all the processes of the host (e.g. the workers of a
+ * prefork server) holds a second level of the discovery cache. The file is a
+ * header followed by fixed size slots; a key goes to one of SHM_PROBES slots
+ * following its hash. The slots are written under a per-slot lock holding the
+ * pid of the writer and read without any lock: the sequence number is odd
+ * while the slot is being written and the readers retry if it changed while
+ * they were reading.
+ *
+ * The processes missing an entry claim its query in the slot: one of them
+ * runs it, the others wait for its results. If the query ends without results
+ * to publish (an error, a zero lifetime, too much data for a slot) the claimer
+ * bumps the released counter of the slot instead: the waiting processes then
+ * run the query themselves, at the same time, instead of claiming it one after
+ * the other. The times are time.time() values so that the file stays
+ * meaningful after a reboot.
+ *
+ * A hit is copied once from the mapping into the private cache of the
+ * process, as the python objects are built from the private entries.
+ *
+ * The snapshots written by cache_save() hold the same records packed one
+ * after the other instead of in slots; cache_load() maps one privately,
+ * indexes its records and restores them on demand.
+ */
+
+#define SHM_MAGIC		0x43504c53	/* "SLPC" */
+#define SHM_VERSION		2
+#define SHM_HEADER_SIZE	64
+#define SHM_PROBES		8
+/* Seconds after which the claim of a query is ignored. */
+#define SHM_CLAIM_TTL	30.0
+/* Interval of polling for the results of a query claimed by another process,
+ * in microseconds. */
+#define SHM_POLL_US		2000
+
+/* shm_claim() results */
+#define SHM_WAIT		0	/* another process runs the query */
+#define SHM_CLAIMED		1	/* the caller runs it and stores its results */
+#define SHM_UNCACHED	2	/* the query ended without results to publish:
+							 * the caller runs it without claiming it */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slot_size;
+} shm_header_t;
+
+/**
+ * Slot of the shared memory cache. Followed by the key and the results: for
+ * each of them the lifetime (2 bytes), the length (4 bytes) and the NUL
+ * terminated string.
+ */
+typedef struct {
+	uint32_t seq;		/* odd while the slot is being written */
+	uint32_t lock;		/* pid of the writer, 0 if none */
+	uint32_t claimer;	/* pid of the process running the query, 0 if none */
+	uint32_t hash;
+	double claimed;		/* time the query was claimed at */
+	double stored;		/* time of the query of the results */
+	double expires;		/* time the entry expires at, 0 if empty */
+	int32_t err;
+	uint32_t keylen;
+	uint32_t count;
+	uint32_t datalen;
+	uint32_t released;	/* bumped when a claim ends without results */
+} shm_slot_t;
+
+#define SHM_ITEM_SIZE	6
+
+#define SNAP_MAGIC		0x53504c53	/* "SLPS" */
+#define SNAP_VERSION	2
+
+/**
+ * Header of a snapshot, followed by its index: the offsets of the records
+ * (0 for none) in a table of slots, by hash with linear probing, which the
+ * lookups use in place once the file is mapped. The records follow.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t slots;		/* size of the index, a power of 2 */
+} snap_header_t;
+
+/**
+ * Record of a snapshot, followed by the key and the results in the layout of
+ * a slot and padded to 8 bytes.
+ */
+typedef struct {
+	uint32_t size;		/* size of the record with its padding */
+	uint32_t hash;
+	double stored;		/* time of the query of the results */
+	double expires;		/* time the entry expires at */
+	int32_t err;
+	uint32_t keylen;
+	uint32_t count;
+	uint32_t datalen;
+	uint32_t restored;	/* set once restored, in the private mapping only */
+} snap_record_t;
+
+/* cache_shm_lock protects the mappings (not their content) */
+static pthread_rwlock_t cache_shm_lock = PTHREAD_RWLOCK_INITIALIZER;
+static shm_header_t * volatile cache_shm;
+static size_t cache_shm_size;
+static char *cache_shm_path;
+static char * volatile cache_snapshot;
+static size_t cache_snapshot_size;
+/* the index of the snapshot, in its mapping */
+static uint64_t *cache_snapshot_index;
+static size_t cache_snapshot_mask;
+static unsigned long cache_shared_hits;
+static unsigned long cache_shared_waits;
+static unsigned long cache_restored;
+
+/**
+ * Returns the slot of a key.
+ *
+ * @param shm	The mapping.
+ * @param hash	cache_hash() of the key.
+ * @param probe	Number of the probe, below SHM_PROBES.
+ * @return	The slot.
+ */
+static shm_slot_t *shm_slot(shm_header_t *shm, unsigned long hash,
+		int probe)
+{
+	return (shm_slot_t *) ((char *) shm + SHM_HEADER_SIZE +
+			(size_t) ((hash + probe) % shm->slots) * shm->slot_size);
+}
+
+/**
+ * Whether the process is gone.
+ */
+static int shm_pid_dead(uint32_t pid)
+{
+	return kill((pid_t) pid, 0) < 0 && errno == ESRCH;
+}
+
+/**
+ * Locks the slot for writing. The lock of a dead process is taken over and
+ * the slot it was writing is emptied.
+ *
+ * @param slot	The slot.
+ */
+static void shm_slot_lock(shm_slot_t *slot)
+{
+	uint32_t pid = (uint32_t) getpid();
+	uint32_t owner;
+	unsigned int spins = 0;
+
+	for (;;) {
+		owner = 0;
+		if (__atomic_compare_exchange_n(&slot->lock, &owner, pid, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		if (++spins % 1024 == 0 && shm_pid_dead(owner) &&
+				__atomic_compare_exchange_n(&slot->lock, &owner, pid, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			if (slot->seq & 1) {
+				slot->keylen = 0;
+				slot->expires = 0;
+				__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+			}
+			return;
+		}
+		sched_yield();
+	}
+}
+
+static void shm_slot_unlock(shm_slot_t *slot)
+{
+	__atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Starts writing the slot: the readers retry until shm_write_end().
+ */
+static void shm_write_begin(shm_slot_t *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_write_end(shm_slot_t *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Empties the slot.
+ */
+static void shm_slot_clear(shm_slot_t *slot)
+{
+	shm_slot_lock(slot);
+	shm_write_begin(slot);
+	slot->keylen = 0;
+	slot->expires = 0;
+	shm_write_end(slot);
+	shm_slot_unlock(slot);
+}
+
+/**
+ * Locks the slot of a key. Called with cache_shm_lock held.
+ *
+ * @param shm		The mapping.
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @param create	Whether to take over a slot if the key has none: an
+ * 					empty one or the one expiring first.
+ * @return	The locked slot, NULL if none.
+ */
+static shm_slot_t *shm_slot_acquire(shm_header_t *shm, const char *key,
+		size_t keylen, unsigned long hash, int create)
+{
+	shm_slot_t *slot;
+	shm_slot_t *victim;
+	uint32_t victim_seq = 0;
+	int tries;
+	int i;
+
+	for (tries = 0; tries < SHM_PROBES; tries++) {
+		victim = NULL;
+		for (i = 0; i < SHM_PROBES; i++) {
+			slot = shm_slot(shm, hash, i);
+			shm_slot_lock(slot);
+			if (slot->keylen == keylen && slot->hash == (uint32_t) hash &&
+					!memcmp(slot + 1, key, keylen))
+				return slot;
+			if (!victim || (victim->keylen && (!slot->keylen ||
+								slot->expires < victim->expires))) {
+				victim = slot;
+				victim_seq = slot->seq;
+			}
+			shm_slot_unlock(slot);
+		}
+		if (!create || keylen > shm->slot_size - sizeof(shm_slot_t))
+			return NULL;
+		/* Another process may have taken the victim meanwhile. */
+		shm_slot_lock(victim);
+		if (victim->seq == victim_seq)
+			break;
+		shm_slot_unlock(victim);
+	}
+	if (tries == SHM_PROBES)
+		return NULL;
+
+	/* Write the key; the entry has no results yet. */
+	shm_write_begin(victim);
+	victim->claimer = 0;
+	victim->hash = (uint32_t) hash;
+	victim->expires = 0;
+	victim->count = victim->datalen = 0;
+	victim->keylen = keylen;
+	memcpy(victim + 1, key, keylen);
+	shm_write_end(victim);
+
+	return victim;
+}
+
+/**
+ * Returns the size of the results in the layout of a slot.
+ */
+static size_t shm_items_size(const slp_results_t *res)
+{
+	size_t size = 0;
+	size_t i;
+
+	for (i = 0; i < res->count; i++)
+		size += SHM_ITEM_SIZE + res->items[i].len + 1;
+
+	return size;
+}
+
+/**
+ * Writes the results in the layout of a slot.
+ *
+ * @param p		Where to write them, shm_items_size() bytes.
+ * @param res	The results.
+ */
+static void shm_items_write(char *p, const slp_results_t *res)
+{
+	uint32_t len;
+	size_t i;
+
+	for (i = 0; i < res->count; i++) {
+		len = res->items[i].len;
+		memcpy(p, &res->items[i].lifetime, 2);
+		memcpy(p + 2, &len, 4);
+		memcpy(p + SHM_ITEM_SIZE, res->items[i].str, len + 1);
+		p += SHM_ITEM_SIZE + len + 1;
+	}
+}
+
+/**
+ * Reads results written by shm_items_write(), checking their bounds.
+ *
+ * @param p			The results.
+ * @param datalen	Their size.
+ * @param count		Their number.
+ * @param res		Where to add them.
+ * @return	RET_OK on success, RET_ERROR if malformed or out of memory.
+ */
+static int shm_items_read(const char *p, size_t datalen, uint32_t count,
+		slp_results_t *res)
+{
+	const char *end = p + datalen;
+	uint32_t len;
+	uint16_t lifetime;
+	uint32_t j;
+
+	for (j = 0; j < count; j++) {
+		if (end - p < SHM_ITEM_SIZE)
+			return RET_ERROR;
+		memcpy(&lifetime, p, 2);
+		memcpy(&len, p + 2, 4);
+		p += SHM_ITEM_SIZE;
+		if ((size_t) (end - p) <= len || p[len] ||
+				slp_results_add(res, p, lifetime) != RET_OK)
+			return RET_ERROR;
+		p += len + 1;
+	}
+
+	return RET_OK;
+}
+
+/**
+ * Writes the results to a locked slot holding their key. The results not
+ * fitting in the slot are not written.
+ *
+ * @param shm		The mapping.
+ * @param slot		The slot.
+ * @param data		The results.
+ * @param expires	slp_monotonic() time the results expire at.
+ * @return	Non-zero if written.
+ */
+static int shm_slot_write(shm_header_t *shm, shm_slot_t *slot,
+		const cache_data_t *data, double expires)
+{
+	size_t size = shm_items_size(&data->res);
+	double now = slp_walltime();
+	double mono = slp_monotonic();
+
+	if (slot->keylen + size > shm->slot_size - sizeof(shm_slot_t))
+		return 0;
+
+	shm_write_begin(slot);
+	slot->stored = now - (mono - data->stored);
+	slot->expires = now + (expires - mono);
+	slot->err = data->res.err;
+	slot->count = data->res.count;
+	slot->datalen = size;
+	shm_items_write((char *) (slot + 1) + slot->keylen, &data->res);
+	shm_write_end(slot);
+
+	return 1;
+}
+
+/**
+ * Reads the unexpired results of a key. Called with cache_shm_lock held.
+ *
+ * @param shm		The mapping.
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @return	The results with one reference, NULL if none.
+ */
+static cache_data_t *shm_read(shm_header_t *shm, const char *key,
+		size_t keylen, unsigned long hash)
+{
+	slp_results_t res = SLP_RESULTS_INIT;
+	cache_data_t *data = NULL;
+	shm_slot_t *slot;
+	uint32_t seq;
+	double stored = 0;
+	double now;
+	int tries;
+	int skip;
+	int i;
+
+	now = slp_walltime();
+	for (i = 0; i < SHM_PROBES && !data; i++) {
+		slot = shm_slot(shm, hash, i);
+		for (tries = 0; tries < 64; tries++) {
+			if ((seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) & 1) {
+				sched_yield();
+				continue;
+			}
+			skip = 0;
+			if (slot->keylen != keylen || slot->hash != (uint32_t) hash ||
+					slot->expires <= now ||
+					slot->keylen + slot->datalen > shm->slot_size -
+					sizeof(shm_slot_t) ||
+					memcmp(slot + 1, key, keylen)) {
+				skip = 1;
+			} else {
+				stored = slot->stored;
+				res.err = slot->err;
+				skip = shm_items_read((const char *) (slot + 1) + keylen,
+						slot->datalen, slot->count, &res) != RET_OK;
+			}
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+				slp_results_clear(&res);
+				continue;
+			}
+			if (!skip)
+				data = cache_data_new(&res, slp_monotonic() - (now - stored));
+			slp_results_clear(&res);
+			break;
+		}
+	}
+
+	return data;
+}
+
+/**
+ * Reads the unexpired results of a key from the shared memory cache.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @return	The results with one reference, NULL if none.
+ */
+static cache_data_t *shm_get(const char *key, size_t keylen,
+		unsigned long hash)
+{
+	cache_data_t *data = NULL;
+
+	pthread_rwlock_rdlock(&cache_shm_lock);
+	if (cache_shm)
+		data = shm_read(cache_shm, key, keylen, hash);
+	pthread_rwlock_unlock(&cache_shm_lock);
+
+	return data;
+}
+
+/**
+ * Claims the query of a key for the calling process.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @param ticket	The released counter of the slot: stored on SHM_WAIT if
+ * 					not waiting yet, compared otherwise.
+ * @param waiting	Whether the caller already got SHM_WAIT for the key.
+ * @return	SHM_CLAIMED if the caller has to run the query (also when there
+ * 			is no shared memory cache), SHM_WAIT if another process runs it,
+ * 			SHM_UNCACHED if that query ended without results to publish.
+ */
+static int shm_claim(const char *key, size_t keylen, unsigned long hash,
+		uint32_t *ticket, int waiting)
+{
+	shm_slot_t *slot;
+	double now = slp_walltime();
+	int ret = SHM_CLAIMED;
+
+	pthread_rwlock_rdlock(&cache_shm_lock);
+	if (cache_shm && (slot = shm_slot_acquire(cache_shm, key, keylen, hash,
+					1))) {
+		if (waiting && slot->released != *ticket) {
+			ret = SHM_UNCACHED;
+		} else if (slot->claimer && now - slot->claimed < SHM_CLAIM_TTL &&
+				!shm_pid_dead(slot->claimer)) {
+			ret = SHM_WAIT;
+			if (!waiting)
+				*ticket = slot->released;
+		} else {
+			slot->claimer = (uint32_t) getpid();
+			slot->claimed = now;
+		}
+		shm_slot_unlock(slot);
+	}
+	pthread_rwlock_unlock(&cache_shm_lock);
+
+	return ret;
+}
+
+/**
+ * Stores the results of a key in the shared memory cache and drops the claim
+ * of the calling process. The results not fitting in a slot are not stored;
+ * the processes waiting for them are told to run the query themselves then.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @param data		The results, NULL to only drop the claim.
+ * @param expires	slp_monotonic() time the results expire at, 0 to only
+ * 					drop the claim.
+ */
+static void shm_store(const char *key, size_t keylen, unsigned long hash,
+		const cache_data_t *data, double expires)
+{
+	shm_slot_t *slot;
+	int written = 0;
+
+	pthread_rwlock_rdlock(&cache_shm_lock);
+	if (!cache_shm || !(slot = shm_slot_acquire(cache_shm, key, keylen, hash,
+					data && expires > 0)))
+		goto out;
+	if (data && expires > 0)
+		written = shm_slot_write(cache_shm, slot, data, expires);
+	if (slot->claimer == (uint32_t) getpid()) {
+		slot->claimer = 0;
+		if (!written)
+			slot->released++;
+	}
+	shm_slot_unlock(slot);
+out:
+	pthread_rwlock_unlock(&cache_shm_lock);
+}
+
+/**
+ * Empties all the slots of the shared memory cache.
+ */
+static void shm_flush(void)
+{
+	uint32_t i;
+
+	pthread_rwlock_rdlock(&cache_shm_lock);
+	for (i = 0; cache_shm && i < cache_shm->slots; i++)
+		shm_slot_clear(shm_slot(cache_shm, i, 0));
+	pthread_rwlock_unlock(&cache_shm_lock);
+}
+
+/**
+ * Whether the header describes a cache file of the given size.
+ */
+static int shm_header_valid(const shm_header_t *header, off_t size)
+{
+	return header->magic == SHM_MAGIC && header->version == SHM_VERSION &&
+		header->slots && header->slot_size > sizeof(shm_slot_t) &&
+		!(header->slot_size % 8) && (size_t) size ==
+		SHM_HEADER_SIZE + (size_t) header->slots * header->slot_size;
+}
+
+/**
+ * Maps the shared memory cache file, creating it if needed. An existing file
+ * keeps its geometry.
+ *
+ * @param path		Path of the file.
+ * @param slots		Number of the slots of a new file.
+ * @param slot_size	Size of the slots of a new file.
+ * @return	0 on success, errno value otherwise (EINVAL for a file which is
+ * 			not a cache).
+ */
+static int shm_attach(const char *path, uint32_t slots, uint32_t slot_size)
+{
+	shm_header_t header;
+	struct stat st;
+	size_t size;
+	void *map;
+	char *copy;
+	int fd;
+	int err = 0;
+
+	if (!(copy = strdup(path)))
+		return ENOMEM;
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+		free(copy);
+		return errno;
+	}
+	/* Only one process initializes the file. */
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+	} else if (!st.st_size) {
+		header.magic = SHM_MAGIC;
+		header.version = SHM_VERSION;
+		header.slots = slots;
+		header.slot_size = slot_size;
+		size = SHM_HEADER_SIZE + (size_t) slots * slot_size;
+		if (ftruncate(fd, size) < 0 ||
+				pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+			err = errno;
+	} else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			!shm_header_valid(&header, st.st_size)) {
+		err = EINVAL;
+	}
+	flock(fd, LOCK_UN);
+	size = SHM_HEADER_SIZE + (size_t) header.slots * header.slot_size;
+	if (!err && (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+					fd, 0)) == MAP_FAILED)
+		err = errno;
+	close(fd);
+	if (err) {
+		free(copy);
+		return err;
+	}
+
+	pthread_rwlock_wrlock(&cache_shm_lock);
+	if (cache_shm)
+		munmap(cache_shm, cache_shm_size);
+	free(cache_shm_path);
+	cache_shm = map;
+	cache_shm_size = size;
+	cache_shm_path = copy;
+	pthread_rwlock_unlock(&cache_shm_lock);
+
+	return 0;
+}
+
+/**
+ * Unmaps the shared memory cache file.
+ */
+static void shm_detach(void)
+{
+	pthread_rwlock_wrlock(&cache_shm_lock);
+	if (cache_shm)
+		munmap(cache_shm, cache_shm_size);
+	free(cache_shm_path);
+	cache_shm = NULL;
+	cache_shm_path = NULL;
+	pthread_rwlock_unlock(&cache_shm_lock);
+}
+
+/* Entry of the cache being saved, see cache_snapshot_save(). */
+typedef struct {
+	char *key;
+	size_t keylen;
+	unsigned long hash;
+	double expires;
+	cache_data_t *data;
+} snap_entry_t;
+
+/**
+ * Returns the size of the record of an entry in a snapshot, with its padding.
+ *
+ * @param entry	The entry.
+ */
+static size_t cache_snapshot_record_size(const snap_entry_t *entry)
+{
+	size_t need = sizeof(snap_record_t) + entry->keylen +
+		shm_items_size(&entry->data->res);
+
+	return (need + 7) & ~(size_t) 7;
+}
+
+/**
+ * Writes one record of a snapshot.
+ *
+ * @param file	The snapshot file.
+ * @param entry	The entry.
+ * @param buf	Buffer of the record, grown as needed.
+ * @param size	Size of the buffer.
+ * @return	0 on success, errno value otherwise.
+ */
+static int cache_snapshot_write(FILE *file, const snap_entry_t *entry,
+		char **buf, size_t *size)
+{
+	snap_record_t *rec;
+	size_t datalen = shm_items_size(&entry->data->res);
+	size_t need = cache_snapshot_record_size(entry);
+	double now = slp_walltime();
+	double mono = slp_monotonic();
+	char *p;
+
+	if (need > *size) {
+		if (!(p = realloc(*buf, need)))
+			return ENOMEM;
+		*buf = p;
+		*size = need;
+	}
+	memset(*buf, 0, need);
+	rec = (snap_record_t *) *buf;
+	rec->size = need;
+	rec->hash = (uint32_t) entry->hash;
+	rec->stored = now - (mono - entry->data->stored);
+	rec->expires = now + (entry->expires - mono);
+	rec->err = entry->data->res.err;
+	rec->keylen = entry->keylen;
+	rec->count = entry->data->res.count;
+	rec->datalen = datalen;
+	memcpy(rec + 1, entry->key, entry->keylen);
+	shm_items_write((char *) (rec + 1) + entry->keylen, &entry->data->res);
+	if (fwrite(*buf, need, 1, file) != 1)
+		return errno ? errno : EIO;
+
+	return 0;
+}
+
+/**
+ * Writes the unexpired entries of the cache to a snapshot file, one record
+ * per entry after the index of the records. The entries are only referenced
+ * under cache_lock; the file is written without holding it and replaced
+ * atomically.
+ *
+ * @param path	Path of the file.
+ * @param saved	Where to store the number of the saved entries.
+ * @return	0 on success, errno value otherwise.
+ */
+static int cache_snapshot_save(const char *path, size_t *saved)
+{
+	snap_header_t header;
+	snap_entry_t *entries = NULL;
+	cache_entry_t *entry;
+	uint64_t *index = NULL;
+	uint64_t off;
+	size_t slots;
+	size_t slot;
+	size_t need;
+	size_t count = 0;
+	size_t n = 0;
+	size_t size = 0;
+	size_t i;
+	double now = slp_monotonic();
+	char *buf = NULL;
+	char *tmp;
+	FILE *file = NULL;
+	int fd;
+	int err = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	for (entry = cache_lru_head; entry; entry = entry->lru_next)
+		if (entry->expires > now)
+			count++;
+	if (count && !(entries = calloc(count, sizeof(snap_entry_t))))
+		err = ENOMEM;
+	for (entry = cache_lru_head; entry && !err; entry = entry->lru_next) {
+		if (entry->expires <= now)
+			continue;
+		if (!(entries[n].key = malloc(entry->keylen))) {
+			err = ENOMEM;
+			break;
+		}
+		memcpy(entries[n].key, entry->key, entry->keylen);
+		entries[n].keylen = entry->keylen;
+		entries[n].hash = entry->hash;
+		entries[n].expires = entry->expires;
+		entries[n].data = entry->data;
+		entry->data->refs++;
+		n++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	/* Keep the index at most half full. */
+	for (slots = 16; slots < 2 * n; slots *= 2)
+		;
+	if (!err && (slots > UINT32_MAX ||
+				!(index = calloc(slots, sizeof(uint64_t)))))
+		err = ENOMEM;
+	off = sizeof(header) + slots * sizeof(uint64_t);
+	for (i = 0; i < n && !err; i++) {
+		for (slot = (uint32_t) entries[i].hash & (slots - 1); index[slot];
+				slot = (slot + 1) & (slots - 1))
+			;
+		index[slot] = off;
+		if ((need = cache_snapshot_record_size(&entries[i])) > UINT32_MAX)
+			err = EFBIG;
+		off += need;
+	}
+
+	if (!err && !(tmp = malloc(strlen(path) + 8)))
+		err = ENOMEM;
+	if (!err) {
+		sprintf(tmp, "%s.XXXXXX", path);
+		if ((fd = mkstemp(tmp)) < 0) {
+			err = errno;
+		} else if (!(file = fdopen(fd, "wb"))) {
+			err = errno;
+			close(fd);
+		}
+		if (file) {
+			memset(&header, 0, sizeof(header));
+			header.magic = SNAP_MAGIC;
+			header.version = SNAP_VERSION;
+			header.count = n;
+			header.slots = slots;
+			if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+					fwrite(index, sizeof(uint64_t), slots, file) != slots)
+				err = errno ? errno : EIO;
+			for (i = 0; i < n && !err; i++)
+				err = cache_snapshot_write(file, &entries[i], &buf, &size);
+			if (!err && (fflush(file) || fsync(fileno(file)) < 0))
+				err = errno ? errno : EIO;
+			if (fclose(file) && !err)
+				err = errno ? errno : EIO;
+			if (!err && rename(tmp, path) < 0)
+				err = errno;
+			if (err)
+				unlink(tmp);
+		}
+		free(tmp);
+	}
+	*saved = err ? 0 : n;
+
+	free(index);
+	free(buf);
+	for (i = 0; i < n; i++) {
+		free(entries[i].key);
+		cache_data_unref(entries[i].data);
+	}
+	free(entries);
+
+	return err;
+}
+
+/**
+ * Maps a snapshot file written by cache_snapshot_save(). Only the header is
+ * checked: the lookups use the index of the file in place and check each
+ * record they reach, so that loading takes the same time whatever the size
+ * of the snapshot. The mapping is private: the restored records are marked in
+ * it without touching the file.
+ *
+ * @param path	Path of the file, NULL to unmap the current snapshot.
+ * @return	0 on success, errno value otherwise (EINVAL for a file which is
+ * 			not a snapshot).
+ */
+static int cache_snapshot_load(const char *path)
+{
+	snap_header_t header;
+	struct stat st;
+	size_t old_size;
+	char *old;
+	void *map = NULL;
+	int fd;
+	int err = 0;
+
+	if (path) {
+		if ((fd = open(path, O_RDONLY)) < 0)
+			return errno;
+		if (fstat(fd, &st) < 0)
+			err = errno;
+		else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+				header.magic != SNAP_MAGIC ||
+				header.version != SNAP_VERSION || !header.slots ||
+				(header.slots & (header.slots - 1)) ||
+				header.slots > ((size_t) st.st_size - sizeof(header)) /
+				sizeof(uint64_t))
+			err = EINVAL;
+		else if ((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+			err = errno;
+		close(fd);
+		if (err)
+			return err;
+	}
+
+	pthread_rwlock_wrlock(&cache_shm_lock);
+	old = cache_snapshot;
+	old_size = cache_snapshot_size;
+	cache_snapshot = map;
+	cache_snapshot_size = map ? (size_t) st.st_size : 0;
+	cache_snapshot_index = map ? (uint64_t *) ((char *) map +
+			sizeof(header)) : NULL;
+	cache_snapshot_mask = map ? header.slots - 1 : 0;
+	pthread_rwlock_unlock(&cache_shm_lock);
+	if (old)
+		munmap(old, old_size);
+
+	return 0;
+}
+
+/**
+ * Returns the record of the loaded snapshot at an offset taken from its
+ * index, if the offset and the record are within the file. Called with
+ * cache_shm_lock held.
+ *
+ * @param off	The offset.
+ * @return	The record, NULL if it is corrupted.
+ */
+static snap_record_t *cache_snapshot_record(uint64_t off)
+{
+	snap_record_t *rec;
+	size_t first = sizeof(snap_header_t) +
+		(cache_snapshot_mask + 1) * sizeof(uint64_t);
+
+	if (off % 8 || off < first || off > cache_snapshot_size ||
+			cache_snapshot_size - off < sizeof(snap_record_t))
+		return NULL;
+	rec = (snap_record_t *) (cache_snapshot + off);
+	if (rec->size % 8 || rec->size > cache_snapshot_size - off ||
+			sizeof(snap_record_t) + (size_t) rec->keylen + rec->datalen >
+			rec->size)
+		return NULL;
+
+	return rec;
+}
+
+/**
+ * Takes the unexpired results of a key out of the loaded snapshot: each
+ * record is taken once. Called with cache_shm_lock held.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @return	The results with one reference, NULL if none.
+ */
+static cache_data_t *cache_snapshot_take(const char *key, size_t keylen,
+		unsigned long hash)
+{
+	slp_results_t res = SLP_RESULTS_INIT;
+	cache_data_t *data = NULL;
+	snap_record_t *rec;
+	size_t slot;
+	size_t probes;
+	double now = slp_walltime();
+
+	/* The probes are bounded: the index of a damaged file may be full. */
+	for (slot = (uint32_t) hash & cache_snapshot_mask, probes = 0;
+			probes <= cache_snapshot_mask && cache_snapshot_index[slot];
+			slot = (slot + 1) & cache_snapshot_mask, probes++) {
+		if (!(rec = cache_snapshot_record(cache_snapshot_index[slot])) ||
+				rec->hash != (uint32_t) hash || rec->keylen != keylen ||
+				memcmp(rec + 1, key, keylen))
+			continue;
+		if (rec->expires <= now ||
+				__atomic_exchange_n(&rec->restored, 1, __ATOMIC_ACQ_REL))
+			continue;
+		res.err = rec->err;
+		if (shm_items_read((const char *) (rec + 1) + keylen, rec->datalen,
+					rec->count, &res) == RET_OK)
+			data = cache_data_new(&res, slp_monotonic() -
+					(now - rec->stored));
+		slp_results_clear(&res);
+		break;
+	}
+
+	return data;
+}
+
+/**
+ * Looks up the results of a key in the shared memory cache and copies them to
+ * the local cache. Does not need the GIL.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @return	The results to be released by cache_data_unref(), NULL if none.
+ */
+static cache_data_t *cache_shm_get(const char *key, size_t keylen,
+		unsigned long hash)
+{
+	cache_data_t *data;
+
+	if (!cache_shm || !(data = shm_get(key, keylen, hash)))
+		return NULL;
+	cache_insert(key, keylen, data);
+	pthread_mutex_lock(&cache_lock);
+	cache_shared_hits++;
+	pthread_mutex_unlock(&cache_lock);
+
+	return data;
+}
+
+/**
+ * Waits for the results of a key in the shared memory cache while another
+ * process runs its query. Does not need the GIL.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @return	The results to be released by cache_data_unref(), NULL if the
+ * 			caller has to run the query: it claimed it, or the query of the
+ * 			other process ended without results to share.
+ */
+static cache_data_t *cache_shm_wait(const char *key, size_t keylen,
+		unsigned long hash)
+{
+	cache_data_t *data;
+	uint32_t ticket = 0;
+	int waited = 0;
+
+	for (;;) {
+		if ((data = cache_shm_get(key, keylen, hash)) ||
+				shm_claim(key, keylen, hash, &ticket, waited) != SHM_WAIT)
+			break;
+		if (!waited++) {
+			pthread_mutex_lock(&cache_lock);
+			cache_shared_waits++;
+			pthread_mutex_unlock(&cache_lock);
+		}
+		usleep(SHM_POLL_US);
+	}
+
+	return data;
+}
+
+/**
+ * Stores the results of a query if they are worth caching: the complete
+ * results (possibly empty) and the queries timed out without any result.
+ * Passes them to the threads waiting for the query.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param err		Return value of the libslp call.
+ * @param res		The gathered results, see cache_data_new().
+ * @param start		slp_monotonic() time the query started at.
+ * @param flight	The query registered by cache_lookup(), may be NULL.
+ */
+static void cache_store(const char *key, size_t keylen, SLPError err,
+		slp_results_t *res, double start, cache_flight_t *flight)
+{
+	slp_results_t timeout = SLP_RESULTS_INIT;
+	cache_data_t *data = NULL;
+	double expires = 0;
+
+	if (err == SLP_OK && res->err == SLP_OK && res->complete) {
+		data = cache_data_new(res, start);
+	} else if (!res->count && (err == SLP_NETWORK_TIMED_OUT ||
+				res->err == SLP_NETWORK_TIMED_OUT)) {
+		timeout.err = SLP_NETWORK_TIMED_OUT;
+		data = cache_data_new(&timeout, start);
+	}
+	if (data)
+		expires = cache_insert(key, keylen, data);
+	if (cache_shm)
+		shm_store(key, keylen, cache_hash(key, keylen), data, expires);
+	if (flight)
+		cache_flight_finish(flight, data);
+	if (data)
+		cache_data_unref(data);
+}
+
+static pthread_once_t cache_hooks_once = PTHREAD_ONCE_INIT;
+
+/**
+ * pthread_atfork() handler keeping the cache locks consistent across fork(),
+ * e.g. in the workers of a prefork server.
+ */
+static void cache_fork_prepare(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	pthread_rwlock_wrlock(&cache_shm_lock);
+}
+
+/**
+ * pthread_atfork() handler of the parent process.
+ */
+static void cache_fork_parent(void)
+{
+	pthread_rwlock_unlock(&cache_shm_lock);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * pthread_atfork() handler of the child process. The queries in progress are
+ * run by the threads of the parent, which the child does not have: the child
+ * forgets them (leaking them) so that its queries do not wait for them.
+ */
+static void cache_fork_child(void)
+{
+	cache_flights = NULL;
+	/* The write lock belongs to the thread id of the parent. */
+	pthread_rwlock_init(&cache_shm_lock, NULL);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Installs the fork hooks of the cache, once per process.
+ */
+static void cache_hooks_install(void)
+{
+	pthread_atfork(cache_fork_prepare, cache_fork_parent, cache_fork_child);
+}
+
+/**
+ * Drops the cache entries.
+ *
+ * @param negative_only	Drop only the negative entries.
+ */
+static void cache_flush(int negative_only)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (negative_only)
+		cache_remove_negative();
+	else
+		while (cache_lru_head)
+			cache_remove(cache_lru_head);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Remaining lifetime of a cached URL.
+ *
+ * @param data	The cached results.
+ * @param i		Index of the URL.
+ * @param now	slp_monotonic() time.
+ * @return	The lifetime reduced by the age of the results.
+ */
+static unsigned short cache_lifetime(const cache_data_t *data, size_t i,
+		double now)
+{
+	double left = data->res.items[i].lifetime - (now - data->stored);
+
+	return left > 0 ? (unsigned short) (left + 0.5) : 0;
+}
+
+/**
+ * SLPFindSrvs() callback copying the results for the cache before passing
+ * them to the python callback, see srv_url_cb() and batch_url_cb().
+ *
+ * @param hslp 		The SLPHandle used for the query.
+ * @param srvurl 	The URL of the found service.
+ * @param lifetime 	The lifetime of the service in seconds.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	cb_cookie_t with the record results set.
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data.
+ */
+static SLPBoolean record_url_cb(SLPHandle hslp, const char* srvurl,
+		unsigned short lifetime, SLPError errcode, void* cookie)
+{
+	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
+
+	collect_url_cb(hslp, srvurl, lifetime, errcode, cb_data->record);
+
+	return cb_data->batch_size ?
+		batch_url_cb(hslp, srvurl, lifetime, errcode, cookie) :
+		srv_url_cb(hslp, srvurl, lifetime, errcode, cookie);
+}
+
+/**
+ * Passes the cached results to the python callback the same way the library
+ * would. The callback runs with the GIL held by the caller.
+ *
+ * @param data		The cached results.
+ * @param cookie	cb_cookie_t of the python callback; freed.
+ */
+static void cache_replay(const cache_data_t *data, cb_cookie_t *cookie)
+{
+	SLPSrvURLCallback *cb = cookie->batch_size ? batch_url_cb : srv_url_cb;
+	double now = slp_monotonic();
+	size_t i;
+
+	for (i = 0; i < data->res.count; i++)
+		if (!cb(NULL, data->res.items[i].str, cache_lifetime(data, i, now),
+					SLP_OK, cookie))
+			return;
+	cb(NULL, NULL, 0, data->res.err != SLP_OK ? data->res.err : SLP_LAST_CALL,
+			cookie);
+}
+
+/**
+ * Copies the cached results without the duplicate URLs, for the queries asking
+ * for the merged replies while the cache holds the raw ones.
+ *
+ * @param data	The cached results.
+ * @param copy	Where to copy them; its results are to be released by
+ * 				slp_results_clear().
+ * @return	RET_OK on success, RET_ERROR if out of memory.
+ */
+static int cache_data_dedupe(const cache_data_t *data, cache_data_t *copy)
+{
+	memset(copy, 0, sizeof(cache_data_t));
+	copy->refs = 1;
+	copy->stored = data->stored;
+	if (slp_results_dedupe(&data->res, &copy->res) != RET_OK) {
+		slp_results_clear(&copy->res);
+		return RET_ERROR;
+	}
+
+	return RET_OK;
+}
+
+/**
+ * Converts the cached results to the list of (url, lifetime) tuples.
+ *
+ * @param data	The cached results.
+ * @return	The list, NULL + exception raised on error or for a cached
+ * 			timeout.
+ */
+static PyObject *cache_to_list(const cache_data_t *data)
+{
+	double now = slp_monotonic();
+	PyObject *list;
+	PyObject *item;
+	size_t i;
+
+	if (data->res.err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(data->res.err));
+		return NULL;
+	}
+	if (!(list = PyList_New(data->res.count)))
+		return NULL;
+	for (i = 0; i < data->res.count; i++) {
+		if (!(item = Py_BuildValue("(s#i)", data->res.items[i].str,
+						(Py_ssize_t) data->res.items[i].len,
+						cache_lifetime(data, i, now)))) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+
+	return list;
+}
+
+/**
+ * Sets the lifetime of the gathered attribute lists to the remaining lifetime
+ * of the service URL so that the cache entry expires with the URL. The
+ * lifetime is looked up in the cached SLPFindSrvs() results; cache_attr_ttl
+ * is used for the URLs not found there.
+ *
+ * @param res		The attribute lists.
+ * @param srvurl	The service URL.
+ */
+static void cache_attr_lifetime(slp_results_t *res, const char *srvurl)
+{
+	double now = slp_monotonic();
+	double expires = 0;
+	double left;
+	cache_entry_t *entry;
+	cache_data_t *data;
+	size_t i;
+
+	pthread_mutex_lock(&cache_lock);
+	for (entry = cache_lru_head; entry; entry = entry->lru_next) {
+		if (entry->key[0] != CACHE_SRVS)
+			continue;
+		data = entry->data;
+		for (i = 0; i < data->res.count; i++)
+			if (!strcmp(data->res.items[i].str, srvurl) &&
+					data->stored + data->res.items[i].lifetime > expires)
+				expires = data->stored + data->res.items[i].lifetime;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	left = expires ? expires - now : cache_attr_ttl;
+	if (left > 65535)
+		left = 65535;
+	for (i = 0; i < res->count; i++)
+		res->items[i].lifetime = left > 0 ? (unsigned short) left : 0;
+}
+
+/**
+ * Matches the attribute tag against an attribute id pattern, case
+ * insensitively. The pattern may contain the '*' wildcards (RFC 2608).
+ *
+ * @param pat		The attribute id.
+ * @param patlen	Length of the attribute id.
+ * @param tag		The attribute tag.
+ * @param taglen	Length of the tag.
+ * @return	Non-zero if the tag matches.
+ */
+static int attr_tag_match(const char *pat, size_t patlen, const char *tag,
+		size_t taglen)
+{
+	size_t p = 0, t = 0;
+	size_t star_p = (size_t) -1, star_t = 0;
+
+	while (t < taglen) {
+		if (p < patlen && pat[p] == '*') {
+			star_p = p++;
+			star_t = t;
+		} else if (p < patlen && tolower((unsigned char) pat[p]) ==
+				tolower((unsigned char) tag[t])) {
+			p++;
+			t++;
+		} else if (star_p != (size_t) -1) {
+			p = star_p + 1;
+			t = ++star_t;
+		} else {
+			return 0;
+		}
+	}
+	while (p < patlen && pat[p] == '*')
+		p++;
+
+	return p == patlen;
+}
+
+/**
+ * Tells whether the attribute tag is one of the requested attribute ids.
+ *
+ * @param attrids	Comma separated list of the attribute ids.
+ * @param tag		The attribute tag.
+ * @param taglen	Length of the tag.
+ * @return	Non-zero if the attribute was requested.
+ */
+static int attr_requested(const char *attrids, const char *tag, size_t taglen)
+{
+	const char *id = attrids;
+	const char *end;
+	size_t len;
+
+	while (*id) {
+		while (isspace((unsigned char) *id))
+			id++;
+		end = strchr(id, ',');
+		len = end ? (size_t) (end - id) : strlen(id);
+		while (len && isspace((unsigned char) id[len - 1]))
+			len--;
+		if (len && attr_tag_match(id, len, tag, taglen))
+			return 1;
+		if (!end)
+			break;
+		id = end + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Splits the next attribute off an attribute list in the SLP wire format:
+ * "(tag=value,...),(tag=value),keyword".
+ *
+ * @param list		The rest of the list; moved past the attribute.
+ * @param len		Where to store the length of the attribute.
+ * @param tag		Where to store the tag of the attribute.
+ * @param taglen	Where to store the length of the tag, 0 if none.
+ * @return	The attribute, NULL at the end of the list.
+ */
+static const char *attr_next(const char **list, size_t *len,
+		const char **tag, size_t *taglen)
+{
+	const char *item = *list;
+	const char *end;
+
+	if (!*item)
+		return NULL;
+	/* Values may contain commas only inside the parentheses. */
+	end = item;
+	if (*end == '(')
+		while (*end && *end != ')')
+			end++;
+	while (*end && *end != ',')
+		end++;
+
+	*tag = item;
+	while (*tag < end && (isspace((unsigned char) **tag) || **tag == '('))
+		(*tag)++;
+	for (*taglen = 0; *tag + *taglen < end && (*tag)[*taglen] != '=' &&
+			(*tag)[*taglen] != ')'; (*taglen)++)
+		;
+	while (*taglen && isspace((unsigned char) (*tag)[*taglen - 1]))
+		(*taglen)--;
+	*len = end - item;
+	*list = *end ? end + 1 : end;
+
+	return item;
+}
+
+/**
+ * Selects the requested attributes from an attribute list in the SLP wire
+ * format, see attr_next().
+ *
+ * @param attrs		The full attribute list.
+ * @param attrids	Comma separated list of the attribute ids.
+ * @param requested	Whether to keep the requested attributes or the other
+ * 					ones.
+ * @return	The malloc()ed list of the selected attributes in the original
+ * 			order (may be ""), NULL if out of memory.
+ */
+static char *attr_project(const char *attrs, const char *attrids,
+		int requested)
+{
+	const char *item;
+	const char *tag;
+	size_t itemlen;
+	size_t taglen;
+	size_t len = 0;
+	char *ret;
+
+	if (!(ret = malloc(strlen(attrs) + 1)))
+		return NULL;
+	while ((item = attr_next(&attrs, &itemlen, &tag, &taglen))) {
+		if (taglen && !attr_requested(attrids, tag, taglen) == !requested) {
+			if (len)
+				ret[len++] = ',';
+			memcpy(ret + len, item, itemlen);
+			len += itemlen;
+		}
+	}
+	ret[len] = '\0';
+
+	return ret;
+}
+
+/**
+ * Finds the attribute of the given tag in an attribute list, case
+ * insensitively.
+ *
+ * @param list		The attribute list.
+ * @param tag		The attribute tag.
+ * @param taglen	Length of the tag.
+ * @param len		Where to store the length of the found attribute.
+ * @return	The attribute, NULL if not found.
+ */
+static const char *attr_find(const char *list, const char *tag,
+		size_t taglen, size_t *len)
+{
+	const char *item;
+	const char *t;
+	size_t tl;
+
+	while ((item = attr_next(&list, len, &t, &tl)))
+		if (tl == taglen && attr_tag_match(tag, taglen, t, tl))
+			return item;
+
+	return NULL;
+}
+
+/**
+ * Appends a string to a comma separated list.
+ *
+ * @param buf	The list, large enough.
+ * @param len	Length of the list; updated.
+ * @param str	The string.
+ * @param n		Length of the string.
+ */
+static void attr_append(char *buf, size_t *len, const char *str, size_t n)
+{
+	if (*len)
+		buf[(*len)++] = ',';
+	memcpy(buf + *len, str, n);
+	*len += n;
+	buf[*len] = '\0';
+}
+
+/**
+ * Computes the change between two attribute lists.
+ *
+ * @param old	The registered attribute list.
+ * @param new	The wanted attribute list.
+ * @param add	Where to store the malloc()ed list of the new and changed
+ * 				attributes (may be "").
+ * @param del	Where to store the malloc()ed list of the tags of the removed
+ * 				attributes (may be "").
+ * @return	RET_OK on success, RET_ERROR if out of memory.
+ */
+static int attr_diff(const char *old, const char *new, char **add, char **del)
+{
+	const char *list;
+	const char *item;
+	const char *tag;
+	const char *found;
+	size_t len;
+	size_t taglen;
+	size_t foundlen;
+	size_t addlen = 0;
+	size_t dellen = 0;
+
+	*add = malloc(strlen(new) + 1);
+	*del = malloc(strlen(old) + 1);
+	if (!*add || !*del) {
+		free(*add);
+		free(*del);
+		return RET_ERROR;
+	}
+	**add = **del = '\0';
+	for (list = new; (item = attr_next(&list, &len, &tag, &taglen)); ) {
+		if (!taglen || ((found = attr_find(old, tag, taglen, &foundlen)) &&
+					foundlen == len && !memcmp(found, item, len)))
+			continue;
+		attr_append(*add, &addlen, item, len);
+	}
+	for (list = old; (item = attr_next(&list, &len, &tag, &taglen)); )
+		if (taglen && !attr_find(new, tag, taglen, &foundlen))
+			attr_append(*del, &dellen, tag, taglen);
+
+	return RET_OK;
+}
+
+/**
+ * Applies an incremental registration and an attribute deletion to an
+ * attribute list.
+ *
+ * @param old	The registered attribute list.
+ * @param add	The attributes added or replaced, may be NULL.
+ * @param del	The attribute ids deleted (wildcards allowed), may be NULL.
+ * @return	The malloc()ed attribute list, NULL if out of memory.
+ */
+static char *attr_merge(const char *old, const char *add, const char *del)
+{
+	const char *list;
+	const char *item;
+	const char *tag;
+	size_t len;
+	size_t taglen;
+	size_t foundlen;
+	size_t retlen = 0;
+	char *ret;
+
+	if (!add)
+		add = "";
+	if (!(ret = malloc(strlen(old) + strlen(add) + 2)))
+		return NULL;
+	*ret = '\0';
+	for (list = old; (item = attr_next(&list, &len, &tag, &taglen)); )
+		if (taglen && !attr_find(add, tag, taglen, &foundlen) &&
+				!(del && attr_requested(del, tag, taglen)))
+			attr_append(ret, &retlen, item, len);
+	for (list = add; (item = attr_next(&list, &len, &tag, &taglen)); )
+		if (taglen)
+			attr_append(ret, &retlen, item, len);
+
+	return ret;
+}
+
+/**
+ * SLPFindAttrs() callback copying the attribute lists for the cache before
+ * passing them to the python callback, see record_url_cb().
+ *
+ * @param hslp 		The SLPHandle used for the query.
+ * @param values	The attribute list.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	cb_cookie_t with the record results set.
+ * @return	SLPBoolean value indicating if the callback wants to process more
+ * 			data.
+ */
+static SLPBoolean record_attr_cb(SLPHandle hslp, const char* values,
+		SLPError errcode, void* cookie)
+{
+	cb_cookie_t *cb_data = (cb_cookie_t *) cookie;
+
+	collect_str_cb(hslp, values, errcode, cb_data->record);
+
+	return cb_data->batch_size ?
+		batch_attr_cb(hslp, values, errcode, cookie) :
+		srv_attr_type_cb(hslp, values, errcode, cookie);
+}
+
+/**
+ * Passes the cached attribute lists to the python callback the same way the
+ * library would, see cache_replay().
+ *
+ * @param data		The cached full attribute lists.
+ * @param attrids	The requested attribute ids, None or "" for all.
+ * @param cookie	cb_cookie_t of the python callback; freed.
+ */
+static void cache_replay_attrs(const cache_data_t *data, const char *attrids,
+		cb_cookie_t *cookie)
+{
+	SLPAttrCallback *cb = cookie->batch_size ? batch_attr_cb :
+		srv_attr_type_cb;
+	SLPBoolean more;
+	char *attrs;
+	size_t i;
+
+	if (attrids && *attrids)
+		cache_projections++;
+	for (i = 0; i < data->res.count; i++) {
+		if (!attrids || !*attrids) {
+			more = cb(NULL, data->res.items[i].str, SLP_OK, cookie);
+		} else if (!(attrs = attr_project(data->res.items[i].str, attrids,
+						1))) {
+			cb(NULL, NULL, SLP_MEMORY_ALLOC_FAILED, cookie);
+			return;
+		} else {
+			more = !*attrs || cb(NULL, attrs, SLP_OK, cookie);
+			free(attrs);
+		}
+		if (!more)
+			return;
+	}
+	cb(NULL, NULL, data->res.err != SLP_OK ? data->res.err : SLP_LAST_CALL,
+			cookie);
+}
+
+/**
+ * Converts the cached attribute lists to the list of the strings.
+ *
+ * @param data		The cached full attribute lists.
+ * @param attrids	The requested attribute ids, None or "" for all.
+ * @return	The list, NULL + exception raised on error or for a cached
+ * 			timeout.
+ */
+static PyObject *cache_attrs_to_list(const cache_data_t *data,
+		const char *attrids)
+{
+	PyObject *list;
+	PyObject *item;
+	char *attrs;
+	size_t i;
+
+	if (data->res.err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(data->res.err));
+		return NULL;
+	}
+	if (attrids && *attrids)
+		cache_projections++;
+	if (!(list = PyList_New(0)))
+		return NULL;
+	for (i = 0; i < data->res.count; i++) {
+		if (!attrids || !*attrids) {
+			item = slp_string(data->res.items[i].str,
+					data->res.items[i].len);
+		} else if ((attrs = attr_project(data->res.items[i].str, attrids,
+						1))) {
+			item = *attrs ? slp_string(attrs, -1) : NULL;
+			free(attrs);
+			if (!item)
+				continue;
+		} else {
+			item = PyErr_NoMemory();
+		}
+		if (!item || PyList_Append(list, item)) {
+			Py_XDECREF(item);
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+
+	return list;
+}
+
+/**
+ * Background refresh of a stale cache entry. Runs the query of the key on its
+ * own SLP handle, without the GIL.
+ *
+ * @param arg	The cache_flight_t registered for the key.
+ * @return	NULL.
+ */
+static void *cache_refresh_thread(void *arg)
+{
+	cache_flight_t *flight = (cache_flight_t *) arg;
+	slp_results_t res = SLP_RESULTS_INIT;
+	const char *parts[4];
+	const char *p = flight->key + 1;
+	double start = slp_monotonic();
+	SLPHandle hslp;
+	SLPError err;
+	int i;
+
+	/* The key is the kind followed by the NUL terminated parts. */
+	for (i = 0; i < 4; i++) {
+		parts[i] = p;
+		p += strlen(p) + 1;
+	}
+	if ((err = SLPOpen(*parts[3] ? parts[3] : NULL, SLP_FALSE, &hslp)) ==
+			SLP_OK) {
+		if (flight->key[0] == CACHE_SRVS)
+			err = SLPFindSrvs(hslp, parts[0], parts[1], parts[2],
+					collect_url_cb, (void *)&res);
+		else
+			err = SLPFindAttrs(hslp, parts[0], parts[1], "",
+					collect_str_cb, (void *)&res);
+		SLPClose(hslp);
+	}
+	if (flight->key[0] == CACHE_ATTRS)
+		cache_attr_lifetime(&res, parts[0]);
+	cache_store(flight->key, flight->keylen, err, &res, start, flight);
+	slp_results_clear(&res);
+
+	return NULL;
+}
+
+/**
+ * Starts the background refresh of a key unless one is in progress, in this
+ * process or (with a shared memory cache) in another one. Called with
+ * cache_lock held.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ */
+static void cache_refresh_start(const char *key, size_t keylen,
+		unsigned long hash)
+{
+	cache_flight_t *refresh;
+	pthread_t thread;
+	uint32_t ticket;
+	int claimed = SHM_CLAIMED;
+
+	if (cache_flight_find(key, keylen) ||
+			!(refresh = cache_flight_new(key, keylen)))
+		return;
+	if (cache_shm) {
+		/* The slot may be locked by another process for a while: not with
+		 * cache_lock held. The flight keeps the other threads away. */
+		pthread_mutex_unlock(&cache_lock);
+		claimed = shm_claim(key, keylen, hash, &ticket, 0);
+		pthread_mutex_lock(&cache_lock);
+	}
+	if (claimed != SHM_CLAIMED) {
+		cache_flight_drop(refresh);
+		return;
+	}
+	if (pthread_create(&thread, NULL, cache_refresh_thread, refresh)) {
+		/* Try again next time. */
+		cache_flight_drop(refresh);
+		pthread_mutex_unlock(&cache_lock);
+		shm_store(key, keylen, hash, NULL, 0);
+		pthread_mutex_lock(&cache_lock);
+	} else {
+		pthread_detach(thread);
+		cache_refreshes++;
+	}
+}
+
+/**
+ * Restores the unexpired results of a key from the snapshot loaded by
+ * cache_load() into the cache and starts their background refresh. Each
+ * entry of the snapshot is restored once. Does not need the GIL.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param hash		cache_hash() of the key.
+ * @return	The results to be released by cache_data_unref(), NULL if none.
+ */
+static cache_data_t *cache_snapshot_get(const char *key, size_t keylen,
+		unsigned long hash)
+{
+	cache_data_t *data = NULL;
+
+	pthread_rwlock_rdlock(&cache_shm_lock);
+	if (cache_snapshot)
+		data = cache_snapshot_take(key, keylen, hash);
+	pthread_rwlock_unlock(&cache_shm_lock);
+	if (!data)
+		return NULL;
+
+	cache_insert(key, keylen, data);
+	pthread_mutex_lock(&cache_lock);
+	cache_restored++;
+	cache_refresh_start(key, keylen, hash);
+	pthread_mutex_unlock(&cache_lock);
+
+	return data;
+}
+
+/**
+ * Looks up the results of a query in the cache.
+ *
+ * If an identical query is in progress, waits for its results (with the GIL
+ * released) instead of asking the network again. Otherwise, if lead is set,
+ * registers the query of the caller: it must be finished by cache_store().
+ * A stale entry is returned as it is and one background refresh is started.
+ * The query is run again, not coalesced, when the leader of the identical
+ * one issues it from its python callback: the leader would wait for itself.
+ *
+ * Called with the GIL held.
+ *
+ * @param key		The key built by cache_key().
+ * @param keylen	Length of the key.
+ * @param lead		Whether the caller is going to run the query on a miss.
+ * @param flight	Where to store the registered query, NULL if none.
+ * @return	The results to be released by cache_data_unref(), NULL if the
+ * 			caller has to run the query.
+ */
+static cache_data_t *cache_lookup(const char *key, size_t keylen, int lead,
+		cache_flight_t **flight)
+{
+	unsigned long hash = cache_hash(key, keylen);
+	cache_flight_t *wait;
+	cache_data_t *data;
+	cache_data_t *fresh;
+	int restored = 0;
+	int stale;
+
+	*flight = NULL;
+	for (;;) {
+		pthread_mutex_lock(&cache_lock);
+		if ((data = cache_get(key, keylen, hash, &stale))) {
+			if (stale && cache_shm && !cache_flight_find(key, keylen)) {
+				/* Another process may have refreshed it already. */
+				pthread_mutex_unlock(&cache_lock);
+				if ((fresh = cache_shm_get(key, keylen, hash))) {
+					cache_data_unref(data);
+					return fresh;
+				}
+				pthread_mutex_lock(&cache_lock);
+			}
+			if (stale)
+				cache_refresh_start(key, keylen, hash);
+			pthread_mutex_unlock(&cache_lock);
+			return data;
+		}
+		if (!(wait = cache_flight_find(key, keylen))) {
+			if (cache_snapshot && !restored) {
+				restored = 1;
+				pthread_mutex_unlock(&cache_lock);
+				if ((data = cache_snapshot_get(key, keylen, hash)))
+					return data;
+				continue;
+			}
+			if (lead && (*flight = cache_flight_new(key, keylen))) {
+				(*flight)->led = 1;
+				(*flight)->leader = pthread_self();
+			}
+			pthread_mutex_unlock(&cache_lock);
+			if (cache_shm && (*flight || !lead)) {
+				/* One process of the host runs the query. */
+				Py_BEGIN_ALLOW_THREADS
+				data = lead ? cache_shm_wait(key, keylen, hash) :
+					cache_shm_get(key, keylen, hash);
+				Py_END_ALLOW_THREADS
+				if (data && *flight) {
+					cache_flight_finish(*flight, data);
+					*flight = NULL;
+				}
+			}
+			return data;
+		}
+		if (cache_flight_leading()) {
+			/* Run it uncoalesced rather than deadlock. */
+			pthread_mutex_unlock(&cache_lock);
+			return NULL;
+		}
+		wait->refs++;
+		pthread_mutex_unlock(&cache_lock);
+
+		/* cache_lock must not be held while re-acquiring the GIL. */
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock(&cache_lock);
+		while (!wait->done)
+			pthread_cond_wait(&cache_flight_cond, &cache_lock);
+		if ((data = wait->data)) {
+			data->refs++;
+			cache_coalesced++;
+		}
+		cache_flight_unref(wait);
+		pthread_mutex_unlock(&cache_lock);
+		Py_END_ALLOW_THREADS
+		if (data)
+			return data;
+		/* The query failed or was cut short, run it again. */
+	}
+}
+
+/**
+ * Helper function to check the python handle argument and take the handle
+ * for one libslp call.
+ *
+ * @param py_handle	The python handle object returned by SLPOpen().
+ * @return	The acquired handle (borrowed reference) to be given up with
+ * 			slp_handle_release(), NULL with an exception raised on error.
+ */
+static SLPHandleObject *acquire_slp_handle(PyObject *py_handle)
+{
+	if (!SLPHandle_Check(py_handle)) {
+		PyErr_SetString(PyExc_TypeError, "Invalid SLP handle");
+		return NULL;
+	}
+	if (((SLPHandleObject *) py_handle)->isasync) {
+		PyErr_SetString(PyExc_ValueError, "The function does not support "
+				"asynchronous SLP handles");
+		return NULL;
+	}
+	if (slp_handle_acquire((SLPHandleObject *) py_handle) != RET_OK)
+		return NULL;
+
+	return (SLPHandleObject *) py_handle;
+}
+
+/**
+ * Helper function to extract the SLPHandle and wrap the python objects required
+ * for every callback function.
+ *
+ * @param py_handle		The python handle object returned by SLPOpen().
+ * @param py_callback	Python object representing the python function to be
+ *						called.
+ * @param py_cookie		Arbitrary data to be passed to the python callback.
+ * @param ret_handle	Where to store the acquired python handle object.
+ * @param ret_cookie	Newly allocated cb_cookie_t structure pointer. Will hold
+ * 						the python handle, callback function and cookie objects.
+ * @return	RET_OK (0) on success, RET_ERROR (-1) otherwise.
+ *
+ * On success the handle is acquired for the caller which has to give it up
+ * with slp_handle_release() once the libslp call returns. The asynchronous
+ * handles are not acquired; the caller passes the cookie to async_submit()
+ * instead.
+ */
+static inline int slpfunc_prep_args(PyObject *py_handle, PyObject *py_callback,
+		PyObject *py_cookie, SLPHandleObject **ret_handle,
+		cb_cookie_t **ret_cookie)
+{
+	if (!PyCallable_Check(py_callback)) {
+		PyErr_SetString(PyExc_TypeError, "Callback must be callable");
+		return RET_ERROR;
+	}
+	if (SLPHandle_Check(py_handle) &&
+			((SLPHandleObject *) py_handle)->isasync)
+		*ret_handle = (SLPHandleObject *) py_handle;
+	else if (!(*ret_handle = acquire_slp_handle(py_handle)))
+		return RET_ERROR;
+	if (!(*ret_cookie = calloc(1, sizeof(cb_cookie_t)))) {
+		if (!(*ret_handle)->isasync)
+			slp_handle_release(*ret_handle);
+		PyErr_NoMemory();
+		return RET_ERROR;
+	}
+	
+	/* Decreased in the callback when no longer needed */
+	Py_XINCREF(py_callback);
+
+	(*ret_cookie)->py_handle = py_handle;
+	(*ret_cookie)->py_cookie = py_cookie;
+	(*ret_cookie)->py_callback = py_callback;
+
+	return RET_OK;
+}
+
+/**
+ * Helper function for the py_slp_findsrvs() and py_slp_findsttrs -- extracts
+ * the arguments.
+ *
+ * @param args	The arguments from the python caller code, see
+ * 				SLP_FASTCALL_ARGS.
+ * @param format	The slp_parse_args() format, "OzzzOO|id:<name>".
+ * @param kwlist	The names of the arguments.
+ * @param handle	Will hold the acquired python handle object.
+ * @param str_arg_1	Where to put the first extracted string
+ * @param str_arg_2	Where to put the second extracted string
+ * @param str_arg_3	Where to put the third extracted string
+ * @param cb_cookie	Where to allocate the cb_cookie_t structure wrapping the
+ *					python objects.
+ * @return RET_OK (0) on success, RET_ERROR (-1) otherwise.
+ *
+ * The optional batch_size and flush_interval arguments switch the callback
+ * to the batched delivery: the python callback gets a list of results, see
+ * batch_url_cb(). The format may go on with the limit and deadline
+ * arguments, see srv_url_cb(), and with the dedupe one, see collect_srvs().
+ */
+static int location_func_prep(SLP_FASTCALL_ARGS, const char *format,
+		char **kwlist, SLPHandleObject **handle,
+		char **str_arg_1, char **str_arg_2, char **str_arg_3,
+		cb_cookie_t **cb_cookie)
+{
+	PyObject *py_handle;
+	PyObject *py_callback;
+	PyObject *py_cookie;
+	int batch_size = 0;
+	double flush_interval = 0;
+	int limit = 0;
+	double deadline = 0;
+	PyObject *py_dedupe = NULL;
+	int dedupe = 0;
+	
+	if (slp_parse_args(SLP_FASTCALL_PASS, format, kwlist,
+				&py_handle, str_arg_1, str_arg_2, str_arg_3, &py_callback,
+				&py_cookie, &batch_size, &flush_interval, &limit,
+				&deadline, &py_dedupe) != RET_OK) {
+		return RET_ERROR;
+	}
+	if (py_dedupe && (dedupe = PyObject_IsTrue(py_dedupe)) < 0)
+		return RET_ERROR;
+	if (batch_size < 0 || flush_interval < 0 || limit < 0 || deadline < 0) {
+		PyErr_SetString(PyExc_ValueError, "batch_size, flush_interval, "
+				"limit and deadline must not be negative");
+		return RET_ERROR;
+	}
+	if ((batch_size || flush_interval || limit || deadline || dedupe) &&
+			SLPHandle_Check(py_handle) &&
+			((SLPHandleObject *) py_handle)->isasync) {
+		PyErr_SetString(PyExc_ValueError, "Batched callbacks, early stop "
+				"and dedupe are not supported on asynchronous SLP handles");
+		return RET_ERROR;
+	}
+
+	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
+			handle, cb_cookie) != RET_OK)
+		return RET_ERROR;
+	/* A flush interval alone means no limit on the batch size. */
+	(*cb_cookie)->batch_size = batch_size ? batch_size :
+		(flush_interval ? -1 : 0);
+	(*cb_cookie)->flush_interval = flush_interval;
+	(*cb_cookie)->limit = limit;
+	(*cb_cookie)->deadline = deadline ? slp_monotonic() + deadline : 0;
+	(*cb_cookie)->dedupe = dedupe;
+
+	return RET_OK;
+}
+
+/**
+ * Interface function for SLPOpen().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The SLPOpen arguments, positional or by keyword:
+ * 				lang: String according to RFC 1766, may be None or "".
+ * 				isasync: Boolean indicating whether to open for async
+ * 				operations.
+ * @return	The slp.Handle object wrapping the SLPHandle. It is closed when
+ * 			garbage collected, by SLPClose() or when leaving the "with" block.
+ * 			On error returns NULL and raises an exception.
+ */
+static PyObject *py_slp_open(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "lang", "isasync", NULL };
+	char *lang;
+	SLPBoolean isasync;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "zi:SLPOpen", kwlist,
+				&lang, &isasync) != RET_OK)
+		return NULL;
+
+	return slp_handle_open(lang, isasync);
+}
+
+/**
+ * Interface function for SLPClose().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The slp.Handle object returned by SLPOpen(). Waits for the
+ * 				operation running on the handle (if any) to finish.
+ * @return	None.
+ */
+static PyObject *py_slp_close(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", NULL };
+	PyObject *py_handle;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "O:SLPClose", kwlist,
+				&py_handle) != RET_OK)
+		return NULL;
+	if (!SLPHandle_Check(py_handle)) {
+		PyErr_SetString(PyExc_TypeError, "The argument to SLPClose doesn't "
+				"seem to be a valid SLP handle");
+		return NULL;
+	}
+	if (slp_handle_close((SLPHandleObject *) py_handle) != RET_OK)
+		return NULL;
+	
+	Py_INCREF(Py_None);
+	
+	return Py_None;
+}
+
+/**
+ * Interface function for SLPFindSrvs().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvtype: The service type string -- may be None or ""
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				filter: A query formulated of attribute pattern matching
+ *				expressions in the form of an LDAPv3 search filter.
+ *				callback: te python object representing the callback function to
+ *				be called.
+ *				cookie: arbitrary data to be passed to the callback.
+ *				batch_size, flush_interval: see batch_url_cb().
+ *				limit: Stop the query once that many results came, 0 (the
+ *				default) for no limit.
+ *				deadline: Stop the query at the first result coming after
+ *				that many seconds, 0 (the default) for none.
+ *				dedupe: Gather the replies in C and pass each URL once, with
+ *				its longest lifetime, merging the scopes of the scope list.
+ * @return	True if the query was stopped by limit or deadline, False
+ * 			otherwise; NULL + exception raised on error.
+ */
+static PyObject *py_slp_findsrvs(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvtype", "scopelist", "filter",
+		"callback", "cookie", "batch_size", "flush_interval", "limit",
+		"deadline", "dedupe", NULL };
+	slp_results_t record = SLP_RESULTS_INIT;
+	SLPHandleObject *handle;
+	cache_data_t *data;
+	cache_data_t merged;
+	cache_flight_t *flight = NULL;
+	char *srvtype;
+	char *scopetype;
+	char *filter;
+	char *key = NULL;
+	size_t keylen;
+	double start = 0;
+	SLPError err;
+	cb_cookie_t *cookie;
+	int partial = 0;
+
+	if (location_func_prep(SLP_FASTCALL_PASS, "OzzzOO|ididO:SLPFindSrvs",
+				kwlist, &handle, &srvtype,
+				&scopetype, &filter, &cookie) != RET_OK)
+		return NULL;
+	if (handle->isasync)
+		return async_submit(handle, ASYNC_FIND_SRVS, cookie, srvtype,
+				scopetype, filter, 0, SLP_FALSE);
+	cookie->partial = &partial;
+	if (cache_enabled && (key = cache_key(CACHE_SRVS, srvtype, scopetype, filter,
+					handle->lang, &keylen))) {
+		/* The early stopped queries are not cached: they do not lead the
+		 * identical ones. */
+		if ((data = cache_lookup(key, keylen,
+						!cookie->limit && !cookie->deadline, &flight))) {
+			slp_handle_release(handle);
+			free(key);
+			if (cookie->dedupe && cache_data_dedupe(data, &merged) == RET_OK) {
+				cache_replay(&merged, cookie);
+				slp_results_clear(&merged.res);
+			} else {
+				cache_replay(data, cookie);
+			}
+			cache_data_unref(data);
+			goto out;
+		}
+		cookie->record = &record;
+		start = slp_monotonic();
+	}
+
+	if (cookie->dedupe) {
+		/* The replies are merged before any of them reaches the callback;
+		 * the limit is applied while replaying them. */
+		cookie->record = NULL;
+		record.dedupe = 1;
+		record.deadline = cookie->deadline;
+		start = slp_monotonic();
+		Py_BEGIN_ALLOW_THREADS
+		err = collect_srvs(handle->hslp, srvtype, scopetype, filter, &record);
+		slp_handle_release(handle);
+		Py_END_ALLOW_THREADS
+		partial = record.partial;
+		if (err != SLP_OK)
+			record.err = err;
+		else if (!record.count)
+			err = record.err;
+		merged.refs = 1;
+		merged.stored = slp_monotonic();
+		merged.res = record;
+		/* The deadline was applied while collecting: the replay comes
+		 * after it. */
+		cookie->deadline = 0;
+		cache_replay(&merged, cookie);
+	} else {
+		Py_BEGIN_ALLOW_THREADS
+		err = SLPFindSrvs(handle->hslp, srvtype, scopetype, filter,
+				key ? record_url_cb :
+				(cookie->batch_size ? batch_url_cb : srv_url_cb),
+				(void *)cookie);
+		slp_handle_release(handle);
+		Py_END_ALLOW_THREADS
+	}
+	if (key) {
+		cache_store(key, keylen, err, &record, start, flight);
+		free(key);
+	}
+	slp_results_clear(&record);
+	if (err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+out:
+	/* The python callback may have raised while the GIL was re-acquired. */
+	if (PyErr_Occurred())
+		return NULL;
+
+	return PyBool_FromLong(partial);
+}
+
+/**
+ * Interface function for SLPFindSrvTypes().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				namingauth: The naming authorities to search. "*" for all
+ *				authorities, "" for the default (IANA)
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				callback: te python object representing the callback function to
+ *				be called.
+ *				cookie: arbitrary data to be passed to the callback.
+ * @return	None on success, NULL + exception raised on error.
+ */
+static PyObject *py_slp_findsrvtypes(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "namingauth", "scopelist", "callback", "cookie", NULL };
+	SLPHandleObject *handle;
+	PyObject *py_handle;
+	PyObject *py_callback;
+	PyObject *py_cookie;
 	char *namingauth;
 	char *scopelist;
 	SLPError err;
-	cb_cookie_t *cookie;
-	
-	if (!PyArg_ParseTuple(args, "OzzOO", &py_handle, &namingauth, &scopelist,
-				&py_callback, &py_cookie))
+	cb_cookie_t *cookie;
+	
+	if (slp_parse_args(SLP_FASTCALL_PASS, "OzzOO:SLPFindSrvTypes", kwlist,
+				&py_handle, &namingauth, &scopelist, &py_callback,
+				&py_cookie) != RET_OK)
+		return NULL;
+	
+	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
+			&handle, &cookie) != RET_OK)
+		return NULL;
+	if (handle->isasync)
+		return async_submit(handle, ASYNC_FIND_SRVTYPES, cookie,
+				namingauth ? namingauth : "", scopelist, NULL, 0, SLP_FALSE);
+
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPFindSrvTypes(handle->hslp, namingauth, scopelist, srv_attr_type_cb,
+			(void *)cookie);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+	/* The python callback may have raised while the GIL was re-acquired. */
+	if (PyErr_Occurred())
+		return NULL;
+
+	Py_INCREF(Py_None);
+	
+	return Py_None;
+}
+
+/**
+ * Interface function for SLPFindAttrs().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvurl: The service URL of the service to the attributes of.
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				attrids: A comma separated list of attribute ids to return.
+ *				"" for all attributes.
+ *				callback: te python object representing the callback function to
+ *				be called.
+ *				cookie: arbitrary data to be passed to the callback.
+ * @return	None on success, NULL + exception raised on error.
+ */
+static PyObject *py_slp_findattrs(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvurl", "scopelist", "attrids",
+		"callback", "cookie", "batch_size", "flush_interval", NULL };
+	slp_results_t record = SLP_RESULTS_INIT;
+	SLPHandleObject *handle;
+	cache_data_t *data;
+	cache_flight_t *flight = NULL;
+	char *srvurl;
+	char *scopelist;
+	char *attrids;
+	char *key = NULL;
+	size_t keylen;
+	double start = 0;
+	SLPError err;
+	cb_cookie_t *cookie;
+
+	if (location_func_prep(SLP_FASTCALL_PASS, "OzzzOO|id:SLPFindAttrs",
+				kwlist, &handle, &srvurl,
+				&scopelist, &attrids, &cookie) != RET_OK)
+		return NULL;
+	if (handle->isasync)
+		return async_submit(handle, ASYNC_FIND_ATTRS, cookie, srvurl,
+				scopelist, attrids, 0, SLP_FALSE);
+	/* Only the full attribute lists are cached, the subsets are projected
+	 * from them. */
+	if (cache_enabled && (key = cache_key(CACHE_ATTRS, srvurl, scopelist,
+					NULL, handle->lang, &keylen))) {
+		if ((data = cache_lookup(key, keylen, !attrids || !*attrids,
+						&flight))) {
+			slp_handle_release(handle);
+			free(key);
+			cache_replay_attrs(data, attrids, cookie);
+			cache_data_unref(data);
+			goto out;
+		}
+		if (attrids && *attrids) {
+			free(key);
+			key = NULL;
+		} else {
+			cookie->record = &record;
+			start = slp_monotonic();
+		}
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPFindAttrs(handle->hslp, srvurl, scopelist, attrids,
+			key ? record_attr_cb :
+			(cookie->batch_size ? batch_attr_cb : srv_attr_type_cb),
+			(void *)cookie);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (key) {
+		cache_attr_lifetime(&record, srvurl);
+		cache_store(key, keylen, err, &record, start, flight);
+		slp_results_clear(&record);
+		free(key);
+	}
+	if (err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+out:
+	/* The python callback may have raised while the GIL was re-acquired. */
+	if (PyErr_Occurred())
+		return NULL;
+
+	Py_INCREF(Py_None);
+	
+	return Py_None;
+}
+
+/**
+ * Common part of the collecting find functions: raises the error reported by
+ * the library or by the callback and converts the results to a list.
+ *
+ * @param err			Return value of the libslp call.
+ * @param res			The gathered results; freed here.
+ * @param with_lifetime	Passed to slp_results_to_list().
+ * @return	The list on success, NULL + exception raised on error.
+ */
+static PyObject *collect_finish(SLPError err, slp_results_t *res,
+		int with_lifetime)
+{
+	PyObject *ret = NULL;
+
+	/* An error reported after some results came is not fatal: the caller
+	 * gets what has been found so far. */
+	if (err == SLP_OK && res->count == 0)
+		err = res->err;
+	if (err != SLP_OK)
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+	else
+		ret = slp_results_to_list(res, with_lifetime);
+	slp_results_clear(res);
+
+	return ret;
+}
+
+/**
+ * Adds the partial flag to the results of find_srvs_list() if asked for.
+ *
+ * @param list		The results, may be NULL with an exception raised.
+ * @param early		Whether limit or deadline was given.
+ * @param partial	Whether the query was stopped early.
+ * @return	The list or the (list, partial) tuple, NULL on error.
+ */
+static PyObject *srvs_list_finish(PyObject *list, int early, int partial)
+{
+	if (!list || !early)
+		return list;
+
+	return Py_BuildValue("(NO)", list, partial ? Py_True : Py_False);
+}
+
+/**
+ * SLPFindSrvs() variant gathering the results without any python callback.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvtype: The service type string -- may be None or ""
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				filter: LDAPv3 search filter -- may be None or ""
+ *				limit: Stop the query once that many results came, 0 (the
+ *				default) for no limit.
+ *				deadline: Stop the query at the first result coming after
+ *				that many seconds, 0 (the default) for none.
+ *				dedupe: List each URL once, with its longest lifetime,
+ *				merging the scopes of the scope list.
+ * @return	List of (url, lifetime) tuples; with limit or deadline set, a
+ * 			(list, partial) tuple where partial tells whether the query was
+ * 			stopped early. NULL + exception raised on error.
+ */
+static PyObject *py_slp_findsrvs_list(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvtype", "scopelist", "filter",
+		"limit", "deadline", "dedupe", NULL };
+	slp_results_t res = SLP_RESULTS_INIT;
+	SLPHandleObject *handle;
+	cache_data_t *data;
+	cache_data_t merged;
+	cache_flight_t *flight = NULL;
+	PyObject *py_handle;
+	PyObject *py_dedupe = NULL;
+	PyObject *ret = NULL;
+	char *srvtype;
+	char *scopelist = NULL;
+	char *filter = NULL;
+	char *key = NULL;
+	size_t keylen;
+	double start = 0;
+	double deadline = 0;
+	int partial;
+	int limit = 0;
+	SLPError err;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "Oz|zzidO:find_srvs_list", kwlist,
+				&py_handle, &srvtype, &scopelist, &filter, &limit,
+				&deadline, &py_dedupe) != RET_OK)
+		return NULL;
+	if (py_dedupe && (res.dedupe = PyObject_IsTrue(py_dedupe)) < 0)
+		return NULL;
+	if (limit < 0 || deadline < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"limit and deadline must not be negative");
+		return NULL;
+	}
+	if (!(handle = acquire_slp_handle(py_handle)))
+		return NULL;
+	res.limit = limit;
+	res.deadline = deadline ? slp_monotonic() + deadline : 0;
+	if (cache_enabled && (key = cache_key(CACHE_SRVS, srvtype, scopelist, filter,
+					handle->lang, &keylen))) {
+		if ((data = cache_lookup(key, keylen, !limit && !deadline,
+						&flight))) {
+			slp_handle_release(handle);
+			free(key);
+			if (res.dedupe && cache_data_dedupe(data, &merged) == RET_OK) {
+				cache_data_unref(data);
+				data = &merged;
+			}
+			ret = cache_to_list(data);
+			if (ret && limit && data->res.count > (size_t) limit) {
+				res.partial = 1;
+				if (PyList_SetSlice(ret, limit, PY_SSIZE_T_MAX, NULL) < 0)
+					Py_CLEAR(ret);
+			}
+			if (data == &merged)
+				slp_results_clear(&merged.res);
+			else
+				cache_data_unref(data);
+			return srvs_list_finish(ret, limit || deadline, res.partial);
+		}
+		start = slp_monotonic();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	err = collect_srvs(handle->hslp, srvtype, scopelist, filter, &res);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (key) {
+		if (err == SLP_OK && res.complete && res.err == SLP_OK)
+			ret = slp_results_to_list(&res, 1);
+		cache_store(key, keylen, err, &res, start, flight);
+		free(key);
+		if (ret) {
+			slp_results_clear(&res);
+			return srvs_list_finish(ret, limit || deadline, 0);
+		}
+	}
+	partial = res.partial;
+
+	return srvs_list_finish(collect_finish(err, &res, 1), limit || deadline,
+			partial);
+}
+
+/**
+ * SLPFindAttrs() variant gathering the results without any python callback.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvurl: The service URL of the service to the attributes of.
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				attrids: A comma separated list of attribute ids to return.
+ *				"" or None for all attributes.
+ * @return	List of the attribute list strings, NULL + exception raised on
+ * 			error.
+ */
+static PyObject *py_slp_findattrs_list(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvurl", "scopelist", "attrids", NULL };
+	slp_results_t res = SLP_RESULTS_INIT;
+	SLPHandleObject *handle;
+	cache_data_t *data;
+	cache_flight_t *flight = NULL;
+	PyObject *py_handle;
+	PyObject *ret = NULL;
+	char *srvurl;
+	char *scopelist = NULL;
+	char *attrids = NULL;
+	char *key = NULL;
+	size_t keylen;
+	double start = 0;
+	SLPError err;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "Os|zz:find_attrs_list", kwlist,
+				&py_handle, &srvurl, &scopelist, &attrids) != RET_OK)
+		return NULL;
+	if (!(handle = acquire_slp_handle(py_handle)))
+		return NULL;
+	if (cache_enabled && (key = cache_key(CACHE_ATTRS, srvurl, scopelist,
+					NULL, handle->lang, &keylen))) {
+		if ((data = cache_lookup(key, keylen, !attrids || !*attrids,
+						&flight))) {
+			slp_handle_release(handle);
+			free(key);
+			ret = cache_attrs_to_list(data, attrids);
+			cache_data_unref(data);
+			return ret;
+		}
+		if (attrids && *attrids) {
+			free(key);
+			key = NULL;
+		}
+		start = slp_monotonic();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPFindAttrs(handle->hslp, srvurl, scopelist, attrids,
+			collect_str_cb, (void *)&res);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (key) {
+		if (err == SLP_OK && res.complete && res.err == SLP_OK)
+			ret = slp_results_to_list(&res, 0);
+		cache_attr_lifetime(&res, srvurl);
+		cache_store(key, keylen, err, &res, start, flight);
+		free(key);
+		if (ret) {
+			slp_results_clear(&res);
+			return ret;
+		}
+	}
+
+	return collect_finish(err, &res, 0);
+}
+
+/**
+ * SLPFindSrvTypes() variant gathering the results without any python
+ * callback.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				namingauth: The naming authorities to search. "*" for all
+ *				authorities, "" or None for the default (IANA)
+ *				scopelist: Comma separated list of scope names -- may be ""
+ * @return	List of the service type list strings, NULL + exception raised
+ * 			on error.
+ */
+static PyObject *py_slp_findsrvtypes_list(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "namingauth", "scopelist", NULL };
+	slp_results_t res = SLP_RESULTS_INIT;
+	SLPHandleObject *handle;
+	PyObject *py_handle;
+	char *namingauth = NULL;
+	char *scopelist = NULL;
+	SLPError err;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "O|zz:find_srvtypes_list", kwlist,
+				&py_handle, &namingauth, &scopelist) != RET_OK)
+		return NULL;
+	if (!(handle = acquire_slp_handle(py_handle)))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPFindSrvTypes(handle->hslp, namingauth ? namingauth : "",
+			scopelist, collect_str_cb, (void *)&res);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+
+	return collect_finish(err, &res, 0);
+}
+
+/**
+ * Configures the discovery cache used by SLPFindSrvs(), find_srvs_list(),
+ * SLPFindAttrs() and find_attrs_list() on the synchronous handles.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, by keyword; the settings not given are kept:
+ * 				enabled: Whether to use the cache, disabled by default.
+ * 				max_entries: Number of the cached queries, the least recently
+ * 				used ones are evicted first. 1024 by default.
+ * 				max_ttl: Upper limit of the entry lifetime in seconds, 0 (the
+ * 				default) for the shortest lifetime of the found URLs.
+ * 				negative_ttl: Lifetime of the cached empty and timed out
+ * 				results in seconds, doubled with each such result of the
+ * 				same query in a row. 0 (the default) disables the negative
+ * 				caching.
+ * 				negative_max_ttl: Upper limit of the negative entry lifetime,
+ * 				300 seconds by default.
+ * 				negative_flush_interval: Period of dropping all the negative
+ * 				entries in seconds, 0 (the default) for never.
+ * 				attr_ttl: Lifetime of the cached attributes of the service
+ * 				URLs not found in the cached SLPFindSrvs() results, 0 (the
+ * 				default) to not cache them. The attributes of the other URLs
+ * 				expire with the URL.
+ * 				stale_ttl: For how many seconds the expired results are still
+ * 				served while one background query refreshes them, 0 (the
+ * 				default) to not serve them.
+ * @return	None.
+ */
+static PyObject *py_slp_cache_configure(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "enabled", "max_entries", "max_ttl",
+		"negative_ttl", "negative_max_ttl", "negative_flush_interval",
+		"attr_ttl", "stale_ttl", NULL };
+	PyObject *py_enabled = NULL;
+	PyObject *py_max_entries = NULL;
+	PyObject *py_max_ttl = NULL;
+	Py_ssize_t max_entries = 0;
+	double max_ttl = 0;
+	double negative_ttl = -1;
+	double negative_max_ttl = -1;
+	double negative_flush_interval = -1;
+	double attr_ttl = -1;
+	double stale_ttl = -1;
+	int enabled = 0;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "|OOOddddd:cache_configure", kwlist,
+				&py_enabled, &py_max_entries, &py_max_ttl, &negative_ttl,
+				&negative_max_ttl, &negative_flush_interval, &attr_ttl,
+				&stale_ttl) != RET_OK)
+		return NULL;
+	if (py_enabled && (enabled = PyObject_IsTrue(py_enabled)) < 0)
+		return NULL;
+	if (py_max_entries && (max_entries = PyNumber_AsSsize_t(py_max_entries,
+					PyExc_OverflowError)) == -1 && PyErr_Occurred())
+		return NULL;
+	if (py_max_ttl && (max_ttl = PyFloat_AsDouble(py_max_ttl)) == -1 &&
+			PyErr_Occurred())
+		return NULL;
+	if ((py_max_entries && max_entries < 1) || max_ttl < 0) {
+		PyErr_SetString(PyExc_ValueError, "max_entries must be positive and "
+				"max_ttl must not be negative");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if (py_max_entries)
+		cache_max_entries = max_entries;
+	if (py_max_ttl)
+		cache_max_ttl = max_ttl;
+	if (py_enabled)
+		cache_enabled = enabled;
+	/* The negative settings are left alone unless given (not negative). */
+	if (negative_ttl >= 0)
+		cache_negative_ttl = negative_ttl;
+	if (negative_max_ttl >= 0)
+		cache_negative_max_ttl = negative_max_ttl;
+	if (negative_flush_interval >= 0) {
+		cache_negative_flush_interval = negative_flush_interval;
+		cache_negative_flushed = slp_monotonic();
+	}
+	if (attr_ttl >= 0)
+		cache_attr_ttl = attr_ttl;
+	if (stale_ttl >= 0)
+		cache_stale_ttl = stale_ttl;
+	while (cache_count > cache_max_entries) {
+		cache_remove(cache_lru_tail);
+		cache_evictions++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (py_enabled && !enabled)
+		cache_flush(0);
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+/**
+ * Returns the discovery cache statistics.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	Unused.
+ * @return	Dictionary with the enabled, entries, max_entries, max_ttl, hits,
+ * 			misses, evictions (entries dropped to make room) and expirations
+ * 			(expired entries dropped) items and the negative_entries,
+ * 			negative_hits, negative_ttl and negative_max_ttl items of the
+ * 			negative caching, attr_ttl and projections (attribute subsets
+ * 			served from the cached full lists), stale_ttl, stale_hits,
+ * 			refreshes (background queries started) and coalesced (queries
+ * 			answered by an identical query in progress), shared (path of
+ * 			the shared memory cache or None), shared_hits (results read
+ * 			from the shared memory cache), shared_waits (queries
+ * 			waiting for another process) and restored (entries restored
+ * 			from the snapshot loaded by cache_load()).
+ */
+static PyObject *py_slp_cache_stats(PyObject *self, PyObject *args)
+{
+	PyObject *shared;
+	PyObject *ret;
+
+	pthread_rwlock_rdlock(&cache_shm_lock);
+	shared = Py_BuildValue("z", cache_shm_path);
+	pthread_rwlock_unlock(&cache_shm_lock);
+	if (!shared)
+		return NULL;
+	pthread_mutex_lock(&cache_lock);
+	ret = Py_BuildValue("{s:O,s:n,s:n,s:d,s:k,s:k,s:k,s:k,s:n,s:k,s:d,s:d,"
+			"s:d,s:k,s:d,s:k,s:k,s:k,s:N,s:k,s:k,s:k}",
+			"enabled", cache_enabled ? Py_True : Py_False,
+			"entries", (Py_ssize_t) cache_count,
+			"max_entries", (Py_ssize_t) cache_max_entries,
+			"max_ttl", cache_max_ttl,
+			"hits", cache_hits,
+			"misses", cache_misses,
+			"evictions", cache_evictions,
+			"expirations", cache_expirations,
+			"negative_entries", (Py_ssize_t) cache_negative_count,
+			"negative_hits", cache_negative_hits,
+			"negative_ttl", cache_negative_ttl,
+			"negative_max_ttl", cache_negative_max_ttl,
+			"attr_ttl", cache_attr_ttl,
+			"projections", cache_projections,
+			"stale_ttl", cache_stale_ttl,
+			"stale_hits", cache_stale_hits,
+			"refreshes", cache_refreshes,
+			"coalesced", cache_coalesced,
+			"shared", shared,
+			"shared_hits", cache_shared_hits,
+			"shared_waits", cache_shared_waits,
+			"restored", cache_restored);
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+/**
+ * Drops the discovery cache entries. The whole shared memory cache is
+ * emptied too, unless only the negative entries are dropped.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				negative_only: Drop only the negative entries, False by
+ * 				default.
+ * @return	None.
+ */
+static PyObject *py_slp_cache_clear(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "negative_only", NULL };
+	PyObject *py_negative_only = Py_False;
+	int negative_only;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "|O:cache_clear", kwlist,
+				&py_negative_only) != RET_OK)
+		return NULL;
+	if ((negative_only = PyObject_IsTrue(py_negative_only)) < 0)
+		return NULL;
+	cache_flush(negative_only);
+	if (!negative_only)
+		shm_flush();
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+/**
+ * Attaches the discovery cache to a shared memory file so that the processes
+ * of the host share their results: only one of them runs a given query, the
+ * others read its results from the file.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				path: The file, created if missing; None to detach.
+ * 				slots: Number of the entries of a new file, 1024 by default.
+ * 				slot_size: Size of the entries of a new file in bytes, 4096 by
+ * 				default; the results not fitting in are cached only in the
+ * 				process.
+ * @return	None.
+ */
+static PyObject *py_slp_cache_share(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "path", "slots", "slot_size", NULL };
+	char *path;
+	int slots = 1024;
+	int slot_size = 4096;
+	int err;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "z|ii:cache_share", kwlist, &path,
+				&slots, &slot_size) != RET_OK)
+		return NULL;
+	if (slots < 1 || slot_size < 256 || slot_size % 8) {
+		PyErr_SetString(PyExc_ValueError, "slots must be positive and "
+				"slot_size a multiple of 8 of at least 256");
+		return NULL;
+	}
+
+	if (!path) {
+		shm_detach();
+	} else {
+		Py_BEGIN_ALLOW_THREADS
+		err = shm_attach(path, slots, slot_size);
+		Py_END_ALLOW_THREADS
+		if (err) {
+			errno = err;
+			return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+		}
+	}
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+/**
+ * Saves the unexpired entries of the discovery cache (found URLs, attribute
+ * lists and negative results) to a file, see cache_load().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				path: The file, replaced atomically.
+ * @return	Number of the saved entries.
+ */
+static PyObject *py_slp_cache_save(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "path", NULL };
+	char *path;
+	size_t saved = 0;
+	int err;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "s:cache_save", kwlist,
+				&path) != RET_OK)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	err = cache_snapshot_save(path, &saved);
+	Py_END_ALLOW_THREADS
+	if (err) {
+		errno = err;
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+	}
+
+	return PyLong_FromSize_t(saved);
+}
+
+/**
+ * Loads a file saved by cache_save(). The file is only mapped: its unexpired
+ * entries are restored when first looked up, and refreshed in the
+ * background.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				path: The file; None to drop the loaded one.
+ * @return	None.
+ */
+static PyObject *py_slp_cache_load(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "path", NULL };
+	char *path;
+	int err;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "z:cache_load", kwlist,
+				&path) != RET_OK)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	err = cache_snapshot_load(path);
+	Py_END_ALLOW_THREADS
+	if (err) {
+		errno = err;
+		return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+	}
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+/*
+ * Hedged queries.
+ *
+ * find_srvs_hedged() runs the query in worker threads, each attempt on its
+ * own handle (the handle of the caller only gives the language): the first
+ * one at once, the others (the hedges) once the previous attempts did not
+ * answer within the hedge delay. The losing attempts may run on for a while,
+ * they never hold a handle of the caller nor call into python.
+ * The first attempt finding some services wins; the others are cancelled at
+ * their next result. The default hedge delay is a percentile of the latencies
+ * of the recent winning attempts.
+ */
+
+/* Number of the latencies kept for the hedge delay. */
+#define HEDGE_SAMPLES		256
+/* Number of the latencies needed before using their percentile. */
+#define HEDGE_MIN_SAMPLES	16
+/* Hedge delay in seconds until there are enough latencies. */
+#define HEDGE_DEFAULT_DELAY	1.0
+
+static pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+static double hedge_latencies[HEDGE_SAMPLES];
+static size_t hedge_nlatencies;
+static size_t hedge_pos;
+static unsigned long hedge_queries;
+static unsigned long hedge_launched;
+static unsigned long hedge_wins;
+
+/**
+ * State of a hedged query shared by the caller and the attempts. Freed by
+ * whichever drops the last reference.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	volatile int cancel;
+	int running;			/* attempts not finished yet */
+	int winner;				/* index of the winning attempt, -1 if none */
+	int empty;				/* an attempt succeeded without any result */
+	SLPError err;			/* the first error */
+	slp_results_t res;		/* results of the winner */
+	char *srvtype;
+	char *filter;
+	char *lang;
+} hedge_race_t;
+
+/**
+ * One attempt of a hedged query.
+ */
+typedef struct {
+	hedge_race_t *race;
+	int index;
+	char *scopelist;
+	double start;
+} hedge_attempt_t;
+
+/**
+ * Drops one reference to the race and frees it with the last one. Does not
+ * need the GIL.
+ *
+ * @param race	The race.
+ */
+static void hedge_race_unref(hedge_race_t *race)
+{
+	int last;
+
+	pthread_mutex_lock(&race->lock);
+	last = --race->refs == 0;
+	pthread_mutex_unlock(&race->lock);
+	if (!last)
+		return;
+
+	slp_results_clear(&race->res);
+	free(race->srvtype);
+	free(race->filter);
+	free(race->lang);
+	pthread_cond_destroy(&race->cond);
+	pthread_mutex_destroy(&race->lock);
+	free(race);
+}
+
+/**
+ * Records the latency of a winning attempt.
+ *
+ * @param latency	The latency in seconds.
+ */
+static void hedge_record(double latency)
+{
+	pthread_mutex_lock(&hedge_lock);
+	hedge_latencies[hedge_pos] = latency;
+	hedge_pos = (hedge_pos + 1) % HEDGE_SAMPLES;
+	if (hedge_nlatencies < HEDGE_SAMPLES)
+		hedge_nlatencies++;
+	pthread_mutex_unlock(&hedge_lock);
+}
+
+static int hedge_double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns the hedge delay: the percentile of the recent latencies.
+ *
+ * @param percentile	The percentile, between 0 and 100.
+ * @return	The delay in seconds, HEDGE_DEFAULT_DELAY if there are not
+ * 			enough latencies yet.
+ */
+static double hedge_delay(double percentile)
+{
+	double sorted[HEDGE_SAMPLES];
+	size_t n;
+	size_t i;
+
+	pthread_mutex_lock(&hedge_lock);
+	n = hedge_nlatencies;
+	memcpy(sorted, hedge_latencies, n * sizeof(double));
+	pthread_mutex_unlock(&hedge_lock);
+	if (n < HEDGE_MIN_SAMPLES)
+		return HEDGE_DEFAULT_DELAY;
+
+	qsort(sorted, n, sizeof(double), hedge_double_cmp);
+	i = (size_t) (percentile / 100 * (n - 1) + 0.5);
+
+	return sorted[i];
+}
+
+/**
+ * Worker thread of one attempt of a hedged query.
+ *
+ * @param arg	The hedge_attempt_t; freed.
+ * @return	NULL.
+ */
+static void *hedge_attempt_thread(void *arg)
+{
+	hedge_attempt_t *attempt = (hedge_attempt_t *) arg;
+	hedge_race_t *race = attempt->race;
+	slp_results_t res = SLP_RESULTS_INIT;
+	SLPHandle hslp = NULL;
+	SLPError err;
+
+	res.cancel = &race->cancel;
+	if ((err = SLPOpen(race->lang, SLP_FALSE, &hslp)) != SLP_OK)
+		hslp = NULL;
+	if (err == SLP_OK && !race->cancel) {
+		err = SLPFindSrvs(hslp, race->srvtype, attempt->scopelist,
+				race->filter, collect_url_cb, (void *)&res);
+		/* Same as collect_finish(). */
+		if (err == SLP_OK && !res.count)
+			err = res.err;
+	}
+	if (hslp)
+		SLPClose(hslp);
+
+	pthread_mutex_lock(&race->lock);
+	race->running--;
+	if (race->winner < 0 && !race->cancel) {
+		if (err == SLP_OK && res.count) {
+			race->winner = attempt->index;
+			race->res = res;
+			memset(&res, 0, sizeof(slp_results_t));
+			race->cancel = 1;
+			hedge_record(slp_monotonic() - attempt->start);
+		} else if (err == SLP_OK) {
+			race->empty = 1;
+		} else if (race->err == SLP_OK) {
+			race->err = err;
+		}
+	}
+	pthread_cond_broadcast(&race->cond);
+	pthread_mutex_unlock(&race->lock);
+	slp_results_clear(&res);
+
+	free(attempt->scopelist);
+	free(attempt);
+	hedge_race_unref(race);
+
+	return NULL;
+}
+
+/**
+ * Starts one attempt of a hedged query. Called with race->lock held.
+ *
+ * @param race		The race.
+ * @param index		Index of the attempt.
+ * @param scopelist	The scopes of the attempt.
+ * @return	RET_OK if started, RET_ERROR otherwise.
+ */
+static int hedge_launch(hedge_race_t *race, int index,
+		const char *scopelist)
+{
+	hedge_attempt_t *attempt;
+	pthread_t thread;
+
+	if (!(attempt = calloc(1, sizeof(hedge_attempt_t))) ||
+			(scopelist && !(attempt->scopelist = strdup(scopelist)))) {
+		free(attempt);
+		return RET_ERROR;
+	}
+	attempt->race = race;
+	attempt->index = index;
+	attempt->start = slp_monotonic();
+	race->refs++;
+	race->running++;
+	if (pthread_create(&thread, NULL, hedge_attempt_thread, attempt) != 0) {
+		race->refs--;
+		race->running--;
+		free(attempt->scopelist);
+		free(attempt);
+		return RET_ERROR;
+	}
+	pthread_detach(thread);
+	if (index) {
+		pthread_mutex_lock(&hedge_lock);
+		hedge_launched++;
+		pthread_mutex_unlock(&hedge_lock);
+	}
+
+	return RET_OK;
+}
+
+/**
+ * Splits the scope list at the commas.
+ *
+ * @param scopelist	The scope list, may be NULL.
+ * @param buf		Where to store the malloc()ed buffer holding the scopes.
+ * @param nscopes	Where to store the number of the scopes.
+ * @return	The malloc()ed array of the scopes, NULL if out of memory or if
+ * 			there are less than two scopes.
+ */
+static char **hedge_split_scopes(const char *scopelist, char **buf,
+		int *nscopes)
+{
+	char **scopes;
+	const char *p;
+	char *scope;
+	char *save;
+	int n = 1;
+
+	*nscopes = 0;
+	*buf = NULL;
+	if (!scopelist || !strchr(scopelist, ','))
+		return NULL;
+	for (p = scopelist; *p; p++)
+		n += *p == ',';
+	if (!(scopes = malloc(n * sizeof(char *))) ||
+			!(*buf = strdup(scopelist))) {
+		free(scopes);
+		return NULL;
+	}
+	for (scope = strtok_r(*buf, ", \t", &save); scope;
+			scope = strtok_r(NULL, ", \t", &save))
+		scopes[(*nscopes)++] = scope;
+	if (*nscopes < 2) {
+		free(*buf);
+		free(scopes);
+		*buf = NULL;
+		*nscopes = 0;
+		return NULL;
+	}
+
+	return scopes;
+}
+
+/**
+ * SLPFindSrvs() variant racing several identical queries to cut the tail
+ * latency. Runs without the GIL.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen, giving the language
+ * 				of the handles of the attempts; it is not used for the query.
+ *				srvtype: The service type string -- may be None or ""
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				filter: LDAPv3 search filter -- may be None or ""
+ *				percentile: Percentile of the recent latencies used as the
+ *				hedge delay, 95 by default.
+ *				delay: Hedge delay in seconds overriding the percentile.
+ *				max_hedges: Number of the additional attempts, 1 by default;
+ *				each one starts one hedge delay after the previous one, or
+ *				at once if all the previous ones failed.
+ *				per_scope: Race one attempt per scope of the scope list, all
+ *				started at once, instead of the hedges.
+ * @return	List of (url, lifetime) tuples of the winning attempt, NULL +
+ * 			exception raised on error.
+ */
+static PyObject *py_slp_findsrvs_hedged(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvtype", "scopelist", "filter",
+		"percentile", "delay", "max_hedges", "per_scope", NULL };
+	SLPHandleObject *handle;
+	hedge_race_t *race;
+	PyObject *py_handle;
+	PyObject *py_delay = Py_None;
+	PyObject *py_per_scope = Py_False;
+	PyObject *ret = NULL;
+	struct timespec ts;
+	char **scopes = NULL;
+	char *scopes_buf = NULL;
+	char *srvtype;
+	char *scopelist = NULL;
+	char *filter = NULL;
+	double percentile = 95;
+	double delay;
+	double next;
+	int max_hedges = 1;
+	int per_scope;
+	int nscopes = 0;
+	int total;
+	int launched = 0;
+	SLPError err;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "Oz|zzdOiO:find_srvs_hedged",
+				kwlist, &py_handle, &srvtype, &scopelist, &filter,
+				&percentile, &py_delay, &max_hedges, &py_per_scope) != RET_OK)
+		return NULL;
+	if ((per_scope = PyObject_IsTrue(py_per_scope)) < 0)
+		return NULL;
+	if (py_delay == Py_None)
+		delay = hedge_delay(percentile);
+	else if ((delay = PyFloat_AsDouble(py_delay)) == -1 && PyErr_Occurred())
+		return NULL;
+	if (percentile < 0 || percentile > 100 || delay < 0 || max_hedges < 0) {
+		PyErr_SetString(PyExc_ValueError, "Invalid hedging parameters");
+		return NULL;
+	}
+	if (per_scope)
+		scopes = hedge_split_scopes(scopelist, &scopes_buf, &nscopes);
+	total = nscopes ? nscopes : max_hedges + 1;
+
+	if (!(race = calloc(1, sizeof(hedge_race_t))) ||
+			(srvtype && !(race->srvtype = strdup(srvtype))) ||
+			(filter && !(race->filter = strdup(filter)))) {
+		if (race) {
+			free(race->srvtype);
+			free(race);
+		}
+		free(scopes_buf);
+		free(scopes);
+		return PyErr_NoMemory();
+	}
+	pthread_mutex_init(&race->lock, NULL);
+	pthread_cond_init(&race->cond, NULL);
+	race->refs = 1;
+	race->winner = -1;
+	handle = (SLPHandleObject *) py_handle;
+	if (!SLPHandle_Check(py_handle) || handle->isasync || !handle->hslp ||
+			(handle->lang && !(race->lang = strdup(handle->lang)))) {
+		if (!SLPHandle_Check(py_handle))
+			PyErr_SetString(PyExc_TypeError, "Invalid SLP handle");
+		else if (handle->isasync)
+			PyErr_SetString(PyExc_ValueError, "The function does not "
+					"support asynchronous SLP handles");
+		else if (!handle->hslp)
+			PyErr_SetString(PyExc_ValueError, "The SLP handle is closed");
+		else
+			PyErr_NoMemory();
+		hedge_race_unref(race);
+		free(scopes_buf);
+		free(scopes);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&hedge_lock);
+	hedge_queries++;
+	pthread_mutex_unlock(&hedge_lock);
+	pthread_mutex_lock(&race->lock);
+	if (hedge_launch(race, 0, nscopes ? scopes[0] : scopelist) != RET_OK)
+		race->err = SLP_MEMORY_ALLOC_FAILED;
+	launched = 1;
+	next = slp_monotonic() + delay;
+	while (race->winner < 0) {
+		if (launched < total && (nscopes || !race->running ||
+					slp_monotonic() >= next)) {
+			if (hedge_launch(race, launched,
+						nscopes ? scopes[launched] : scopelist) != RET_OK &&
+					race->err == SLP_OK)
+				race->err = SLP_MEMORY_ALLOC_FAILED;
+			launched++;
+			next = slp_monotonic() + delay;
+			continue;
+		}
+		if (!race->running && launched == total)
+			break;
+		if (launched < total) {
+			slp_abstime(next - slp_monotonic(), &ts);
+			pthread_cond_timedwait(&race->cond, &race->lock, &ts);
+		} else {
+			pthread_cond_wait(&race->cond, &race->lock);
+		}
+	}
+	/* Stop the losers at their next result. */
+	race->cancel = 1;
+	if (race->winner > 0) {
+		pthread_mutex_lock(&hedge_lock);
+		hedge_wins++;
+		pthread_mutex_unlock(&hedge_lock);
+	}
+	err = race->winner >= 0 || race->empty ? SLP_OK : race->err;
+	pthread_mutex_unlock(&race->lock);
+	Py_END_ALLOW_THREADS
+
+	if (err != SLP_OK)
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+	else
+		ret = slp_results_to_list(&race->res, 1);
+	hedge_race_unref(race);
+	free(scopes_buf);
+	free(scopes);
+
+	return ret;
+}
+
+/**
+ * Returns the hedged query statistics.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	Unused.
+ * @return	Dictionary with the queries, hedges (additional attempts
+ * 			started), hedge_wins (queries won by an additional attempt),
+ * 			samples (number of the latencies known) and delay (the 95th
+ * 			percentile hedge delay) items.
+ */
+static PyObject *py_slp_hedge_stats(PyObject *self, PyObject *args)
+{
+	PyObject *ret;
+	double delay = hedge_delay(95);
+
+	pthread_mutex_lock(&hedge_lock);
+	ret = Py_BuildValue("{s:k,s:k,s:k,s:n,s:d}", "queries", hedge_queries,
+			"hedges", hedge_launched, "hedge_wins", hedge_wins,
+			"samples", (Py_ssize_t) hedge_nlatencies, "delay", delay);
+	pthread_mutex_unlock(&hedge_lock);
+
+	return ret;
+}
+
+/**
+ * State shared by the SrvIterator object and its worker thread running
+ * SLPFindSrvs(). The results are passed through a bounded ring buffer: the
+ * libslp callback waits while it is full and the consumer waits (with the GIL
+ * released) while it is empty. Freed by whichever side drops the last
+ * reference.
+ *
+ * The handle is acquired on behalf of the consumer thread so that it gets
+ * SLP_HANDLE_IN_USE instead of a deadlock when using the handle while the
+ * iterator is paused; the ownership moves to the worker once the iterator is
+ * closed.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	slp_result_t *ring;
+	size_t size;
+	size_t head;
+	size_t count;
+	int done;
+	int cancelled;
+	int refs;
+	SLPError err;
+	SLPHandleObject *handle;
+	int holding;
+	pthread_t thread;
+	char *srvtype;
+	char *scopelist;
+	char *filter;
+} srv_stream_t;
+
+/**
+ * The python iterator over the SLPFindSrvs() results.
+ */
+typedef struct {
+	PyObject_HEAD
+	srv_stream_t *stream;
+	size_t yielded;
+} SLPSrvIteratorObject;
+
+static PyTypeObject SLPSrvIterator_Type;
+
+/**
+ * Drops one reference to the stream and frees it with the last one.
+ *
+ * @param stream	The stream.
+ * @param have_gil	Whether the caller holds the GIL (needed to drop the
+ * 					handle reference).
+ */
+static void srv_stream_unref(srv_stream_t *stream, int have_gil)
+{
+	PyGILState_STATE gstate;
+	int last;
+	size_t i;
+
+	pthread_mutex_lock(&stream->lock);
+	last = --stream->refs == 0;
+	pthread_mutex_unlock(&stream->lock);
+	if (!last)
+		return;
+
+	for (i = 0; i < stream->count; i++)
+		free(stream->ring[(stream->head + i) % stream->size].str);
+	free(stream->ring);
+	free(stream->srvtype);
+	free(stream->scopelist);
+	free(stream->filter);
+	pthread_cond_destroy(&stream->not_full);
+	pthread_cond_destroy(&stream->not_empty);
+	pthread_mutex_destroy(&stream->lock);
+	if (have_gil) {
+		Py_DECREF(stream->handle);
+	} else if (slp_gil_ensure(&gstate) == RET_OK) {
+		Py_DECREF(stream->handle);
+		PyGILState_Release(gstate);
+	}
+	free(stream);
+}
+
+/**
+ * SLPFindSrvs() callback of the streaming iterator; pushes the URL to the
+ * ring buffer. Runs without the GIL in the worker thread.
+ *
+ * @param hslp 		The SLPHandle used for the query.
+ * @param srvurl 	The URL of the found service.
+ * @param lifetime 	The lifetime of the service in seconds.
+ * @param errcode 	An error code indicating if an error occurred during
+ * 					the operation.
+ * @param cookie 	The srv_stream_t.
+ * @return	SLP_FALSE once the iterator was closed or on error, SLP_TRUE
+ * 			otherwise.
+ */
+static SLPBoolean stream_url_cb(SLPHandle hslp, const char* srvurl,
+		unsigned short lifetime, SLPError errcode, void* cookie)
+{
+	srv_stream_t *stream = (srv_stream_t *) cookie;
+	slp_result_t *item;
+	SLPBoolean ret = SLP_FALSE;
+
+	pthread_mutex_lock(&stream->lock);
+	if (errcode == SLP_OK) {
+		while (stream->count == stream->size && !stream->cancelled)
+			pthread_cond_wait(&stream->not_full, &stream->lock);
+		if (!stream->cancelled) {
+			item = &stream->ring[(stream->head + stream->count) % stream->size];
+			if ((item->str = strdup(srvurl))) {
+				item->len = strlen(srvurl);
+				item->lifetime = lifetime;
+				stream->count++;
+				pthread_cond_signal(&stream->not_empty);
+				ret = SLP_TRUE;
+			} else {
+				stream->err = SLP_MEMORY_ALLOC_FAILED;
+			}
+		}
+	} else if (errcode != SLP_LAST_CALL && stream->err == SLP_OK) {
+		stream->err = errcode;
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	return ret;
+}
+
+/**
+ * Worker thread of the streaming iterator. The handle was acquired for it by
+ * py_slp_iter_srvs().
+ *
+ * @param arg	The srv_stream_t.
+ * @return	NULL.
+ */
+static void *stream_worker(void *arg)
+{
+	srv_stream_t *stream = (srv_stream_t *) arg;
+	SLPHandleObject *handle = stream->handle;
+	SLPError err;
+
+	err = SLPFindSrvs(handle->hslp, stream->srvtype,
+			stream->scopelist, stream->filter, stream_url_cb, (void *)stream);
+
+	/* Same as slp_handle_release(), see srv_stream_cancel(). */
+	pthread_mutex_lock(&handle->lock);
+	stream->holding = 0;
+	handle->busy = 0;
+	pthread_cond_signal(&handle->cond);
+	pthread_mutex_unlock(&handle->lock);
+
+	pthread_mutex_lock(&stream->lock);
+	if (err != SLP_OK && stream->err == SLP_OK)
+		stream->err = err;
+	stream->done = 1;
+	pthread_cond_broadcast(&stream->not_empty);
+	pthread_mutex_unlock(&stream->lock);
+
+	srv_stream_unref(stream, 0);
+
+	return NULL;
+}
+
+/**
+ * Stops the worker at the next result it gets and drops the buffered ones.
+ * Hands the handle over to the worker if it is still running the query.
+ *
+ * @param stream	The stream.
+ */
+static void srv_stream_cancel(srv_stream_t *stream)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->cancelled = 1;
+	pthread_cond_broadcast(&stream->not_full);
+	pthread_mutex_unlock(&stream->lock);
+
+	pthread_mutex_lock(&stream->handle->lock);
+	if (stream->holding &&
+			pthread_equal(stream->handle->owner, pthread_self()))
+		stream->handle->owner = stream->thread;
+	pthread_mutex_unlock(&stream->handle->lock);
+}
+
+static void slp_srv_iter_tp_dealloc(SLPSrvIteratorObject *self)
+{
+	if (self->stream) {
+		srv_stream_cancel(self->stream);
+		srv_stream_unref(self->stream, 1);
+	}
+	PyObject_Del(self);
+}
+
+static PyObject *slp_srv_iter_tp_iternext(SLPSrvIteratorObject *self)
+{
+	srv_stream_t *stream = self->stream;
+	slp_result_t item = { NULL, 0, 0 };
+	SLPError err;
+	PyObject *ret;
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&stream->lock);
+	while (!stream->count && !stream->done && !stream->cancelled)
+		pthread_cond_wait(&stream->not_empty, &stream->lock);
+	if (stream->count && !stream->cancelled) {
+		item = stream->ring[stream->head];
+		stream->head = (stream->head + 1) % stream->size;
+		stream->count--;
+		pthread_cond_signal(&stream->not_full);
+	}
+	err = stream->err;
+	pthread_mutex_unlock(&stream->lock);
+	Py_END_ALLOW_THREADS
+
+	if (!item.str) {
+		/* Same as the find_*_list() functions: an error is raised only if
+		 * nothing has been found. */
+		if (err != SLP_OK && !self->yielded)
+			PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+
+	self->yielded++;
+	ret = Py_BuildValue("(s#i)", item.str, (Py_ssize_t) item.len,
+			item.lifetime);
+	free(item.str);
+
+	return ret;
+}
+
+static PyObject *slp_srv_iter_close(SLPSrvIteratorObject *self,
+		PyObject *unused)
+{
+	srv_stream_cancel(self->stream);
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+static PyMethodDef slp_srv_iter_methods[] = {
+	{ "close", (PyCFunction) slp_srv_iter_close, METH_NOARGS, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject SLPSrvIterator_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "slp.SrvIterator",
+	.tp_basicsize = sizeof(SLPSrvIteratorObject),
+	.tp_dealloc = (destructor) slp_srv_iter_tp_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_iter = PyObject_SelfIter,
+	.tp_iternext = (iternextfunc) slp_srv_iter_tp_iternext,
+	.tp_methods = slp_srv_iter_methods,
+};
+
+/**
+ * Streaming variant of SLPFindSrvs(): runs the query in a worker thread and
+ * returns an iterator yielding the results as they come.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen; it stays in use until
+ * 				the query finishes or the iterator is closed
+ *				srvtype: The service type string -- may be None or ""
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				filter: LDAPv3 search filter -- may be None or ""
+ *				maxsize: Number of results buffered before the query is
+ *				paused waiting for the consumer.
+ * @return	slp.SrvIterator yielding (url, lifetime) tuples, NULL +
+ * 			exception raised on error.
+ */
+static PyObject *py_slp_iter_srvs(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvtype", "scopelist", "filter",
+		"maxsize", NULL };
+	SLPSrvIteratorObject *iter;
+	srv_stream_t *stream;
+	PyObject *py_handle;
+	char *srvtype;
+	char *scopelist = NULL;
+	char *filter = NULL;
+	int maxsize = 64;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "Oz|zzi:iter_srvs", kwlist,
+				&py_handle, &srvtype, &scopelist, &filter, &maxsize) != RET_OK)
+		return NULL;
+	if (maxsize < 1) {
+		PyErr_SetString(PyExc_ValueError, "maxsize must be positive");
+		return NULL;
+	}
+	if (!acquire_slp_handle(py_handle))
+		return NULL;
+	if (!(iter = PyObject_New(SLPSrvIteratorObject, &SLPSrvIterator_Type))) {
+		slp_handle_release((SLPHandleObject *) py_handle);
+		return NULL;
+	}
+	iter->stream = NULL;
+	iter->yielded = 0;
+	if (!(stream = calloc(1, sizeof(srv_stream_t))) ||
+			!(stream->ring = calloc(maxsize, sizeof(slp_result_t))) ||
+			(srvtype && !(stream->srvtype = strdup(srvtype))) ||
+			(scopelist && !(stream->scopelist = strdup(scopelist))) ||
+			(filter && !(stream->filter = strdup(filter)))) {
+		if (stream) {
+			free(stream->ring);
+			free(stream->srvtype);
+			free(stream->scopelist);
+			free(stream->filter);
+			free(stream);
+		}
+		slp_handle_release((SLPHandleObject *) py_handle);
+		Py_DECREF(iter);
+		return PyErr_NoMemory();
+	}
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->not_empty, NULL);
+	pthread_cond_init(&stream->not_full, NULL);
+	stream->size = maxsize;
+	stream->refs = 2;
+	stream->holding = 1;
+	Py_INCREF(py_handle);
+	stream->handle = (SLPHandleObject *) py_handle;
+
+	if (pthread_create(&stream->thread, NULL, stream_worker, stream) != 0) {
+		slp_handle_release(stream->handle);
+		stream->refs = 1;
+		srv_stream_unref(stream, 1);
+		Py_DECREF(iter);
+		PyErr_SetString(PyExc_RuntimeError,
+				"Unable to start the SLP query thread");
+		return NULL;
+	}
+	pthread_detach(stream->thread);
+	iter->stream = stream;
+
+	return (PyObject *) iter;
+}
+
+/*
+ * Background discovery watcher.
+ *
+ * A native thread runs SLPFindSrvs() for the watched service types every
+ * interval seconds and publishes the results as an immutable snapshot. The
+ * current snapshot is swapped atomically (RCU-style): the readers take a
+ * reference to it without any lock nor libslp call, the writer frees the old
+ * snapshot once the readers which might have seen it are gone.
+ */
+
+/**
+ * One published round of the watcher. Never modified once published.
+ */
+typedef struct {
+	int refs;
+	unsigned long generation;
+	slp_results_t res;	/* sorted by URL, without duplicates */
+} watch_snapshot_t;
+
+/**
+ * State shared by the python object and the watcher thread. The subscribers
+ * list belongs to the python object; it is only touched with the GIL held and
+ * reset to NULL once the object is gone.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	volatile int stop;
+	char **types;
+	size_t ntypes;
+	char *scopelist;
+	char *lang;
+	double interval;
+	watch_snapshot_t *current;
+	int readers;
+	unsigned long generation;	/* of current, under lock for wait() */
+	SLPError err;
+	PyObject *subscribers;
+} watch_state_t;
+
+/**
+ * The python watcher object. The services tuple is built once per generation.
+ */
+typedef struct {
+	PyObject_HEAD
+	watch_state_t *state;
+	PyObject *subscribers;
+	PyObject *py_services;
+	unsigned long py_generation;
+} SLPWatcherObject;
+
+static PyTypeObject SLPWatcher_Type;
+
+/**
+ * Drops one reference to a snapshot. Does not need the GIL.
+ *
+ * @param snap	The snapshot.
+ */
+static void watch_snapshot_unref(watch_snapshot_t *snap)
+{
+	if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	slp_results_clear(&snap->res);
+	free(snap);
+}
+
+/**
+ * Takes a reference to the current snapshot. Lock-free: the readers counter
+ * keeps the writer from freeing the snapshot between the load and the
+ * reference.
+ *
+ * @param state	The watcher state.
+ * @return	The snapshot to be released by watch_snapshot_unref().
+ */
+static watch_snapshot_t *watch_snapshot_get(watch_state_t *state)
+{
+	watch_snapshot_t *snap;
+
+	__atomic_add_fetch(&state->readers, 1, __ATOMIC_SEQ_CST);
+	snap = __atomic_load_n(&state->current, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&snap->refs, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&state->readers, 1, __ATOMIC_SEQ_CST);
+
+	return snap;
+}
+
+/**
+ * Drops one reference to the watcher state and frees it with the last one.
+ * Does not need the GIL.
+ *
+ * @param state	The watcher state.
+ */
+static void watch_state_unref(watch_state_t *state)
+{
+	int last;
+	size_t i;
+
+	pthread_mutex_lock(&state->lock);
+	last = --state->refs == 0;
+	pthread_mutex_unlock(&state->lock);
+	if (!last)
+		return;
+
+	if (state->current)
+		watch_snapshot_unref(state->current);
+	for (i = 0; i < state->ntypes; i++)
+		free(state->types[i]);
+	free(state->types);
+	free(state->scopelist);
+	free(state->lang);
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+}
+
+static int watch_result_cmp(const void *a, const void *b)
+{
+	return strcmp(((const slp_result_t *) a)->str,
+			((const slp_result_t *) b)->str);
+}
+
+/**
+ * Sorts the results by URL and drops the duplicates, keeping the longest
+ * lifetime.
+ *
+ * @param res	The results.
+ */
+static void watch_results_sort(slp_results_t *res)
+{
+	size_t i;
+	size_t n = 0;
+
+	if (!res->count)
+		return;
+	qsort(res->items, res->count, sizeof(slp_result_t), watch_result_cmp);
+	for (i = 1; i < res->count; i++) {
+		if (strcmp(res->items[i].str, res->items[n].str)) {
+			res->items[++n] = res->items[i];
+		} else {
+			if (res->items[i].lifetime > res->items[n].lifetime)
+				res->items[n].lifetime = res->items[i].lifetime;
+			free(res->items[i].str);
+		}
+	}
+	res->count = n + 1;
+}
+
+/**
+ * Converts some of the snapshot URLs to a python list.
+ *
+ * @param res		The snapshot results.
+ * @param idx		Indexes of the URLs.
+ * @param count		Number of indexes.
+ * @return	New reference to the list, NULL with an exception raised on error.
+ */
+static PyObject *watch_delta_to_list(const slp_results_t *res,
+		const size_t *idx, size_t count)
+{
+	PyObject *list;
+	PyObject *item;
+	size_t i;
+
+	if (!(list = PyList_New(count)))
+		return NULL;
+	for (i = 0; i < count; i++) {
+		if (!(item = Py_BuildValue("(s#i)", res->items[idx[i]].str,
+						(Py_ssize_t) res->items[idx[i]].len,
+						res->items[idx[i]].lifetime))) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+
+	return list;
+}
+
+/**
+ * Computes the URLs added and removed between two snapshots and passes them
+ * to the subscribers as callback(added, removed). Both lists hold
+ * (url, lifetime) tuples. Runs in the watcher thread; the GIL is only taken
+ * if something changed.
+ *
+ * @param state	The watcher state.
+ * @param old	The previous snapshot.
+ * @param snap	The new snapshot.
+ */
+static void watch_notify(watch_state_t *state, const watch_snapshot_t *old,
+		const watch_snapshot_t *snap)
+{
+	const slp_results_t *a = &old->res;
+	const slp_results_t *b = &snap->res;
+	PyGILState_STATE gstate;
+	PyObject *subscribers;
+	PyObject *py_added;
+	PyObject *py_removed;
+	PyObject *ret;
+	size_t *added;
+	size_t *removed;
+	size_t nadded = 0;
+	size_t nremoved = 0;
+	size_t i = 0;
+	size_t j = 0;
+	Py_ssize_t k;
+	int cmp;
+
+	added = malloc((b->count + 1) * sizeof(size_t));
+	removed = malloc((a->count + 1) * sizeof(size_t));
+	if (!added || !removed) {
+		free(added);
+		free(removed);
+		return;
+	}
+	/* Both snapshots are sorted: one merge pass. */
+	while (i < a->count || j < b->count) {
+		if (i == a->count)
+			cmp = 1;
+		else if (j == b->count)
+			cmp = -1;
+		else
+			cmp = strcmp(a->items[i].str, b->items[j].str);
+		if (cmp < 0) {
+			removed[nremoved++] = i++;
+		} else if (cmp > 0) {
+			added[nadded++] = j++;
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	/* The interpreter may be gone: nobody to notify then. */
+	if ((nadded || nremoved) && slp_gil_ensure(&gstate) == RET_OK) {
+		if (state->subscribers && PyList_GET_SIZE(state->subscribers)) {
+			/* The callbacks may unsubscribe. */
+			subscribers = PyList_GetSlice(state->subscribers, 0,
+					PY_SSIZE_T_MAX);
+			py_added = watch_delta_to_list(b, added, nadded);
+			py_removed = watch_delta_to_list(a, removed, nremoved);
+			if (subscribers && py_added && py_removed) {
+				for (k = 0; k < PyList_GET_SIZE(subscribers); k++) {
+					ret = PyObject_CallFunctionObjArgs(
+							PyList_GET_ITEM(subscribers, k), py_added,
+							py_removed, NULL);
+					if (!ret)
+						PyErr_WriteUnraisable(PyList_GET_ITEM(subscribers,
+									k));
+					Py_XDECREF(ret);
+				}
+			} else {
+				PyErr_Clear();
+			}
+			Py_XDECREF(subscribers);
+			Py_XDECREF(py_added);
+			Py_XDECREF(py_removed);
+		}
+		PyGILState_Release(gstate);
+	}
+	free(added);
+	free(removed);
+}
+
+/**
+ * Runs one round of the watcher: queries all the watched service types.
+ *
+ * @param state	The watcher state.
+ * @param hslp	The SLP handle of the watcher thread.
+ * @param res	Where to gather the results.
+ * @return	SLP_OK if all the queries succeeded, the first error otherwise.
+ */
+static SLPError watch_round(watch_state_t *state, SLPHandle hslp,
+		slp_results_t *res)
+{
+	SLPError err = SLP_OK;
+	size_t i;
+
+	res->cancel = &state->stop;
+	for (i = 0; i < state->ntypes && err == SLP_OK && !state->stop; i++) {
+		err = SLPFindSrvs(hslp, state->types[i], state->scopelist, "",
+				collect_url_cb, (void *)res);
+		if (err == SLP_OK)
+			err = res->err;
+	}
+
+	return err;
+}
+
+/**
+ * The watcher thread. Publishes a new snapshot after each successful round;
+ * on error the previous snapshot stays current.
+ *
+ * @param arg	The watch_state_t.
+ * @return	NULL.
+ */
+static void *watch_thread(void *arg)
+{
+	watch_state_t *state = (watch_state_t *) arg;
+	watch_snapshot_t *snap;
+	watch_snapshot_t *old;
+	slp_results_t res = SLP_RESULTS_INIT;
+	SLPHandle hslp = NULL;
+	struct timespec ts;
+	SLPError err;
+
+	while (!state->stop) {
+		if (!hslp && (err = SLPOpen(state->lang, SLP_FALSE, &hslp)) !=
+				SLP_OK)
+			hslp = NULL;
+		else
+			err = watch_round(state, hslp, &res);
+		if (err == SLP_OK && !state->stop) {
+			if ((snap = calloc(1, sizeof(watch_snapshot_t)))) {
+				watch_results_sort(&res);
+				snap->refs = 1;
+				snap->res = res;
+				snap->res.cancel = NULL;
+				memset(&res, 0, sizeof(slp_results_t));
+				/* The thread is the only writer. */
+				old = state->current;
+				snap->generation = old->generation + 1;
+				__atomic_store_n(&state->current, snap, __ATOMIC_SEQ_CST);
+				/* Grace period: wait for the readers which may have loaded
+				 * the old pointer before taking their reference. */
+				while (__atomic_load_n(&state->readers, __ATOMIC_SEQ_CST))
+					sched_yield();
+				pthread_mutex_lock(&state->lock);
+				state->generation = snap->generation;
+				pthread_mutex_unlock(&state->lock);
+				watch_notify(state, old, snap);
+				watch_snapshot_unref(old);
+			} else {
+				err = SLP_MEMORY_ALLOC_FAILED;
+			}
+		}
+		slp_results_clear(&res);
+		res.err = SLP_OK;
+
+		pthread_mutex_lock(&state->lock);
+		state->err = err;
+		pthread_cond_broadcast(&state->cond);
+		slp_abstime(state->interval, &ts);
+		while (!state->stop &&
+				pthread_cond_timedwait(&state->cond, &state->lock, &ts) !=
+				ETIMEDOUT)
+			;
+		pthread_mutex_unlock(&state->lock);
+	}
+	if (hslp)
+		SLPClose(hslp);
+	watch_state_unref(state);
+
+	return NULL;
+}
+
+/**
+ * Asks the watcher thread to stop. The thread exits after the query in
+ * progress, at the next result it gets.
+ *
+ * @param state	The watcher state.
+ */
+static void watch_stop(watch_state_t *state)
+{
+	pthread_mutex_lock(&state->lock);
+	state->stop = 1;
+	pthread_cond_broadcast(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Copies a python string argument.
+ *
+ * @param obj	The string object.
+ * @return	The malloc()ed copy, NULL with an exception raised on error.
+ */
+static char *watch_strdup(PyObject *obj)
+{
+	const char *str;
+	char *ret;
+
+#if PY_MAJOR_VERSION >= 3
+	if (!PyUnicode_Check(obj)) {
+#else
+	if (!PyString_Check(obj)) {
+#endif
+		PyErr_SetString(PyExc_TypeError, "service types must be strings");
+		return NULL;
+	}
+#if PY_MAJOR_VERSION >= 3
+	if (!(str = PyUnicode_AsUTF8(obj)))
+#else
+	if (!(str = PyString_AsString(obj)))
+#endif
+		return NULL;
+	if (!(ret = strdup(str)))
+		PyErr_NoMemory();
+
+	return ret;
+}
+
+static PyObject *slp_watcher_tp_new(PyTypeObject *type, PyObject *args,
+		PyObject *kwargs)
+{
+	static char *kwlist[] = { "service_types", "scopes", "interval", "lang",
+		NULL };
+	SLPWatcherObject *self;
+	watch_state_t *state;
+	PyObject *py_types;
+	PyObject *seq;
+	char *scopelist = NULL;
+	char *lang = NULL;
+	double interval = 30.0;
+	pthread_t thread;
+	Py_ssize_t i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|zdz", kwlist,
+				&py_types, &scopelist, &interval, &lang))
+		return NULL;
+	if (interval <= 0) {
+		PyErr_SetString(PyExc_ValueError, "interval must be positive");
+		return NULL;
+	}
+#if PY_MAJOR_VERSION >= 3
+	if (PyUnicode_Check(py_types))
+#else
+	if (PyString_Check(py_types))
+#endif
+		seq = PyTuple_Pack(1, py_types);
+	else
+		seq = PySequence_Fast(py_types, "service_types must be a string "
+				"or a sequence of strings");
+	if (!seq)
+		return NULL;
+	if (!PySequence_Fast_GET_SIZE(seq)) {
+		Py_DECREF(seq);
+		PyErr_SetString(PyExc_ValueError, "no service type to watch");
+		return NULL;
+	}
+
+	if (!(self = (SLPWatcherObject *) type->tp_alloc(type, 0)) ||
+			!(self->subscribers = PyList_New(0))) {
+		Py_XDECREF(self);
+		Py_DECREF(seq);
+		return NULL;
+	}
+	if (!(state = calloc(1, sizeof(watch_state_t))) ||
+			!(state->current = calloc(1, sizeof(watch_snapshot_t))) ||
+			!(state->types = calloc(PySequence_Fast_GET_SIZE(seq),
+					sizeof(char *))) ||
+			(scopelist && !(state->scopelist = strdup(scopelist))) ||
+			(lang && !(state->lang = strdup(lang)))) {
+		if (state) {
+			free(state->current);
+			free(state->types);
+			free(state->scopelist);
+			free(state);
+		}
+		Py_DECREF(self);
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->cond, NULL);
+	state->refs = 1;
+	state->current->refs = 1;
+	state->interval = interval;
+	state->subscribers = self->subscribers;
+	self->state = state;
+	for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+		if (!(state->types[i] = watch_strdup(
+						PySequence_Fast_GET_ITEM(seq, i)))) {
+			Py_DECREF(self);
+			Py_DECREF(seq);
+			return NULL;
+		}
+		state->ntypes++;
+	}
+	Py_DECREF(seq);
+
+	state->refs++;
+	if (pthread_create(&thread, NULL, watch_thread, state) != 0) {
+		state->refs--;
+		Py_DECREF(self);
+		PyErr_SetString(PyExc_RuntimeError,
+				"Unable to start the SLP watcher thread");
+		return NULL;
+	}
+	pthread_detach(thread);
+
+	return (PyObject *) self;
+}
+
+static int slp_watcher_tp_traverse(SLPWatcherObject *self, visitproc visit,
+		void *arg)
+{
+	Py_VISIT(self->subscribers);
+	Py_VISIT(self->py_services);
+
+	return 0;
+}
+
+static int slp_watcher_tp_clear(SLPWatcherObject *self)
+{
+	if (self->state)
+		self->state->subscribers = NULL;
+	Py_CLEAR(self->subscribers);
+	Py_CLEAR(self->py_services);
+
+	return 0;
+}
+
+static void slp_watcher_tp_dealloc(SLPWatcherObject *self)
+{
+	PyObject_GC_UnTrack(self);
+	slp_watcher_tp_clear(self);
+	if (self->state) {
+		watch_stop(self->state);
+		watch_state_unref(self->state);
+	}
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/**
+ * Returns the services of the current snapshot as a tuple of
+ * (url, lifetime) tuples sorted by URL. The lifetimes are the ones reported
+ * by the round which found the services. No lock is taken and no SLP call is
+ * made.
+ */
+static PyObject *slp_watcher_services(SLPWatcherObject *self,
+		PyObject *unused)
+{
+	watch_snapshot_t *snap = watch_snapshot_get(self->state);
+	PyObject *ret;
+	PyObject *item;
+	size_t i;
+
+	if (self->py_services && self->py_generation == snap->generation) {
+		watch_snapshot_unref(snap);
+		Py_INCREF(self->py_services);
+		return self->py_services;
+	}
+	if (!(ret = PyTuple_New(snap->res.count))) {
+		watch_snapshot_unref(snap);
+		return NULL;
+	}
+	for (i = 0; i < snap->res.count; i++) {
+		if (!(item = Py_BuildValue("(s#i)", snap->res.items[i].str,
+						(Py_ssize_t) snap->res.items[i].len,
+						snap->res.items[i].lifetime))) {
+			watch_snapshot_unref(snap);
+			Py_DECREF(ret);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(ret, i, item);
+	}
+	Py_XDECREF(self->py_services);
+	Py_INCREF(ret);
+	self->py_services = ret;
+	self->py_generation = snap->generation;
+	watch_snapshot_unref(snap);
+
+	return ret;
+}
+
+static PyObject *slp_watcher_subscribe(SLPWatcherObject *self,
+		PyObject *callback)
+{
+	if (!PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "callback must be callable");
+		return NULL;
+	}
+	if (PyList_Append(self->subscribers, callback) < 0)
+		return NULL;
+
+	Py_INCREF(callback);
+
+	return callback;
+}
+
+static PyObject *slp_watcher_unsubscribe(SLPWatcherObject *self,
+		PyObject *callback)
+{
+	Py_ssize_t i;
+	int cmp;
+
+	for (i = 0; i < PyList_GET_SIZE(self->subscribers); i++) {
+		cmp = PyObject_RichCompareBool(PyList_GET_ITEM(self->subscribers, i),
+				callback, Py_EQ);
+		if (cmp < 0)
+			return NULL;
+		if (cmp) {
+			if (PyList_SetSlice(self->subscribers, i, i + 1, NULL) < 0)
+				return NULL;
+			Py_INCREF(Py_True);
+			return Py_True;
+		}
+	}
+
+	Py_INCREF(Py_False);
+
+	return Py_False;
+}
+
+/**
+ * Waits for a snapshot newer than the given generation.
+ *
+ * @param args	generation (default: the current one) and timeout (seconds,
+ * 				None to wait forever).
+ * @return	The current generation; unchanged if the timeout expired or the
+ * 			watcher is closed.
+ */
+static PyObject *slp_watcher_wait(SLPWatcherObject *self, PyObject *args,
+		PyObject *kwargs)
+{
+	static char *kwlist[] = { "generation", "timeout", NULL };
+	watch_state_t *state = self->state;
+	watch_snapshot_t *snap;
+	PyObject *py_generation = Py_None;
+	PyObject *py_timeout = Py_None;
+	unsigned long generation;
+	double timeout = -1;
+	struct timespec ts;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist,
+				&py_generation, &py_timeout))
+		return NULL;
+	if (py_timeout != Py_None &&
+			(timeout = PyFloat_AsDouble(py_timeout)) == -1 && PyErr_Occurred())
+		return NULL;
+	snap = watch_snapshot_get(state);
+	generation = snap->generation;
+	watch_snapshot_unref(snap);
+	if (py_generation != Py_None &&
+			(generation = PyLong_AsUnsignedLong(py_generation)) ==
+			(unsigned long) -1 && PyErr_Occurred())
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	if (timeout >= 0)
+		slp_abstime(timeout, &ts);
+	pthread_mutex_lock(&state->lock);
+	while (!state->stop && state->generation <= generation)
+		if (timeout < 0)
+			pthread_cond_wait(&state->cond, &state->lock);
+		else if (pthread_cond_timedwait(&state->cond, &state->lock, &ts) ==
+				ETIMEDOUT)
+			break;
+	pthread_mutex_unlock(&state->lock);
+	snap = watch_snapshot_get(state);
+	generation = snap->generation;
+	watch_snapshot_unref(snap);
+	Py_END_ALLOW_THREADS
+
+	return PyLong_FromUnsignedLong(generation);
+}
+
+static PyObject *slp_watcher_close(SLPWatcherObject *self, PyObject *unused)
+{
+	watch_stop(self->state);
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+static PyObject *slp_watcher_enter(SLPWatcherObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+
+	return (PyObject *) self;
+}
+
+static PyObject *slp_watcher_exit(SLPWatcherObject *self, PyObject *args)
+{
+	watch_stop(self->state);
+
+	Py_INCREF(Py_False);
+
+	return Py_False;
+}
+
+static PyObject *slp_watcher_get_generation(SLPWatcherObject *self,
+		void *closure)
+{
+	watch_snapshot_t *snap = watch_snapshot_get(self->state);
+	unsigned long generation = snap->generation;
+
+	watch_snapshot_unref(snap);
+
+	return PyLong_FromUnsignedLong(generation);
+}
+
+static PyObject *slp_watcher_get_error(SLPWatcherObject *self, void *closure)
+{
+	SLPError err;
+
+	pthread_mutex_lock(&self->state->lock);
+	err = self->state->err;
+	pthread_mutex_unlock(&self->state->lock);
+
+	return PyInt_FromLong(err);
+}
+
+static PyObject *slp_watcher_get_closed(SLPWatcherObject *self, void *closure)
+{
+	return PyBool_FromLong(self->state->stop);
+}
+
+static PyMethodDef slp_watcher_methods[] = {
+	{ "services", (PyCFunction) slp_watcher_services, METH_NOARGS, NULL },
+	{ "subscribe", (PyCFunction) slp_watcher_subscribe, METH_O, NULL },
+	{ "unsubscribe", (PyCFunction) slp_watcher_unsubscribe, METH_O, NULL },
+	{ "wait", (PyCFunction) slp_watcher_wait,
+		METH_VARARGS | METH_KEYWORDS, NULL },
+	{ "close", (PyCFunction) slp_watcher_close, METH_NOARGS, NULL },
+	{ "__enter__", (PyCFunction) slp_watcher_enter, METH_NOARGS, NULL },
+	{ "__exit__", (PyCFunction) slp_watcher_exit, METH_VARARGS, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef slp_watcher_getset[] = {
+	{ "generation", (getter) slp_watcher_get_generation, NULL, NULL, NULL },
+	{ "error", (getter) slp_watcher_get_error, NULL, NULL, NULL },
+	{ "closed", (getter) slp_watcher_get_closed, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject SLPWatcher_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "slp.Watcher",
+	.tp_basicsize = sizeof(SLPWatcherObject),
+	.tp_dealloc = (destructor) slp_watcher_tp_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_traverse = (traverseproc) slp_watcher_tp_traverse,
+	.tp_clear = (inquiry) slp_watcher_tp_clear,
+	.tp_methods = slp_watcher_methods,
+	.tp_getset = slp_watcher_getset,
+	.tp_new = slp_watcher_tp_new,
+};
+
+#if PY_VERSION_HEX >= 0x03050000
+/*
+ * asyncio support.
+ *
+ * The aio_*() functions queue the operation to a pool of native worker
+ * threads and return an awaitable slp.Operation. The worker runs the libslp
+ * call without the GIL, puts the finished operation to the completed list of
+ * the notifier of its event loop and writes a byte to the notifier pipe. The
+ * loop watches the pipe with add_reader() and resolves the futures of the
+ * finished operations. No thread per operation and no executor is involved.
+ *
+ * A worker is started whenever an operation is queued with no idle worker to
+ * take it, up to aio_max_workers; the workers idle for AIO_IDLE_SECONDS exit.
+ * The cancelled operations are dropped by their worker, taking the GIL,
+ * instead of going through the pipe. The loops only hold their notifier
+ * through its reader: once a loop is closed and dropped, the garbage
+ * collector frees its notifier with the operations completed for it, and
+ * those completing later are dropped by their worker.
+ */
+
+#define AIO_DEFAULT_WORKERS	64
+#define AIO_IDLE_SECONDS	30.0
+
+typedef enum {
+	AIO_FIND_SRVS,
+	AIO_FIND_ATTRS,
+	AIO_REG,
+	AIO_DEREG
+} aio_kind_t;
+
+/**
+ * Per event loop notifier: the self-pipe watched by the loop and the list of
+ * the operations completed by the workers.
+ */
+typedef struct {
+	PyObject_HEAD
+	int rfd;
+	int wfd;
+	/* protected by aio_lock */
+	struct _SLPOperationObject *completed;
+	int closed;
+	PyObject *weakreflist;
+} SLPAioNotifierObject;
+
+/**
+ * The awaitable operation. The workers hold a reference to it while it is
+ * queued or running; they touch only the C members.
+ */
+typedef struct _SLPOperationObject {
+	PyObject_HEAD
+	struct _SLPOperationObject *next;
+	aio_kind_t kind;
+	SLPHandleObject *handle;
+	SLPAioNotifierObject *notifier;
+	PyObject *future;
+	char *args[3];
+	unsigned short lifetime;
+	SLPBoolean fresh;
+	slp_results_t res;
+	SLPError err;
+	volatile int cancelled;
+} SLPOperationObject;
+
+static PyTypeObject SLPAioNotifier_Type;
+static PyTypeObject SLPOperation_Type;
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;
+static SLPOperationObject *aio_queue_head;
+static SLPOperationObject *aio_queue_tail;
+static size_t aio_nqueued;
+static int aio_nworkers;
+static int aio_nidle;
+static int aio_max_workers = AIO_DEFAULT_WORKERS;
+static PyObject *aio_notifiers;
+static pthread_once_t aio_hooks_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Runs the libslp call of the operation. Called by the workers without the
+ * GIL.
+ *
+ * @param op	The operation.
+ */
+static void aio_run(SLPOperationObject *op)
+{
+	SLPHandle hslp;
+
+	if ((op->err = slp_handle_wait(op->handle)) != SLP_OK)
+		return;
+	hslp = op->handle->hslp;
+	op->res.cancel = &op->cancelled;
+
+	switch (op->kind) {
+	case AIO_FIND_SRVS:
+		op->err = SLPFindSrvs(hslp, op->args[0], op->args[1], op->args[2],
+				collect_url_cb, (void *)&op->res);
+		break;
+	case AIO_FIND_ATTRS:
+		op->err = SLPFindAttrs(hslp, op->args[0], op->args[1], op->args[2],
+				collect_str_cb, (void *)&op->res);
+		break;
+	case AIO_REG:
+		op->err = SLPReg(hslp, op->args[0], op->lifetime, op->args[1],
+				op->args[2] ? op->args[2] : "", op->fresh, collect_report_cb,
+				(void *)&op->res);
+		break;
+	case AIO_DEREG:
+		op->err = SLPDereg(hslp, op->args[0], collect_report_cb,
+				(void *)&op->res);
+		break;
+	}
+	if (op->err == SLP_OK && op->res.err == SLP_OK) {
+		if (op->kind == AIO_REG)
+			reg_registered(op->args[0], op->args[1], op->args[2],
+					op->handle->lang, op->lifetime, op->fresh);
+		else if (op->kind == AIO_DEREG)
+			reg_forget(op->args[0]);
+	}
+	slp_handle_release(op->handle);
+}
+
+/**
+ * Drops the reference of the workers to an operation which is not handed to
+ * its loop. Leaked if the interpreter is exiting.
+ *
+ * @param op	The operation.
+ */
+static void aio_drop(SLPOperationObject *op)
+{
+	PyGILState_STATE gstate;
+
+	if (slp_gil_ensure(&gstate) != RET_OK)
+		return;
+	Py_DECREF(op);
+	PyGILState_Release(gstate);
+}
+
+/**
+ * The worker thread: runs the queued operations and hands them to their
+ * notifier. Exits once idle for AIO_IDLE_SECONDS or when the pool shrank.
+ *
+ * @param arg	Unused.
+ * @return	NULL.
+ */
+static void *aio_worker(void *arg)
+{
+	SLPAioNotifierObject *notifier;
+	SLPOperationObject *op;
+	struct timespec ts;
+	ssize_t ret;
+	int skip;
+	int timedout;
+
+	pthread_mutex_lock(&aio_lock);
+	for (;;) {
+		timedout = 0;
+		while (!aio_queue_head && !timedout &&
+				aio_nworkers <= aio_max_workers) {
+			slp_abstime(AIO_IDLE_SECONDS, &ts);
+			aio_nidle++;
+			timedout = pthread_cond_timedwait(&aio_cond, &aio_lock, &ts) ==
+				ETIMEDOUT;
+			aio_nidle--;
+		}
+		if (!aio_queue_head)
+			break;
+		op = aio_queue_head;
+		if (!(aio_queue_head = op->next))
+			aio_queue_tail = NULL;
+		aio_nqueued--;
+		skip = op->cancelled || op->notifier->closed;
+		pthread_mutex_unlock(&aio_lock);
+
+		if (!skip)
+			aio_run(op);
+
+		notifier = op->notifier;
+		pthread_mutex_lock(&aio_lock);
+		if (op->cancelled || notifier->closed) {
+			pthread_mutex_unlock(&aio_lock);
+			aio_drop(op);
+			pthread_mutex_lock(&aio_lock);
+			continue;
+		}
+		op->next = notifier->completed;
+		notifier->completed = op;
+		/* Written under the lock: the dispatcher may drop the last
+		 * reference to the notifier once it took the operation. */
+		do {
+			ret = write(notifier->wfd, "", 1);
+		} while (ret < 0 && errno == EINTR);
+	}
+	aio_nworkers--;
+	pthread_mutex_unlock(&aio_lock);
+
+	return NULL;
+}
+
+/**
+ * Queues the operation for the workers, starting one if none is idle.
+ * Steals the reference to the operation.
+ *
+ * @param op	The operation.
+ * @return	RET_OK (0) on success, RET_ERROR (-1) with an exception raised
+ * 			otherwise.
+ */
+static int aio_submit(SLPOperationObject *op)
+{
+	pthread_t thread;
+	int ret = RET_OK;
+
+	pthread_mutex_lock(&aio_lock);
+	if (aio_nqueued >= (size_t) aio_nidle &&
+			aio_nworkers < aio_max_workers &&
+			!pthread_create(&thread, NULL, aio_worker, NULL)) {
+		pthread_detach(thread);
+		aio_nworkers++;
+	}
+	if (aio_nworkers) {
+		op->next = NULL;
+		if (aio_queue_tail)
+			aio_queue_tail->next = op;
+		else
+			aio_queue_head = op;
+		aio_queue_tail = op;
+		aio_nqueued++;
+		pthread_cond_signal(&aio_cond);
+	} else {
+		ret = RET_ERROR;
+	}
+	pthread_mutex_unlock(&aio_lock);
+
+	if (ret != RET_OK) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"Unable to start the SLP worker threads");
+		Py_DECREF(op);
+	}
+
+	return ret;
+}
+
+/**
+ * Returns the notifier of the running event loop, creating it and registering
+ * its pipe with the loop on the first use. aio_notifiers maps the loops to
+ * weak references to their notifier.
+ *
+ * @param loop	The event loop.
+ * @return	New reference to the notifier, NULL with an exception raised on
+ * 			error.
+ */
+static SLPAioNotifierObject *aio_get_notifier(PyObject *loop)
+{
+	SLPAioNotifierObject *notifier = NULL;
+	PyObject *weakref;
+	PyObject *dispatch;
+	PyObject *ref;
+	PyObject *ret;
+	int fds[2];
+
+	if (!(weakref = PyImport_ImportModule("weakref")))
+		return NULL;
+	if (!aio_notifiers && !(aio_notifiers = PyObject_CallMethod(weakref,
+					"WeakKeyDictionary", NULL))) {
+		Py_DECREF(weakref);
+		return NULL;
+	}
+	if ((ref = PyObject_GetItem(aio_notifiers, loop))) {
+		notifier = (SLPAioNotifierObject *) PyWeakref_GetObject(ref);
+		if ((PyObject *) notifier != Py_None) {
+			Py_INCREF(notifier);
+			Py_DECREF(ref);
+			Py_DECREF(weakref);
+			return notifier;
+		}
+		Py_DECREF(ref);
+	} else if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+		Py_DECREF(weakref);
+		return NULL;
+	}
+	PyErr_Clear();
+
+	if (pipe(fds) < 0) {
+		Py_DECREF(weakref);
+		return (SLPAioNotifierObject *) PyErr_SetFromErrno(PyExc_OSError);
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	if (!(notifier = PyObject_GC_New(SLPAioNotifierObject,
+					&SLPAioNotifier_Type))) {
+		Py_DECREF(weakref);
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+	notifier->rfd = fds[0];
+	notifier->wfd = fds[1];
+	notifier->completed = NULL;
+	notifier->closed = 0;
+	notifier->weakreflist = NULL;
+	PyObject_GC_Track(notifier);
+
+	ref = PyObject_CallMethod(weakref, "ref", "O", notifier);
+	Py_DECREF(weakref);
+	if (!ref || !(dispatch = PyObject_GetAttrString((PyObject *) notifier,
+					"_dispatch"))) {
+		Py_XDECREF(ref);
+		Py_DECREF(notifier);
+		return NULL;
+	}
+	ret = PyObject_CallMethod(loop, "add_reader", "iO", notifier->rfd,
+			dispatch);
+	Py_DECREF(dispatch);
+	if (!ret || PyObject_SetItem(aio_notifiers, loop, ref) < 0) {
+		Py_XDECREF(ret);
+		Py_DECREF(ref);
+		Py_DECREF(notifier);
+		return NULL;
+	}
+	Py_DECREF(ret);
+	Py_DECREF(ref);
+
+	return notifier;
+}
+
+/**
+ * Resolves the future of a completed operation unless it was cancelled.
+ *
+ * @param op	The operation.
+ * @return	RET_OK (0) on success, RET_ERROR (-1) with an exception raised
+ * 			otherwise.
+ */
+static int aio_resolve(SLPOperationObject *op)
+{
+	PyObject *py_done;
+	PyObject *result = NULL;
+	PyObject *ret;
+	SLPError err = op->err;
+	int done;
+
+	if (!(py_done = PyObject_CallMethod(op->future, "done", NULL)))
+		return RET_ERROR;
+	done = PyObject_IsTrue(py_done);
+	Py_DECREF(py_done);
+	if (done)
+		return RET_OK;
+
+	if (err == SLP_OK && (op->kind == AIO_REG || op->kind == AIO_DEREG))
+		err = op->res.err;
+	else if (err == SLP_OK && op->res.count == 0)
+		err = op->res.err;
+
+	if (err == SLP_PARAMETER_BAD && !op->handle->hslp) {
+		result = PyObject_CallFunction(PyExc_ValueError, "s",
+				"The SLP handle is closed");
+	} else if (err != SLP_OK) {
+		result = PyObject_CallFunction(PyExc_RuntimeError, "s",
+				get_slp_error_msg(err));
+	}
+	if (result) {
+		ret = PyObject_CallMethod(op->future, "set_exception", "O", result);
+	} else {
+		if (PyErr_Occurred())
+			return RET_ERROR;
+		if (op->kind == AIO_REG || op->kind == AIO_DEREG) {
+			Py_INCREF(Py_None);
+			result = Py_None;
+		} else if (!(result = slp_results_to_list(&op->res,
+						op->kind == AIO_FIND_SRVS))) {
+			return RET_ERROR;
+		}
+		ret = PyObject_CallMethod(op->future, "set_result", "O", result);
+	}
+	Py_DECREF(result);
+	Py_XDECREF(ret);
+
+	return ret ? RET_OK : RET_ERROR;
+}
+
+/**
+ * The add_reader() callback: drains the pipe and resolves the futures of the
+ * completed operations.
+ */
+static PyObject *slp_aio_notifier_dispatch(SLPAioNotifierObject *self,
+		PyObject *unused)
+{
+	SLPOperationObject *op;
+	SLPOperationObject *next;
+	char buf[256];
+
+	while (read(self->rfd, buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&aio_lock);
+	op = self->completed;
+	self->completed = NULL;
+	pthread_mutex_unlock(&aio_lock);
+
+	for (; op; op = next) {
+		next = op->next;
+		if (aio_resolve(op) != RET_OK)
+			PyErr_WriteUnraisable(op->future);
+		/* The reference held by the workers. */
+		Py_DECREF(op);
+	}
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+/* The notifier holds the reference of the workers to the operations it
+ * completed. */
+static int slp_aio_notifier_tp_traverse(SLPAioNotifierObject *self,
+		visitproc visit, void *arg)
+{
+	SLPOperationObject *op;
+	int ret = 0;
+
+	pthread_mutex_lock(&aio_lock);
+	for (op = self->completed; op && !ret; op = op->next)
+		ret = visit((PyObject *) op, arg);
+	pthread_mutex_unlock(&aio_lock);
+
+	return ret;
+}
+
+/**
+ * Drops the completed operations; the workers drop those completing later.
+ */
+static int slp_aio_notifier_tp_clear(SLPAioNotifierObject *self)
+{
+	SLPOperationObject *op;
+	SLPOperationObject *next;
+
+	pthread_mutex_lock(&aio_lock);
+	self->closed = 1;
+	op = self->completed;
+	self->completed = NULL;
+	pthread_mutex_unlock(&aio_lock);
+	for (; op; op = next) {
+		next = op->next;
+		Py_DECREF(op);
+	}
+
+	return 0;
+}
+
+static void slp_aio_notifier_tp_dealloc(SLPAioNotifierObject *self)
+{
+	PyObject_GC_UnTrack(self);
+	if (self->weakreflist)
+		PyObject_ClearWeakRefs((PyObject *) self);
+	slp_aio_notifier_tp_clear(self);
+	close(self->rfd);
+	close(self->wfd);
+	PyObject_GC_Del(self);
+}
+
+static PyMethodDef slp_aio_notifier_methods[] = {
+	{ "_dispatch", (PyCFunction) slp_aio_notifier_dispatch, METH_NOARGS,
+		NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject SLPAioNotifier_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "slp._AioNotifier",
+	.tp_basicsize = sizeof(SLPAioNotifierObject),
+	.tp_dealloc = (destructor) slp_aio_notifier_tp_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_traverse = (traverseproc) slp_aio_notifier_tp_traverse,
+	.tp_clear = (inquiry) slp_aio_notifier_tp_clear,
+	.tp_weaklistoffset = offsetof(SLPAioNotifierObject, weakreflist),
+	.tp_methods = slp_aio_notifier_methods,
+};
+
+/* The future holds the operation through its done callback. */
+static int slp_operation_tp_traverse(SLPOperationObject *self, visitproc visit,
+		void *arg)
+{
+	Py_VISIT(self->handle);
+	Py_VISIT(self->notifier);
+	Py_VISIT(self->future);
+
+	return 0;
+}
+
+static int slp_operation_tp_clear(SLPOperationObject *self)
+{
+	Py_CLEAR(self->future);
+
+	return 0;
+}
+
+static void slp_operation_tp_dealloc(SLPOperationObject *self)
+{
+	int i;
+
+	PyObject_GC_UnTrack(self);
+	Py_XDECREF(self->handle);
+	Py_XDECREF(self->notifier);
+	Py_XDECREF(self->future);
+	for (i = 0; i < 3; i++)
+		free(self->args[i]);
+	slp_results_clear(&self->res);
+	PyObject_GC_Del(self);
+}
+
+static PyObject *slp_operation_am_await(SLPOperationObject *self)
+{
+	return PyObject_CallMethod(self->future, "__await__", NULL);
+}
+
+static PyObject *slp_operation_cancel(SLPOperationObject *self,
+		PyObject *unused)
+{
+	self->cancelled = 1;
+
+	return PyObject_CallMethod(self->future, "cancel", NULL);
+}
+
+static PyObject *slp_operation_done(SLPOperationObject *self,
+		PyObject *unused)
+{
+	return PyObject_CallMethod(self->future, "done", NULL);
+}
+
+/**
+ * The done callback of the future: a future cancelled by the task awaiting
+ * it stops the query at its next result.
+ */
+static PyObject *slp_operation_future_done(SLPOperationObject *self,
+		PyObject *future)
+{
+	PyObject *cancelled;
+
+	if (!(cancelled = PyObject_CallMethod(future, "cancelled", NULL)))
+		return NULL;
+	if (PyObject_IsTrue(cancelled))
+		self->cancelled = 1;
+	Py_DECREF(cancelled);
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+static PyMethodDef slp_operation_methods[] = {
+	{ "cancel", (PyCFunction) slp_operation_cancel, METH_NOARGS, NULL },
+	{ "done", (PyCFunction) slp_operation_done, METH_NOARGS, NULL },
+	{ "_future_done", (PyCFunction) slp_operation_future_done, METH_O,
+		NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyAsyncMethods slp_operation_as_async = {
+	.am_await = (unaryfunc) slp_operation_am_await,
+};
+
+static PyTypeObject SLPOperation_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "slp.Operation",
+	.tp_basicsize = sizeof(SLPOperationObject),
+	.tp_dealloc = (destructor) slp_operation_tp_dealloc,
+	.tp_as_async = &slp_operation_as_async,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_traverse = (traverseproc) slp_operation_tp_traverse,
+	.tp_clear = (inquiry) slp_operation_tp_clear,
+	.tp_methods = slp_operation_methods,
+};
+
+/**
+ * Creates the operation bound to the running event loop and queues it.
+ *
+ * @param kind			What libslp function to call.
+ * @param py_handle		The python handle object.
+ * @param arg0, arg1, arg2	The string arguments of the libslp function, may
+ * 						be NULL.
+ * @return	New reference to the operation, NULL with an exception raised on
+ * 			error.
+ */
+static SLPOperationObject *aio_operation_new(aio_kind_t kind,
+		PyObject *py_handle, const char *arg0, const char *arg1,
+		const char *arg2)
+{
+	SLPOperationObject *op;
+	PyObject *asyncio;
+	PyObject *loop;
+	PyObject *done;
+	PyObject *ret = NULL;
+	const char *args[3] = { arg0, arg1, arg2 };
+	int i;
+
+	if (!SLPHandle_Check(py_handle)) {
+		PyErr_SetString(PyExc_TypeError, "Invalid SLP handle");
+		return NULL;
+	}
+	if (((SLPHandleObject *) py_handle)->isasync) {
+		PyErr_SetString(PyExc_ValueError, "The function does not support "
+				"asynchronous SLP handles");
+		return NULL;
+	}
+	if (!(asyncio = PyImport_ImportModule("asyncio")))
+		return NULL;
+	if (PyObject_HasAttrString(asyncio, "get_running_loop"))
+		loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+	else
+		loop = PyObject_CallMethod(asyncio, "get_event_loop", NULL);
+	Py_DECREF(asyncio);
+	if (!loop)
+		return NULL;
+
+	if (!(op = PyObject_GC_New(SLPOperationObject, &SLPOperation_Type))) {
+		Py_DECREF(loop);
+		return NULL;
+	}
+	op->next = NULL;
+	op->kind = kind;
+	Py_INCREF(py_handle);
+	op->handle = (SLPHandleObject *) py_handle;
+	op->lifetime = 0;
+	op->fresh = SLP_TRUE;
+	memset(&op->res, 0, sizeof(op->res));
+	op->err = SLP_OK;
+	op->cancelled = 0;
+	for (i = 0; i < 3; i++)
+		op->args[i] = NULL;
+	op->future = PyObject_CallMethod(loop, "create_future", NULL);
+	op->notifier = aio_get_notifier(loop);
+	Py_DECREF(loop);
+	PyObject_GC_Track(op);
+	if (op->future && op->notifier && (done = PyObject_GetAttrString(
+					(PyObject *) op, "_future_done"))) {
+		ret = PyObject_CallMethod(op->future, "add_done_callback", "O",
+				done);
+		Py_DECREF(done);
+	}
+	if (!ret) {
+		Py_DECREF(op);
+		return NULL;
+	}
+	Py_DECREF(ret);
+	for (i = 0; i < 3; i++) {
+		if (args[i] && !(op->args[i] = strdup(args[i]))) {
+			Py_DECREF(op);
+			return (SLPOperationObject *) PyErr_NoMemory();
+		}
+	}
+
+	return op;
+}
+
+/**
+ * Queues the operation and returns it to the caller.
+ *
+ * @param op	The operation.
+ * @return	The operation, NULL with an exception raised on error.
+ */
+static PyObject *aio_start(SLPOperationObject *op)
+{
+	if (!op)
+		return NULL;
+	/* The reference for the workers, dropped by the dispatcher. */
+	Py_INCREF(op);
+	if (aio_submit(op) != RET_OK) {
+		Py_DECREF(op);
+		return NULL;
+	}
+
+	return (PyObject *) op;
+}
+
+/**
+ * asyncio variant of SLPFindSrvs().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvtype: The service type string -- may be None or ""
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				filter: LDAPv3 search filter -- may be None or ""
+ * @return	slp.Operation resolving to the list of (url, lifetime) tuples,
+ * 			NULL + exception raised on error.
+ */
+static PyObject *py_slp_aio_findsrvs(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvtype", "scopelist", "filter", NULL };
+	PyObject *py_handle;
+	char *srvtype;
+	char *scopelist = NULL;
+	char *filter = NULL;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "Oz|zz:aio_find_srvs", kwlist,
+				&py_handle, &srvtype, &scopelist, &filter) != RET_OK)
+		return NULL;
+
+	return aio_start(aio_operation_new(AIO_FIND_SRVS, py_handle, srvtype,
+				scopelist, filter));
+}
+
+/**
+ * asyncio variant of SLPFindAttrs().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvurl: The service URL of the service to the attributes of.
+ *				scopelist: Comma separated list of scope names -- may be ""
+ *				attrids: A comma separated list of attribute ids to return.
+ *				"" or None for all attributes.
+ * @return	slp.Operation resolving to the list of the attribute lists,
+ * 			NULL + exception raised on error.
+ */
+static PyObject *py_slp_aio_findattrs(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvurl", "scopelist", "attrids", NULL };
+	PyObject *py_handle;
+	char *srvurl;
+	char *scopelist = NULL;
+	char *attrids = NULL;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "Os|zz:aio_find_attrs", kwlist,
+				&py_handle, &srvurl, &scopelist, &attrids) != RET_OK)
+		return NULL;
+
+	return aio_start(aio_operation_new(AIO_FIND_ATTRS, py_handle, srvurl,
+				scopelist, attrids));
+}
+
+/**
+ * asyncio variant of SLPReg().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvurl: The service URL to register.
+ * 				lifetime: The lifetime of the service in seconds.
+ *				srvtype: Ignored, see SLPReg().
+ *				attrs: Attributes of the registered service.
+ *				fresh: True if the registration is new, False for
+ *				re-registration
+ * @return	slp.Operation resolving to None, NULL + exception raised on
+ * 			error.
+ */
+static PyObject *py_slp_aio_reg(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvurl", "lifetime", "srvtype",
+		"attrs", "fresh", NULL };
+	SLPOperationObject *op;
+	PyObject *py_handle;
+	PyObject *py_fresh = Py_True;
+	char *srvurl;
+	char *srvtype = NULL;
+	char *attrs = NULL;
+	unsigned short lifetime;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "OsH|zzO:aio_reg", kwlist,
+				&py_handle, &srvurl, &lifetime, &srvtype, &attrs,
+				&py_fresh) != RET_OK)
+		return NULL;
+
+	if ((op = aio_operation_new(AIO_REG, py_handle, srvurl, srvtype,
+					attrs))) {
+		op->lifetime = lifetime;
+		op->fresh = PyObject_IsTrue(py_fresh);
+	}
+
+	return aio_start(op);
+}
+
+/**
+ * asyncio variant of SLPDereg().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvurl: The service URL of the service to be deregistered.
+ * @return	slp.Operation resolving to None, NULL + exception raised on
+ * 			error.
+ */
+static PyObject *py_slp_aio_dereg(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvurl", NULL };
+	PyObject *py_handle;
+	char *srvurl;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "Os:aio_dereg", kwlist,
+				&py_handle, &srvurl) != RET_OK)
+		return NULL;
+
+	return aio_start(aio_operation_new(AIO_DEREG, py_handle, srvurl, NULL,
+				NULL));
+}
+
+/**
+ * Sets the maximum number of the asyncio worker threads. The workers above a
+ * lowered maximum exit once idle.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The number of the workers, "workers".
+ * @return	None.
+ */
+static PyObject *py_slp_aio_set_workers(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "workers", NULL };
+	int workers;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "i:aio_set_workers", kwlist,
+				&workers) != RET_OK)
+		return NULL;
+	if (workers < 1) {
+		PyErr_SetString(PyExc_ValueError, "At least one worker is needed");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&aio_lock);
+	aio_max_workers = workers;
+	pthread_cond_broadcast(&aio_cond);
+	pthread_mutex_unlock(&aio_lock);
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+/**
+ * pthread_atfork() handler keeping aio_lock consistent across fork().
+ */
+static void aio_fork_prepare(void)
+{
+	pthread_mutex_lock(&aio_lock);
+}
+
+/**
+ * pthread_atfork() handler of the parent process.
+ */
+static void aio_fork_parent(void)
+{
+	pthread_mutex_unlock(&aio_lock);
+}
+
+/**
+ * pthread_atfork() handler of the child process. The workers do not exist
+ * there: the child forgets the queued operations of the loops of the parent
+ * (leaking them) and starts its own workers on demand.
+ */
+static void aio_fork_child(void)
+{
+	aio_queue_head = aio_queue_tail = NULL;
+	aio_nqueued = 0;
+	aio_nworkers = aio_nidle = 0;
+	pthread_cond_init(&aio_cond, NULL);
+	pthread_mutex_unlock(&aio_lock);
+}
+
+/**
+ * Installs the fork hooks of the asyncio workers, once per process.
+ */
+static void aio_hooks_install(void)
+{
+	pthread_atfork(aio_fork_prepare, aio_fork_parent, aio_fork_child);
+}
+#endif /* PY_VERSION_HEX >= 0x03050000 */
+
+/**
+ * Interface function for SLPReg().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ * 				lifetime: An unsigned short giving the lifetime of the service
+ * 				in seconds.
+ *				srvtype: Ignored, mandated by the RFC 2614, see OpenSLP
+ *				documentation for the details.
+ *				attrs: Attributes of the registered service. Ex. "(Attr1=val1)"
+ *				fresh: True if the registration is new, False for
+ *				re-registration
+ *				callback: te python object representing the callback function to
+ *				be called.
+ *				cookie: arbitrary data to be passed to the callback.
+ * @return	None on success, NULL + exception raised on error.
+ */
+static PyObject *py_slp_reg(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvurl", "lifetime", "srvtype", "attrs", "fresh", "callback", "cookie", NULL };
+	SLPHandleObject *handle;
+	PyObject *py_handle;
+	PyObject *py_callback;
+	PyObject *py_cookie;
+	PyObject *py_fresh;
+	char *srvurl;
+	char *srvtype;
+	char *attrs;
+	unsigned short lifetime;
+	SLPBoolean fresh;
+	SLPError err;
+	SLPError report = SLP_OK;
+	cb_cookie_t *cookie;
+	
+	if (slp_parse_args(SLP_FASTCALL_PASS, "OsHzzOOO:SLPReg", kwlist,
+				&py_handle, &srvurl, &lifetime, &srvtype, &attrs, &py_fresh,
+				&py_callback, &py_cookie) != RET_OK)
+		return NULL;
+	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
+			&handle, &cookie) != RET_OK)
+		return NULL;
+	fresh = PyObject_IsTrue(py_fresh);
+	if (handle->isasync)
+		return async_submit(handle, ASYNC_REG, cookie, srvurl, srvtype,
+				attrs, lifetime, fresh);
+
+	cookie->report = &report;
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPReg(handle->hslp, srvurl, lifetime, srvtype, attrs, fresh, reg_report_cb,
+			(void *)cookie);
+	if (err == SLP_OK && report == SLP_OK)
+		reg_registered(srvurl, srvtype, attrs, handle->lang, lifetime, fresh);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+	/* The python callback may have raised while the GIL was re-acquired. */
+	if (PyErr_Occurred())
+		return NULL;
+
+	Py_INCREF(Py_None);
+	
+	return Py_None;
+}
+
+/**
+ * Interface function for SLPDereg().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvurl: The service URL of the service to be deregistered.
+ *				callback: te python object representing the callback function to
+ *				be called.
+ *				cookie: arbitrary data to be passed to the callback.
+ * @return	None on success, NULL + exception raised on error.
+ */
+static PyObject *py_slp_dereg(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvurl", "callback", "cookie", NULL };
+	SLPHandleObject *handle;
+	PyObject *py_handle;
+	PyObject *py_callback;
+	PyObject *py_cookie;
+	char *srvurl;
+	SLPError err;
+	SLPError report = SLP_OK;
+	cb_cookie_t *cookie;
+	
+	if (slp_parse_args(SLP_FASTCALL_PASS, "OsOO:SLPDereg", kwlist,
+				&py_handle, &srvurl, &py_callback, &py_cookie) != RET_OK)
+		return NULL;
+	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
+			&handle, &cookie) != RET_OK)
+		return NULL;
+	if (handle->isasync)
+		return async_submit(handle, ASYNC_DEREG, cookie, srvurl, NULL, NULL,
+				0, SLP_FALSE);
+
+	cookie->report = &report;
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPDereg(handle->hslp, srvurl, reg_report_cb, (void *)cookie);
+	if (err == SLP_OK && report == SLP_OK)
+		reg_forget(srvurl);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+	/* The python callback may have raised while the GIL was re-acquired. */
+	if (PyErr_Occurred())
+		return NULL;
+
+	Py_INCREF(Py_None);
+
+	return Py_None;
+}
+
+/**
+ * Interface function for SLPDelAttrs().
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				hslp: SLPHandle returned from SLPOpen
+ *				srvurl: The service URL of the service to be deregistered.
+ *				attrs: Comma separated list of the attributes to be deleted.
+ *				callback: te python object representing the callback function to
+ *				be called.
+ *				cookie: arbitrary data to be passed to the callback.
+ * @return	None on success, NULL + exception raised on error.
+ */
+static PyObject *py_slp_delattrs(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "hslp", "srvurl", "attrs", "callback", "cookie", NULL };
+	SLPHandleObject *handle;
+	PyObject *py_handle;
+	PyObject *py_callback;
+	PyObject *py_cookie;
+	char *srvurl;
+	char *attrs;
+	SLPError err;
+	SLPError report = SLP_OK;
+	cb_cookie_t *cookie;
+	
+	if (slp_parse_args(SLP_FASTCALL_PASS, "OssOO:SLPDelAttrs", kwlist,
+				&py_handle, &srvurl, &attrs, &py_callback,
+				&py_cookie) != RET_OK)
+		return NULL;
+	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
+			&handle, &cookie) != RET_OK)
+		return NULL;
+	if (handle->isasync)
+		return async_submit(handle, ASYNC_DELATTRS, cookie, srvurl, attrs,
+				NULL, 0, SLP_FALSE);
+
+	cookie->report = &report;
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPDelAttrs(handle->hslp, srvurl, attrs, reg_report_cb, (void *)cookie);
+	if (err == SLP_OK && report == SLP_OK)
+		reg_amend(srvurl, NULL, NULL, attrs, NULL, 0);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+	/* The python callback may have raised while the GIL was re-acquired. */
+	if (PyErr_Occurred())
+		return NULL;
+
+	Py_INCREF(Py_None);
+	
+	return Py_None;
+}
+
+/* Default number of the workers of the bulk operations. */
+#define REG_BATCH_WORKERS		4
+/* Maximum number of the workers of a bulk operation. */
+#define REG_BATCH_MAX_WORKERS	64
+
+/**
+ * One registration or deregistration of a bulk operation.
+ */
+typedef struct {
+	const char *srvurl;
+	const char *attrs;
+	unsigned short lifetime;
+	SLPError err;
+	int done;
+} reg_item_t;
+
+/**
+ * Bulk registration or deregistration, see reg_batch_run(). The workers take
+ * the items in turn through the shared next index, each one on its own
+ * handle, so that several requests are in flight to slpd at once.
+ *
+ * The workers hold references to the operation: with a deadline the caller
+ * may return while some of them are still waiting for slpd. The strings of the
+ * items are then owned by the operation (own_strings set), otherwise they are
+ * borrowed from the caller which waits for all the workers.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	int running;
+	reg_item_t *items;
+	size_t count;
+	size_t next;
+	int own_strings;
+	int dereg;
+	SLPBoolean fresh;
+	const char *srvtype;
+	char *lang;
+	/* slp_monotonic() time after which the items left fail, 0 for none */
+	double deadline;
+	SLPError open_err;
+} reg_batch_t;
+
+/**
+ * Allocates a bulk operation.
+ *
+ * @param count	Number of the items.
+ * @param lang	Language of the handles, may be NULL.
+ * @return	The operation with one reference, NULL if out of memory.
+ */
+static reg_batch_t *reg_batch_new(size_t count, const char *lang)
+{
+	reg_batch_t *batch;
+
+	if (!(batch = calloc(1, sizeof(reg_batch_t))))
+		return NULL;
+	if ((count && !(batch->items = calloc(count, sizeof(reg_item_t)))) ||
+			(lang && !(batch->lang = strdup(lang)))) {
+		free(batch->items);
+		free(batch);
+		return NULL;
+	}
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->cond, NULL);
+	batch->refs = 1;
+	batch->count = count;
+	batch->srvtype = "";
+
+	return batch;
+}
+
+/**
+ * Drops a reference to the bulk operation. Does not need the GIL.
+ *
+ * @param batch	The operation.
+ */
+static void reg_batch_unref(reg_batch_t *batch)
+{
+	size_t i;
+	int refs;
+
+	pthread_mutex_lock(&batch->lock);
+	refs = --batch->refs;
+	pthread_mutex_unlock(&batch->lock);
+	if (refs)
+		return;
+	if (batch->own_strings)
+		for (i = 0; i < batch->count; i++)
+			free((char *) batch->items[i].srvurl);
+	pthread_mutex_destroy(&batch->lock);
+	pthread_cond_destroy(&batch->cond);
+	free(batch->items);
+	free(batch->lang);
+	free(batch);
+}
+
+/**
+ * Worker of a bulk operation. Runs without the GIL.
+ *
+ * @param arg	The reg_batch_t; the reference of the worker is dropped.
+ * @return	NULL.
+ */
+static void *reg_batch_worker(void *arg)
+{
+	reg_batch_t *batch = (reg_batch_t *) arg;
+	slp_results_t res = SLP_RESULTS_INIT;
+	reg_item_t *item;
+	SLPHandle hslp;
+	SLPError err;
+	size_t i;
+
+	if ((err = SLPOpen(batch->lang, SLP_FALSE, &hslp)) != SLP_OK) {
+		pthread_mutex_lock(&batch->lock);
+		batch->open_err = err;
+		goto out;
+	}
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+			batch->count) {
+		item = &batch->items[i];
+		if (batch->deadline > 0 && slp_monotonic() >= batch->deadline) {
+			err = SLP_NETWORK_TIMED_OUT;
+		} else {
+			res.err = SLP_OK;
+			if (batch->dereg)
+				err = SLPDereg(hslp, item->srvurl, collect_report_cb,
+						(void *)&res);
+			else
+				err = SLPReg(hslp, item->srvurl, item->lifetime,
+						batch->srvtype, item->attrs, batch->fresh,
+						collect_report_cb, (void *)&res);
+			if (err == SLP_OK)
+				err = res.err;
+		}
+		pthread_mutex_lock(&batch->lock);
+		item->err = err;
+		item->done = 1;
+		pthread_mutex_unlock(&batch->lock);
+		if (err != SLP_OK)
+			continue;
+		if (batch->dereg)
+			reg_forget(item->srvurl);
+		else
+			reg_registered(item->srvurl, batch->srvtype, item->attrs,
+					batch->lang, item->lifetime, batch->fresh);
+	}
+	SLPClose(hslp);
+	pthread_mutex_lock(&batch->lock);
+out:
+	batch->running--;
+	pthread_cond_broadcast(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+	reg_batch_unref(batch);
+
+	return NULL;
+}
+
+/**
+ * Runs a bulk operation on up to workers threads and waits for them, at most
+ * until the deadline of the operation if set. Does not need the GIL.
+ *
+ * @param batch		The operation.
+ * @param workers	Maximum number of the workers.
+ * @param errs		Where to store the error codes of the items: the ones
+ * 					still in progress at the deadline get SLP_NETWORK_TIMED_OUT,
+ * 					the ones no worker could take (none of them could open a
+ * 					handle) the SLPOpen() error.
+ */
+static void reg_batch_run(reg_batch_t *batch, int workers, SLPError *errs)
+{
+	struct timespec ts;
+	pthread_t thread;
+	double left;
+	size_t i;
+
+	if ((size_t) workers > batch->count)
+		workers = (int) batch->count;
+	pthread_mutex_lock(&batch->lock);
+	while (batch->running < workers) {
+		batch->refs++;
+		batch->running++;
+		if (pthread_create(&thread, NULL, reg_batch_worker, batch) != 0) {
+			batch->refs--;
+			batch->running--;
+			break;
+		}
+		pthread_detach(thread);
+	}
+	if (!batch->running && batch->count) {
+		/* No thread could be started: do the work here. */
+		batch->refs++;
+		batch->running++;
+		pthread_mutex_unlock(&batch->lock);
+		reg_batch_worker(batch);
+		pthread_mutex_lock(&batch->lock);
+	}
+	while (batch->running) {
+		if (batch->deadline <= 0) {
+			pthread_cond_wait(&batch->cond, &batch->lock);
+			continue;
+		}
+		if ((left = batch->deadline - slp_monotonic()) <= 0)
+			break;
+		slp_abstime(left, &ts);
+		pthread_cond_timedwait(&batch->cond, &batch->lock, &ts);
+	}
+	for (i = 0; i < batch->count; i++)
+		errs[i] = batch->items[i].done ? batch->items[i].err :
+			(batch->running ? SLP_NETWORK_TIMED_OUT : batch->open_err);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * Registers many services at once.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				registrations: Sequence of (srvurl, lifetime) or (srvurl,
+ * 				lifetime, attrs) tuples.
+ *				srvtype: Ignored by OpenSLP, see SLPReg().
+ *				fresh: True if the registrations are new, False for
+ *				re-registrations.
+ *				workers: Number of the registrations in flight at once, each
+ *				on its own handle (4 by default).
+ *				lang: Language of the handles, may be None.
+ * @return	List of the SLP error codes, one per registration (SLP_OK for the
+ * 			successful ones); NULL + exception raised on a bad argument.
+ */
+static PyObject *py_slp_reg_many(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "registrations", "srvtype", "fresh", "workers",
+		"lang", NULL };
+	reg_batch_t *batch = NULL;
+	SLPError *errs = NULL;
+	PyObject *py_regs;
+	PyObject *py_fresh = NULL;
+	PyObject *seq;
+	PyObject *item;
+	PyObject *ret = NULL;
+	char *srvtype = NULL;
+	char *lang = NULL;
+	int workers = REG_BATCH_WORKERS;
+	int fresh = 1;
+	Py_ssize_t count;
+	Py_ssize_t i;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "O|zOiz:reg_many", kwlist,
+				&py_regs, &srvtype, &py_fresh, &workers, &lang) != RET_OK)
+		return NULL;
+	if (workers < 1 || workers > REG_BATCH_MAX_WORKERS) {
+		PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d",
+				REG_BATCH_MAX_WORKERS);
+		return NULL;
+	}
+	if (py_fresh && (fresh = PyObject_IsTrue(py_fresh)) < 0)
+		return NULL;
+	/* The tuples are immutable: their strings stay valid without the GIL. */
+	if (!(seq = PySequence_Tuple(py_regs)))
+		return NULL;
+
+	count = PyTuple_GET_SIZE(seq);
+	if (!(batch = reg_batch_new(count, lang)) ||
+			!(errs = malloc((count ? count : 1) * sizeof(SLPError)))) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	batch->fresh = fresh ? SLP_TRUE : SLP_FALSE;
+	if (srvtype)
+		batch->srvtype = srvtype;
+	for (i = 0; i < count; i++) {
+		item = PyTuple_GET_ITEM(seq, i);
+		if (!PyTuple_Check(item)) {
+			PyErr_SetString(PyExc_TypeError, "The registrations must be "
+					"(srvurl, lifetime[, attrs]) tuples");
+			goto out;
+		}
+		batch->items[i].attrs = "";
+		if (!PyArg_ParseTuple(item, "sH|z:reg_many", &batch->items[i].srvurl,
+					&batch->items[i].lifetime, &batch->items[i].attrs))
+			goto out;
+		if (!batch->items[i].attrs)
+			batch->items[i].attrs = "";
+	}
+
+	/* Without a deadline all the workers are over once this returns. */
+	Py_BEGIN_ALLOW_THREADS
+	reg_batch_run(batch, workers, errs);
+	Py_END_ALLOW_THREADS
+	if (!(ret = PyList_New(count)))
+		goto out;
+	for (i = 0; i < count; i++) {
+		if (!(item = PyInt_FromLong(errs[i]))) {
+			Py_CLEAR(ret);
+			goto out;
+		}
+		PyList_SET_ITEM(ret, i, item);
+	}
+out:
+	if (batch)
+		reg_batch_unref(batch);
+	free(errs);
+	Py_DECREF(seq);
+
+	return ret;
+}
+
+/* Number of the registry hash buckets. */
+#define REG_BUCKETS			256
+/* Number of the slots of the refresh timing wheel, one per second. */
+#define REG_WHEEL_SLOTS		512
+/* Number of the candidate seconds a refresh may be spread over. */
+#define REG_SPREAD			32
+/* Seconds before retrying a failed refresh. */
+#define REG_RETRY			5
+
+/**
+ * One live registration made through this module, see reg_track(). The
+ * entries are refreshed by reg_refresh_thread() shortly before they expire.
+ *
+ * The entries due for a refresh are linked into the slot of their due second
+ * in the timing wheel; the ones due more than REG_WHEEL_SLOTS seconds later
+ * stay in the slot for more turns of the wheel.
+ */
+typedef struct _reg_entry_s {
+	int refs;
+	char *srvurl;
+	char *srvtype;
+	char *attrs;
+	char *lang;
+	unsigned short lifetime;
+	unsigned long hash;
+	/* slp_monotonic() time of the last successful registration */
+	double registered;
+	/* second of the next refresh, see reg_schedule() */
+	unsigned long due;
+	int scheduled;
+	/* the refresh thread is registering the entry */
+	int inflight;
+	/* removed from the registry: deregistered or replaced (superseded) */
+	int removed;
+	int superseded;
+	struct _reg_entry_s *chain;
+	struct _reg_entry_s *wheel_prev;
+	struct _reg_entry_s *wheel_next;
+} reg_entry_t;
+
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reg_cond = PTHREAD_COND_INITIALIZER;
+static reg_entry_t *reg_buckets[REG_BUCKETS];
+static size_t reg_count;
+static reg_entry_t *reg_wheel[REG_WHEEL_SLOTS];
+static unsigned int reg_wheel_load[REG_WHEEL_SLOTS];
+/* the last second processed by the refresh thread, 0 before its first pass */
+static unsigned long reg_tick;
+static pthread_t reg_thread;
+static int reg_running;
+static int reg_stop;
+/* set by the refresh thread once it stopped */
+static int reg_exited;
+
+static unsigned long reg_refreshes;
+static unsigned long reg_failures;
+static unsigned long reg_late;
+static unsigned long reg_orphans;
+
+/**
+ * Current second of the refresh timing wheel.
+ *
+ * @return	The second.
+ */
+static unsigned long reg_now(void)
+{
+	return (unsigned long) slp_monotonic();
+}
+
+/**
+ * Drops a reference to the entry. Called with reg_lock held.
+ *
+ * @param entry	The entry.
+ */
+static void reg_entry_unref(reg_entry_t *entry)
+{
+	if (--entry->refs)
+		return;
+	free(entry->srvurl);
+	free(entry->srvtype);
+	free(entry->attrs);
+	free(entry->lang);
+	free(entry);
+}
+
+/**
+ * Finds the registration of the URL. Called with reg_lock held.
+ *
+ * @param srvurl	The service URL.
+ * @param hash		cache_hash() of the URL.
+ * @return	The entry or NULL.
+ */
+static reg_entry_t *reg_find(const char *srvurl, unsigned long hash)
+{
+	reg_entry_t *entry;
+
+	for (entry = reg_buckets[hash % REG_BUCKETS]; entry; entry = entry->chain)
+		if (entry->hash == hash && !strcmp(entry->srvurl, srvurl))
+			return entry;
+
+	return NULL;
+}
+
+/**
+ * Takes the entry off the timing wheel. Called with reg_lock held.
+ *
+ * @param entry	The entry.
+ */
+static void reg_unschedule(reg_entry_t *entry)
+{
+	unsigned long slot = entry->due % REG_WHEEL_SLOTS;
+
+	if (!entry->scheduled)
+		return;
+	if (entry->wheel_prev)
+		entry->wheel_prev->wheel_next = entry->wheel_next;
+	else
+		reg_wheel[slot] = entry->wheel_next;
+	if (entry->wheel_next)
+		entry->wheel_next->wheel_prev = entry->wheel_prev;
+	entry->wheel_prev = entry->wheel_next = NULL;
+	entry->scheduled = 0;
+	reg_wheel_load[slot]--;
+}
+
+/**
+ * Puts the entry on the timing wheel. Called with reg_lock held.
+ *
+ * The refresh is due at three quarters of the lifetime, but never sooner than
+ * SLPGetRefreshInterval() seconds after the registration. To avoid bursts the
+ * least loaded second of the eighth of the lifetime before that is picked
+ * (REG_SPREAD seconds at most).
+ *
+ * @param entry	The entry, not scheduled.
+ * @param delay	Seconds from now to refresh the entry in, 0 to compute them
+ * 				from the lifetime.
+ */
+static void reg_schedule(reg_entry_t *entry, unsigned long delay)
+{
+	unsigned long now = reg_now();
+	unsigned long min = SLPGetRefreshInterval();
+	unsigned long span;
+	unsigned long best;
+	unsigned long d;
+	unsigned long i;
+
+	/* The permanent registrations need no refresh. */
+	if (entry->lifetime == SLP_LIFETIME_MAXIMUM)
+		return;
+	if (!delay) {
+		if (min < 1)
+			min = 1;
+		if ((delay = entry->lifetime * 3 / 4) < min)
+			delay = min;
+		if ((span = entry->lifetime / 8) > REG_SPREAD)
+			span = REG_SPREAD;
+		if (span > delay - min)
+			span = delay - min;
+		/* The candidates are visited from a point depending on the URL so
+		 * that the ties do not all end up in the same second. */
+		for (best = delay, i = 0; i <= span; i++) {
+			d = delay - (entry->hash + i) % (span + 1);
+			if (reg_wheel_load[(now + d) % REG_WHEEL_SLOTS] <
+					reg_wheel_load[(now + best) % REG_WHEEL_SLOTS])
+				best = d;
+		}
+		delay = best;
+	}
+	entry->due = now + delay;
+	entry->wheel_prev = NULL;
+	entry->wheel_next = reg_wheel[entry->due % REG_WHEEL_SLOTS];
+	if (entry->wheel_next)
+		entry->wheel_next->wheel_prev = entry;
+	reg_wheel[entry->due % REG_WHEEL_SLOTS] = entry;
+	reg_wheel_load[entry->due % REG_WHEEL_SLOTS]++;
+	entry->scheduled = 1;
+}
+
+/**
+ * Removes the entry from the registry. Called with reg_lock held.
+ *
+ * @param entry		The entry.
+ * @param superseded	Whether the entry is replaced by a new registration of
+ * 						the same URL.
+ */
+static void reg_remove(reg_entry_t *entry, int superseded)
+{
+	reg_entry_t **pp;
+
+	for (pp = &reg_buckets[entry->hash % REG_BUCKETS]; *pp != entry;
+			pp = &(*pp)->chain)
+		;
+	*pp = entry->chain;
+	reg_unschedule(entry);
+	entry->removed = 1;
+	entry->superseded = superseded;
+	reg_count--;
+	reg_entry_unref(entry);
+}
+
+/**
+ * Allocates a registry entry.
+ *
+ * @param srvurl	The service URL.
+ * @param srvtype	The service type, may be NULL.
+ * @param attrs		The attributes, may be NULL.
+ * @param lang		Language of the handle, may be NULL.
+ * @param lifetime	The lifetime of the registration.
+ * @return	The entry with one reference, NULL if out of memory.
+ */
+static reg_entry_t *reg_entry_new(const char *srvurl, const char *srvtype,
+		const char *attrs, const char *lang, unsigned short lifetime)
+{
+	reg_entry_t *entry;
+
+	if (!(entry = calloc(1, sizeof(reg_entry_t))))
+		return NULL;
+	entry->refs = 1;
+	entry->hash = cache_hash(srvurl, strlen(srvurl));
+	entry->lifetime = lifetime;
+	entry->registered = slp_monotonic();
+	if (!(entry->srvurl = strdup(srvurl)) ||
+			!(entry->srvtype = strdup(srvtype ? srvtype : "")) ||
+			!(entry->attrs = strdup(attrs ? attrs : "")) ||
+			(lang && !(entry->lang = strdup(lang)))) {
+		/* Not shared yet, reg_lock is not needed. */
+		reg_entry_unref(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/**
+ * Adds the entry to the registry in place of the previous registration of the
+ * URL. Called with reg_lock held.
+ *
+ * @param entry	The new entry; the registry takes over its reference.
+ * @param delay	Seconds to the refresh of the entry, see reg_schedule().
+ */
+static void reg_insert(reg_entry_t *entry, unsigned long delay)
+{
+	reg_entry_t *old;
+
+	if ((old = reg_find(entry->srvurl, entry->hash))) {
+		/* A refresh in flight may overwrite this registration with the old
+		 * attributes: register again at once. */
+		if (old->inflight)
+			delay = 1;
+		reg_remove(old, 1);
+	}
+	entry->chain = reg_buckets[entry->hash % REG_BUCKETS];
+	reg_buckets[entry->hash % REG_BUCKETS] = entry;
+	reg_count++;
+	reg_schedule(entry, delay);
+}
+
+/**
+ * Records a successful registration so that it gets refreshed. Replaces the
+ * previous registration of the URL. Does not need the GIL.
+ *
+ * @param srvurl	The service URL.
+ * @param srvtype	The service type, may be NULL.
+ * @param attrs		The attributes, may be NULL.
+ * @param lang		Language of the handle, may be NULL.
+ * @param lifetime	The lifetime of the registration.
+ */
+static void reg_track(const char *srvurl, const char *srvtype,
+		const char *attrs, const char *lang, unsigned short lifetime)
+{
+	reg_entry_t *entry;
+
+	if (!(entry = reg_entry_new(srvurl, srvtype, attrs, lang, lifetime)))
+		return;
+	pthread_mutex_lock(&reg_lock);
+	reg_insert(entry, 0);
+	pthread_mutex_unlock(&reg_lock);
+}
+
+/**
+ * Applies an incremental registration (fresh set to false) or an attribute
+ * deletion to the registration of the URL, see attr_merge(). The entry is
+ * replaced by an amended copy. Does not need the GIL.
+ *
+ * @param srvurl	The service URL.
+ * @param srvtype	The service type, may be NULL.
+ * @param add		The registered attributes, may be NULL.
+ * @param del		The deleted attribute ids, may be NULL.
+ * @param lang		Language of the handle, may be NULL.
+ * @param lifetime	The lifetime of the incremental registration, 0 for an
+ * 					attribute deletion which does not renew the registration.
+ */
+static void reg_amend(const char *srvurl, const char *srvtype,
+		const char *add, const char *del, const char *lang,
+		unsigned short lifetime)
+{
+	unsigned long hash = cache_hash(srvurl, strlen(srvurl));
+	unsigned long now = reg_now();
+	unsigned long delay = 0;
+	reg_entry_t *entry = NULL;
+	reg_entry_t *old;
+	char *attrs;
+
+	pthread_mutex_lock(&reg_lock);
+	if (!(old = reg_find(srvurl, hash))) {
+		pthread_mutex_unlock(&reg_lock);
+		/* Registered elsewhere: the attributes are only known if new. */
+		if (lifetime)
+			reg_track(srvurl, srvtype, add, lang, lifetime);
+		return;
+	}
+	if ((attrs = attr_merge(old->attrs, add, del)))
+		entry = reg_entry_new(srvurl, old->srvtype, attrs, old->lang,
+				lifetime ? lifetime : old->lifetime);
+	free(attrs);
+	if (entry) {
+		if (!lifetime) {
+			/* Keep the refresh of the registration where it was. */
+			entry->registered = old->registered;
+			if (old->scheduled)
+				delay = old->due > now ? old->due - now : 1;
+		}
+		reg_insert(entry, delay);
+	}
+	pthread_mutex_unlock(&reg_lock);
+}
+
+/**
+ * Records a successful registration, see reg_track() and reg_amend(). Does not
+ * need the GIL.
+ *
+ * @param srvurl	The service URL.
+ * @param srvtype	The service type, may be NULL.
+ * @param attrs		The attributes, may be NULL.
+ * @param lang		Language of the handle, may be NULL.
+ * @param lifetime	The lifetime of the registration.
+ * @param fresh		The fresh flag given to SLPReg().
+ */
+static void reg_registered(const char *srvurl, const char *srvtype,
+		const char *attrs, const char *lang, unsigned short lifetime,
+		SLPBoolean fresh)
+{
+	if (fresh)
+		reg_track(srvurl, srvtype, attrs, lang, lifetime);
+	else
+		reg_amend(srvurl, srvtype, attrs, NULL, lang, lifetime);
+}
+
+/**
+ * Forgets the registration of a deregistered URL. Does not need the GIL.
+ *
+ * @param srvurl	The service URL.
+ */
+static void reg_forget(const char *srvurl)
+{
+	unsigned long hash = cache_hash(srvurl, strlen(srvurl));
+	reg_entry_t *entry;
+
+	pthread_mutex_lock(&reg_lock);
+	if ((entry = reg_find(srvurl, hash)))
+		reg_remove(entry, 0);
+	pthread_mutex_unlock(&reg_lock);
+}
+
+/**
+ * Collects the entries due by the given second. Called with reg_lock held.
+ * The entries are taken off the wheel and marked in flight.
+ *
+ * @param slot	The slot to look at.
+ * @param tick	The second.
+ * @param due	The array of the due entries, grown as needed.
+ * @param ndue	Number of the entries in the array.
+ * @param alloc	Allocated size of the array.
+ */
+static void reg_collect(unsigned long slot, unsigned long tick,
+		reg_entry_t ***due, size_t *ndue, size_t *alloc)
+{
+	reg_entry_t *entry;
+	reg_entry_t *next;
+	reg_entry_t **grown;
+
+	for (entry = reg_wheel[slot]; entry; entry = next) {
+		next = entry->wheel_next;
+		if (entry->due > tick)
+			continue;
+		if (*ndue == *alloc) {
+			if (!(grown = realloc(*due, (*alloc ? 2 * *alloc : 64) *
+							sizeof(reg_entry_t *))))
+				return;
+			*due = grown;
+			*alloc = *alloc ? 2 * *alloc : 64;
+		}
+		reg_unschedule(entry);
+		entry->inflight = 1;
+		entry->refs++;
+		(*due)[(*ndue)++] = entry;
+	}
+}
+
+/**
+ * The refresh thread: re-registers the due entries once a second. Does not
+ * use the GIL. The registrations are sent on a handle of the thread, reopened
+ * when the language of the entries changes. Once asked to stop, it puts the
+ * due entries it did not start back on the wheel.
+ *
+ * @param arg	Unused.
+ * @return	NULL.
+ */
+static void *reg_refresh_thread(void *arg)
+{
+	reg_entry_t **due = NULL;
+	reg_entry_t *entry;
+	size_t ndue;
+	size_t alloc = 0;
+	size_t i;
+	unsigned long now;
+	unsigned long tick;
+	struct timespec ts;
+	SLPHandle hslp = NULL;
+	char *lang = NULL;
+	SLPError err;
+	slp_results_t res = SLP_RESULTS_INIT;
+	double start;
+	int orphan;
+
+	pthread_mutex_lock(&reg_lock);
+	while (!reg_stop) {
+		now = reg_now();
+		ndue = 0;
+		if (!reg_tick || now - reg_tick >= REG_WHEEL_SLOTS) {
+			/* First pass, or stopped or stalled for a whole turn: the
+			 * registrations made due meanwhile may be anywhere. */
+			for (i = 0; i < REG_WHEEL_SLOTS; i++)
+				reg_collect(i, now, &due, &ndue, &alloc);
+		} else {
+			for (tick = reg_tick + 1; tick <= now; tick++)
+				reg_collect(tick % REG_WHEEL_SLOTS, now, &due, &ndue, &alloc);
+		}
+		reg_tick = now;
+		pthread_mutex_unlock(&reg_lock);
+
+		for (i = 0; i < ndue; i++) {
+			entry = due[i];
+			pthread_mutex_lock(&reg_lock);
+			if (reg_stop) {
+				for (; i < ndue; i++) {
+					due[i]->inflight = 0;
+					if (!due[i]->removed)
+						reg_schedule(due[i], 1);
+					reg_entry_unref(due[i]);
+				}
+				pthread_mutex_unlock(&reg_lock);
+				break;
+			}
+			pthread_mutex_unlock(&reg_lock);
+			if (!hslp || (entry->lang ? !lang || strcmp(entry->lang, lang) :
+						lang != NULL)) {
+				if (hslp)
+					SLPClose(hslp);
+				free(lang);
+				lang = entry->lang ? strdup(entry->lang) : NULL;
+				if (SLPOpen(lang, SLP_FALSE, &hslp) != SLP_OK)
+					hslp = NULL;
+			}
+			start = slp_monotonic();
+			res.err = SLP_OK;
+			err = hslp ? SLPReg(hslp, entry->srvurl, entry->lifetime,
+					entry->srvtype, entry->attrs, SLP_TRUE, collect_report_cb,
+					(void *)&res) : SLP_NETWORK_INIT_FAILED;
+			if (err == SLP_OK)
+				err = res.err;
+			/* Deregistered meanwhile: take back the refresh. */
+			pthread_mutex_lock(&reg_lock);
+			orphan = err == SLP_OK && entry->removed && !entry->superseded;
+			pthread_mutex_unlock(&reg_lock);
+			if (orphan)
+				SLPDereg(hslp, entry->srvurl, collect_report_cb, (void *)&res);
+
+			pthread_mutex_lock(&reg_lock);
+			reg_refreshes++;
+			reg_orphans += orphan;
+			if (start > entry->registered + entry->lifetime)
+				reg_late++;
+			entry->inflight = 0;
+			if (err != SLP_OK)
+				reg_failures++;
+			if (!entry->removed) {
+				if (err == SLP_OK)
+					entry->registered = start;
+				reg_schedule(entry, err == SLP_OK ? 0 : REG_RETRY);
+			}
+			reg_entry_unref(entry);
+			pthread_mutex_unlock(&reg_lock);
+		}
+
+		pthread_mutex_lock(&reg_lock);
+		if (reg_stop)
+			break;
+		slp_abstime(reg_now() + 1 - slp_monotonic(), &ts);
+		pthread_cond_timedwait(&reg_cond, &reg_lock, &ts);
+	}
+	reg_exited = 1;
+	/* reg_at_exit() may be waiting. */
+	pthread_cond_broadcast(&reg_cond);
+	pthread_mutex_unlock(&reg_lock);
+	if (hslp)
+		SLPClose(hslp);
+	free(lang);
+	free(due);
+
+	return NULL;
+}
+
+/**
+ * Starts or stops the refresh thread. Called without the GIL.
+ *
+ * @param enabled	Whether the registrations are to be refreshed.
+ * @return	0 on success, the pthread_create() error otherwise.
+ */
+static int reg_refresh_enable(int enabled)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&reg_lock);
+	if (enabled && !reg_running) {
+		reg_stop = 0;
+		reg_exited = 0;
+		if (!(err = pthread_create(&reg_thread, NULL, reg_refresh_thread,
+						NULL)))
+			reg_running = 1;
+		pthread_mutex_unlock(&reg_lock);
+	} else if (!enabled && reg_running) {
+		reg_stop = 1;
+		reg_running = 0;
+		pthread_cond_signal(&reg_cond);
+		pthread_mutex_unlock(&reg_lock);
+		pthread_join(reg_thread, NULL);
+	} else {
+		pthread_mutex_unlock(&reg_lock);
+	}
+
+	return err;
+}
+
+/**
+ * Turns the automatic refresh of the registrations on or off.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				enabled: Whether to refresh the registrations (True by
+ * 				default).
+ * @return	None, NULL + exception raised on error.
+ */
+static PyObject *py_slp_refresh_configure(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "enabled", NULL };
+	PyObject *py_enabled = NULL;
+	int enabled = 1;
+	int err;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "|O:refresh_configure", kwlist,
+				&py_enabled) != RET_OK)
 		return NULL;
-	
-	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
-			&hslp, &cookie) != RET_OK)
+	if (py_enabled && (enabled = PyObject_IsTrue(py_enabled)) < 0)
 		return NULL;
 
-	if ((err = SLPFindSrvTypes(hslp, namingauth, scopelist, srv_attr_type_cb,
-					(void *)cookie)) != SLP_OK) {
-		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+	Py_BEGIN_ALLOW_THREADS
+	err = reg_refresh_enable(enabled);
+	Py_END_ALLOW_THREADS
+	if (err) {
+		errno = err;
+		PyErr_SetFromErrno(PyExc_OSError);
 		return NULL;
 	}
 
 	Py_INCREF(Py_None);
-	
+
 	return Py_None;
 }
 
 /**
- * Interface function for SLPFindAttrs().
+ * Returns the counters of the automatic refresh.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	Unused.
+ * @return	Dictionary of the counters.
+ */
+static PyObject *py_slp_refresh_stats(PyObject *self, PyObject *args)
+{
+	PyObject *ret;
+
+	pthread_mutex_lock(&reg_lock);
+	ret = Py_BuildValue("{s:O,s:n,s:k,s:k,s:k,s:k}",
+			"enabled", reg_running ? Py_True : Py_False,
+			"registrations", (Py_ssize_t) reg_count,
+			"refreshes", reg_refreshes,
+			"failed", reg_failures,
+			"late", reg_late,
+			"orphans", reg_orphans);
+	pthread_mutex_unlock(&reg_lock);
+
+	return ret;
+}
+
+/**
+ * Brings the registration of the URL to the given attributes with the
+ * fewest requests: nothing if they did not change, otherwise an incremental
+ * registration (fresh set to false) of the new and changed attributes and
+ * SLPDelAttrs() for the removed ones. Falls back on a full registration for
+ * the URLs missing from the registry, a lifetime change or if the incremental
+ * registration or SLPDelAttrs() is not implemented. Does not need the GIL.
+ *
+ * @param hslp		The SLPHandle to use.
+ * @param lang		Language of the handle, may be NULL.
+ * @param srvurl	The service URL.
+ * @param srvtype	The service type, may be NULL.
+ * @param attrs		The wanted attributes.
+ * @param lifetime	The lifetime, 0 to keep the registered one.
+ * @param sent		Set to non-zero if any request was sent.
+ * @return	The error of the first failed request, SLP_OK if none.
+ */
+static SLPError reg_update(SLPHandle hslp, const char *lang,
+		const char *srvurl, const char *srvtype, const char *attrs,
+		unsigned short lifetime, int *sent)
+{
+	slp_results_t res = SLP_RESULTS_INIT;
+	reg_entry_t *entry;
+	unsigned short old_lifetime = 0;
+	char *old = NULL;
+	char *add = NULL;
+	char *del = NULL;
+	int full = 1;
+	int added = 0;
+	int deleted = 0;
+	SLPError err = SLP_OK;
+
+	*sent = 0;
+	pthread_mutex_lock(&reg_lock);
+	if ((entry = reg_find(srvurl, cache_hash(srvurl, strlen(srvurl))))) {
+		old_lifetime = entry->lifetime;
+		old = strdup(entry->attrs);
+	}
+	pthread_mutex_unlock(&reg_lock);
+	if (!lifetime)
+		lifetime = old_lifetime ? old_lifetime : SLP_LIFETIME_DEFAULT;
+
+	if (old && lifetime == old_lifetime &&
+			attr_diff(old, attrs, &add, &del) == RET_OK) {
+		full = 0;
+		if (*add) {
+			*sent = 1;
+			res.err = SLP_OK;
+			if ((err = SLPReg(hslp, srvurl, lifetime, srvtype ? srvtype : "",
+							add, SLP_FALSE, collect_report_cb,
+							(void *)&res)) == SLP_OK)
+				err = res.err;
+			if (err == SLP_NOT_IMPLEMENTED)
+				full = 1;
+			added = err == SLP_OK;
+		}
+		if (!full && err == SLP_OK && *del) {
+			*sent = 1;
+			res.err = SLP_OK;
+			if ((err = SLPDelAttrs(hslp, srvurl, del, collect_report_cb,
+							(void *)&res)) == SLP_OK)
+				err = res.err;
+			/* OpenSLP does not implement it. */
+			if (err == SLP_NOT_IMPLEMENTED)
+				full = 1;
+			deleted = err == SLP_OK;
+		}
+		if (!full && (added || deleted))
+			reg_amend(srvurl, srvtype, added ? add : NULL,
+					deleted ? del : NULL, lang, added ? lifetime : 0);
+	}
+	if (full) {
+		res.err = SLP_OK;
+		if ((err = SLPReg(hslp, srvurl, lifetime, srvtype ? srvtype : "",
+						attrs, SLP_TRUE, collect_report_cb,
+						(void *)&res)) == SLP_OK)
+			err = res.err;
+		*sent = 1;
+		if (err == SLP_OK)
+			reg_track(srvurl, srvtype, attrs, lang, lifetime);
+	}
+	free(old);
+	free(add);
+	free(del);
+
+	return err;
+}
+
+/**
+ * Updates a registration made through this module to the given attributes,
+ * sending only what changed, see reg_update().
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
+ * @param args	The arguments, positional or by keyword:
  * 				hslp: SLPHandle returned from SLPOpen
- *				srvurl: The service URL of the service to the attributes of.
- *				scopelist: Comma separated list of scope names -- may be ""
- *				attrids: A comma separated list of attribute ids to return.
- *				"" for all attributes.
- *				callback: te python object representing the callback function to
- *				be called.
- *				cookie: arbitrary data to be passed to the callback.
- * @return	None on success, NULL + exception raised on error.
+ *				srvurl: The service URL.
+ *				attrs: The wanted attributes. Ex. "(Attr1=val1),(Attr2=val2)"
+ *				lifetime: The lifetime, 0 (the default) to keep the registered
+ *				one.
+ *				srvtype: Ignored, see SLPReg().
+ * @return	True if any request was sent, False if the registration was up to
+ * 			date; NULL + exception raised on error.
  */
-static PyObject *py_slp_findattrs(PyObject *self, PyObject *args)
+static PyObject *py_slp_reg_update(PyObject *self, SLP_FASTCALL_ARGS)
 {
-	SLPHandle hslp;
+	static char *kwlist[] = { "hslp", "srvurl", "attrs", "lifetime",
+		"srvtype", NULL };
+	SLPHandleObject *handle;
+	PyObject *py_handle;
 	char *srvurl;
-	char *scopelist;
-	char *attrids;
+	char *attrs;
+	char *srvtype = NULL;
+	unsigned short lifetime = 0;
 	SLPError err;
-	cb_cookie_t *cookie;
+	int sent;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "Osz|Hz:reg_update", kwlist,
+				&py_handle, &srvurl, &attrs, &lifetime, &srvtype) != RET_OK)
+		return NULL;
+	if (!(handle = acquire_slp_handle(py_handle)))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	err = reg_update(handle->hslp, handle->lang, srvurl, srvtype,
+			attrs ? attrs : "", lifetime, &sent);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (err != SLP_OK) {
+		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+		return NULL;
+	}
+
+	return PyBool_FromLong(sent);
+}
+
+/**
+ * Tells whether the registered URL matches a URL prefix or a service type.
+ * A pattern without "://" is a service type: "service:printer" matches
+ * "service:printer://..." and "service:printer:lpr://..." but not
+ * "service:printers://...".
+ *
+ * @param srvurl	The registered URL.
+ * @param pattern	The URL prefix or service type, NULL to match any URL.
+ * @return	Non-zero if the URL matches.
+ */
+static int reg_matches(const char *srvurl, const char *pattern)
+{
+	size_t len;
 
-	if (location_func_prep(args, &hslp, &srvurl, &scopelist, &attrids, &cookie)
-			!= RET_OK)
+	if (!pattern)
+		return 1;
+	len = strlen(pattern);
+	if (strstr(pattern, "://"))
+		return !strncmp(srvurl, pattern, len);
+
+	return !strncasecmp(srvurl, pattern, len) && srvurl[len] == ':';
+}
+
+/**
+ * Prepares the deregistration of the registered URLs matching the pattern.
+ * Does not need the GIL.
+ *
+ * @param pattern	See reg_matches(), NULL for all the URLs.
+ * @param lang		Language of the handles, may be NULL.
+ * @return	The bulk operation owning copies of the URLs, NULL if out of
+ * 			memory.
+ */
+static reg_batch_t *reg_dereg_batch(const char *pattern, const char *lang)
+{
+	reg_batch_t *batch;
+	reg_entry_t *entry;
+	size_t count = 0;
+	size_t i;
+
+	pthread_mutex_lock(&reg_lock);
+	for (i = 0; i < REG_BUCKETS; i++)
+		for (entry = reg_buckets[i]; entry; entry = entry->chain)
+			count += reg_matches(entry->srvurl, pattern);
+	if (!(batch = reg_batch_new(count, lang))) {
+		pthread_mutex_unlock(&reg_lock);
+		return NULL;
+	}
+	batch->dereg = 1;
+	batch->own_strings = 1;
+	batch->count = 0;
+	for (i = 0; i < REG_BUCKETS; i++)
+		for (entry = reg_buckets[i]; entry; entry = entry->chain)
+			if (reg_matches(entry->srvurl, pattern) &&
+					(batch->items[batch->count].srvurl =
+					 strdup(entry->srvurl)))
+				batch->count++;
+	pthread_mutex_unlock(&reg_lock);
+
+	return batch;
+}
+
+/**
+ * Deregisters the registered URLs matching the pattern. Common part of
+ * dereg_all() and dereg_matching().
+ *
+ * @param pattern	See reg_matches(), NULL for all the URLs.
+ * @param deadline	Seconds to give up after, 0 for no limit.
+ * @param workers	Number of the deregistrations in flight at once.
+ * @param lang		Language of the handles, may be NULL.
+ * @return	List of the (url, errcode) tuples, NULL + exception raised on
+ * 			error.
+ */
+static PyObject *reg_dereg_common(const char *pattern, double deadline,
+		int workers, const char *lang)
+{
+	reg_batch_t *batch;
+	SLPError *errs = NULL;
+	PyObject *ret = NULL;
+	PyObject *item;
+	size_t i;
+
+	if (workers < 1 || workers > REG_BATCH_MAX_WORKERS) {
+		PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d",
+				REG_BATCH_MAX_WORKERS);
+		return NULL;
+	}
+	if (deadline < 0) {
+		PyErr_SetString(PyExc_ValueError, "deadline must not be negative");
 		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if ((batch = reg_dereg_batch(pattern, lang)) &&
+			(errs = malloc((batch->count ? batch->count : 1) *
+						   sizeof(SLPError)))) {
+		batch->deadline = deadline ? slp_monotonic() + deadline : 0;
+		reg_batch_run(batch, workers, errs);
+	}
+	Py_END_ALLOW_THREADS
+	if (!errs) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	if (!(ret = PyList_New(batch->count)))
+		goto out;
+	for (i = 0; i < batch->count; i++) {
+		if (!(item = Py_BuildValue("(si)", batch->items[i].srvurl,
+						errs[i]))) {
+			Py_CLEAR(ret);
+			goto out;
+		}
+		PyList_SET_ITEM(ret, i, item);
+	}
+out:
+	free(errs);
+	if (batch)
+		reg_batch_unref(batch);
+
+	return ret;
+}
+
+/**
+ * Deregisters all the live registrations made through this module.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				deadline: Seconds to give up after, 0 (the default) for no
+ * 				limit. The deregistrations not done by then are reported
+ * 				with SLP_NETWORK_TIMED_OUT.
+ *				workers: Number of the deregistrations in flight at once
+ *				(4 by default).
+ *				lang: Language of the handles, may be None.
+ * @return	List of the (url, errcode) tuples, NULL + exception raised on
+ * 			error.
+ */
+static PyObject *py_slp_dereg_all(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "deadline", "workers", "lang", NULL };
+	double deadline = 0;
+	int workers = REG_BATCH_WORKERS;
+	char *lang = NULL;
 
-	if ((err = SLPFindAttrs(hslp, srvurl, scopelist, attrids, srv_attr_type_cb,
-					(void *)cookie)) != SLP_OK) {
-		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+	if (slp_parse_args(SLP_FASTCALL_PASS, "|diz:dereg_all", kwlist,
+				&deadline, &workers, &lang) != RET_OK)
 		return NULL;
-	}
 
-	Py_INCREF(Py_None);
-	
-	return Py_None;
+	return reg_dereg_common(NULL, deadline, workers, lang);
 }
 
 /**
- * Interface function for SLPReg().
+ * Deregisters the live registrations made through this module matching a URL
+ * prefix or a service type, see reg_matches().
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
- * 				hslp: SLPHandle returned from SLPOpen
- * 				lifetime: An unsigned short giving the lifetime of the service
- * 				in seconds.
- *				srvtype: Ignored, mandated by the RFC 2614, see OpenSLP
- *				documentation for the details.
- *				attrs: Attributes of the registered service. Ex. "(Attr1=val1)"
- *				fresh: True if the registration is new, False for
- *				re-registration
- *				callback: te python object representing the callback function to
- *				be called.
- *				cookie: arbitrary data to be passed to the callback.
- * @return	None on success, NULL + exception raised on error.
+ * @param args	The arguments, positional or by keyword:
+ * 				pattern: The URL prefix (containing "://") or the service
+ * 				type.
+ *				deadline, workers, lang: See dereg_all().
+ * @return	List of the (url, errcode) tuples, NULL + exception raised on
+ * 			error.
  */
-static PyObject *py_slp_reg(PyObject *self, PyObject *args)
+static PyObject *py_slp_dereg_matching(PyObject *self, SLP_FASTCALL_ARGS)
 {
-	SLPHandle hslp;
-	PyObject *py_handle;
-	PyObject *py_callback;
-	PyObject *py_cookie;
-	PyObject *py_fresh;
-	char *srvurl;
-	char *srvtype;
-	char *attrs;
-	unsigned short lifetime;
-	SLPBoolean fresh;
-	SLPError err;
-	cb_cookie_t *cookie;
-	
-	if (!PyArg_ParseTuple(args, "OsizzOOO", &py_handle, &srvurl, &lifetime,
-				&srvtype, &attrs, &py_fresh, &py_callback, &py_cookie))
-		return NULL;
-	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
-			&hslp, &cookie) != RET_OK)
-		return NULL;
-	fresh = PyObject_IsTrue(py_fresh);
+	static char *kwlist[] = { "pattern", "deadline", "workers", "lang", NULL };
+	char *pattern;
+	double deadline = 0;
+	int workers = REG_BATCH_WORKERS;
+	char *lang = NULL;
 
-	if ((err = SLPReg(hslp, srvurl, lifetime, srvtype, attrs, fresh, reg_report_cb,
-					(void *)cookie)) != SLP_OK) {
-		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+	if (slp_parse_args(SLP_FASTCALL_PASS, "s|diz:dereg_matching", kwlist,
+				&pattern, &deadline, &workers, &lang) != RET_OK)
 		return NULL;
-	}
-	
-	Py_INCREF(Py_None);
-	
-	return Py_None;
+
+	return reg_dereg_common(pattern, deadline, workers, lang);
 }
 
+/* Deregistration at exit, see dereg_on_exit(). */
+static pthread_once_t reg_hooks_once = PTHREAD_ONCE_INIT;
+static int reg_exit_enabled;
+static double reg_exit_deadline;
+static int reg_exit_workers;
+static pid_t reg_exit_pid;
+
 /**
- * Interface function for SLPDereg().
+ * Py_AtExit() hook: stops the refresh thread and deregisters everything if
+ * dereg_on_exit() asked for it in this process (not in a forked child). Runs
+ * once the interpreter is gone: does not use python.
  *
- * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
- * 				hslp: SLPHandle returned from SLPOpen
- *				srvurl: The service URL of the service to be deregistered.
- *				callback: te python object representing the callback function to
- *				be called.
- *				cookie: arbitrary data to be passed to the callback.
- * @return	None on success, NULL + exception raised on error.
+ * Before deregistering, the refresh in flight is waited for (within the exit
+ * deadline) so that it does not register again a URL the exit batch just
+ * deregistered. Without the exit batch the thread is only told to stop: a
+ * refresh in progress must not delay the exit.
  */
-static PyObject *py_slp_dereg(PyObject *self, PyObject *args)
+static void reg_at_exit(void)
 {
-	SLPHandle hslp;
-	PyObject *py_handle;
-	PyObject *py_callback;
-	PyObject *py_cookie;
-	char *srvurl;
-	SLPError err;
-	cb_cookie_t *cookie;
-	
-	if (!PyArg_ParseTuple(args, "OsOO", &py_handle, &srvurl, &py_callback,
-				&py_cookie))
-		return NULL;
-	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
-			&hslp, &cookie) != RET_OK)
-		return NULL;
+	reg_batch_t *batch;
+	SLPError *errs;
+	struct timespec ts;
+	double deadline;
+	int exiting = reg_exit_enabled && reg_exit_pid == getpid();
+	int running;
+	int exited;
 
-	if ((err = SLPDereg(hslp, srvurl, reg_report_cb, (void *)cookie))
-			!= SLP_OK) {
-		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
-		return NULL;
+	deadline = exiting && reg_exit_deadline ?
+		slp_monotonic() + reg_exit_deadline : 0;
+	pthread_mutex_lock(&reg_lock);
+	if ((running = reg_running)) {
+		reg_stop = 1;
+		reg_running = 0;
+		pthread_cond_broadcast(&reg_cond);
+		while (exiting && !reg_exited &&
+				(!deadline || slp_monotonic() < deadline)) {
+			slp_abstime(deadline ? deadline - slp_monotonic() : 1, &ts);
+			pthread_cond_timedwait(&reg_cond, &reg_lock, &ts);
+		}
+	}
+	exited = reg_exited;
+	pthread_mutex_unlock(&reg_lock);
+	/* Past the deadline the entry in flight is deregistered with the others;
+	 * the thread deregisters it again if its refresh ends before the exit. */
+	if (running && exited)
+		pthread_join(reg_thread, NULL);
+	else if (running)
+		pthread_detach(reg_thread);
+	if (!exiting)
+		return;
+	if (!(batch = reg_dereg_batch(NULL, NULL)))
+		return;
+	if ((errs = malloc((batch->count ? batch->count : 1) *
+					sizeof(SLPError)))) {
+		batch->deadline = deadline;
+		reg_batch_run(batch, reg_exit_workers, errs);
+		free(errs);
 	}
+	reg_batch_unref(batch);
+}
 
-	Py_INCREF(Py_None);
+/**
+ * pthread_atfork() handler keeping reg_lock consistent across fork().
+ */
+static void reg_fork_prepare(void)
+{
+	pthread_mutex_lock(&reg_lock);
+}
 
-	return Py_None;
+/**
+ * pthread_atfork() handler of the parent process.
+ */
+static void reg_fork_parent(void)
+{
+	pthread_mutex_unlock(&reg_lock);
 }
 
 /**
- * Interface function for SLPDelAttrs().
+ * pthread_atfork() handler of the child process. The registrations belong to
+ * the parent: the child forgets them, so that it neither refreshes nor
+ * deregisters them, and the refresh thread does not exist there.
+ */
+static void reg_fork_child(void)
+{
+	reg_entry_t *entry;
+	reg_entry_t *next;
+	size_t i;
+
+	for (i = 0; i < REG_BUCKETS; i++) {
+		for (entry = reg_buckets[i]; entry; entry = next) {
+			next = entry->chain;
+			/* No other thread is left to hold a reference. */
+			entry->refs = 1;
+			reg_entry_unref(entry);
+		}
+		reg_buckets[i] = NULL;
+	}
+	memset(reg_wheel, 0, sizeof(reg_wheel));
+	memset(reg_wheel_load, 0, sizeof(reg_wheel_load));
+	reg_count = 0;
+	reg_running = 0;
+	reg_stop = 0;
+	reg_exit_enabled = 0;
+	pthread_mutex_unlock(&reg_lock);
+}
+
+/**
+ * Installs the exit and fork hooks of the registry, once per process.
+ */
+static void reg_hooks_install(void)
+{
+	Py_AtExit(reg_at_exit);
+	pthread_atfork(reg_fork_prepare, reg_fork_parent, reg_fork_child);
+}
+
+/**
+ * Turns the deregistration of all the live registrations at exit on or off.
+ * The deregistration runs when the interpreter exits normally, in the process
+ * which called this function only.
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
- * 				hslp: SLPHandle returned from SLPOpen
- *				srvurl: The service URL of the service to be deregistered.
- *				attrs: Comma separated list of the attributes to be deleted.
- *				callback: te python object representing the callback function to
- *				be called.
- *				cookie: arbitrary data to be passed to the callback.
- * @return	None on success, NULL + exception raised on error.
+ * @param args	The arguments, positional or by keyword:
+ * 				enabled: Whether to deregister at exit (True by default).
+ * 				deadline: Seconds the exit may be delayed by, 0 for no limit
+ * 				(2 by default).
+ *				workers: Number of the deregistrations in flight at once
+ *				(4 by default).
+ * @return	None, NULL + exception raised on error.
  */
-static PyObject *py_slp_delattrs(PyObject *self, PyObject *args)
+static PyObject *py_slp_dereg_on_exit(PyObject *self, SLP_FASTCALL_ARGS)
 {
-	SLPHandle hslp;
-	PyObject *py_handle;
-	PyObject *py_callback;
-	PyObject *py_cookie;
-	char *srvurl;
-	char *attrs;
-	SLPError err;
-	cb_cookie_t *cookie;
-	
-	if (!PyArg_ParseTuple(args, "OssOO", &py_handle, &srvurl, &attrs,
-				&py_callback, &py_cookie))
+	static char *kwlist[] = { "enabled", "deadline", "workers", NULL };
+	PyObject *py_enabled = NULL;
+	int enabled = 1;
+	double deadline = 2;
+	int workers = REG_BATCH_WORKERS;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "|Odi:dereg_on_exit", kwlist,
+				&py_enabled, &deadline, &workers) != RET_OK)
 		return NULL;
-	if (slpfunc_prep_args(py_handle, py_callback, py_cookie,
-			&hslp, &cookie) != RET_OK)
+	if (py_enabled && (enabled = PyObject_IsTrue(py_enabled)) < 0)
 		return NULL;
-
-	if ((err = SLPDelAttrs(hslp, srvurl, attrs, reg_report_cb, (void *)cookie))
-			!= SLP_OK) {
-		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
+	if (workers < 1 || workers > REG_BATCH_MAX_WORKERS || deadline < 0) {
+		PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d, "
+				"deadline must not be negative", REG_BATCH_MAX_WORKERS);
 		return NULL;
 	}
-	
+
+	reg_exit_deadline = deadline;
+	reg_exit_workers = workers;
+	reg_exit_pid = getpid();
+	reg_exit_enabled = enabled;
+
 	Py_INCREF(Py_None);
-	
+
 	return Py_None;
 }
 
@@ -615,27 +9763,36 @@ static PyObject *py_slp_get_refresh_interval(PyObject *self, PyObject *args)
  * Interface function for SLPFindScopes().
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
+ * @param args	The arguments, positional or by keyword:
  * 				hslp: SLPHandle returned from SLPOpen
  * @return	Comma separated list of the available scopes.
  */
-static PyObject *py_slp_find_scopes(PyObject *self, PyObject *args)
+static PyObject *py_slp_find_scopes(PyObject *self, SLP_FASTCALL_ARGS)
 {
-	SLPHandle hslp;
+	static char *kwlist[] = { "hslp", NULL };
+	SLPHandleObject *handle;
 	SLPError err;
 	PyObject *py_handle;
 	PyObject *ret;
 	char *scopelist;
 
-	if (!PyArg_ParseTuple(args, "O", &py_handle))
+	if (slp_parse_args(SLP_FASTCALL_PASS, "O:SLPFindScopes", kwlist,
+				&py_handle) != RET_OK)
 		return NULL;
-	if (!(hslp = get_slp_handle(py_handle))) {
+	if (!SLPHandle_Check(py_handle)) {
 		PyErr_SetString(PyExc_TypeError, "The argument doesn't "
 				"seem to be a valid SLP handle");
 		return NULL;
 	}
+	handle = (SLPHandleObject *) py_handle;
+	if (slp_handle_acquire(handle) != RET_OK)
+		return NULL;
 
-	if ((err = SLPFindScopes(hslp, &scopelist)) != SLP_OK) {
+	Py_BEGIN_ALLOW_THREADS
+	err = SLPFindScopes(handle->hslp, &scopelist);
+	slp_handle_release(handle);
+	Py_END_ALLOW_THREADS
+	if (err != SLP_OK) {
 		PyErr_SetString(PyExc_RuntimeError, get_slp_error_msg(err));
 		return NULL;
 	}
@@ -651,16 +9808,18 @@ static PyObject *py_slp_find_scopes(PyObject *self, PyObject *args)
  * Interface function for SLPGetProperty().
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
+ * @param args	The arguments, positional or by keyword:
  * 				name: The name of a net.slp property to get.
  * @return	The string with the property value. May be None.
  */
-static PyObject *py_slp_get_property(PyObject *self, PyObject *args)
+static PyObject *py_slp_get_property(PyObject *self, SLP_FASTCALL_ARGS)
 {
+	static char *kwlist[] = { "name", NULL };
 	char *name;
 	const char *val;
 
-	if (!PyArg_ParseTuple(args, "s", &name))
+	if (slp_parse_args(SLP_FASTCALL_PASS, "s:SLPGetProperty", kwlist,
+				&name) != RET_OK)
 		return NULL;
 	if ((val = SLPGetProperty(name))) {
 		return Py_BuildValue("s", val);
@@ -677,17 +9836,19 @@ static PyObject *py_slp_get_property(PyObject *self, PyObject *args)
  * for more details why.
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
+ * @param args	The arguments, positional or by keyword:
  * 				name: The name of a net.slp property to set.
  * 				value: The new value.
  * @return	The string with the property value. May be None.
  */
-static PyObject *py_slp_set_property(PyObject *self, PyObject *args)
+static PyObject *py_slp_set_property(PyObject *self, SLP_FASTCALL_ARGS)
 {
+	static char *kwlist[] = { "name", "value", NULL };
 	char *name;
 	char *value;
 
-	if (!PyArg_ParseTuple(args, "zz", &name, &value))
+	if (slp_parse_args(SLP_FASTCALL_PASS, "zz:SLPSetProperty", kwlist,
+				&name, &value) != RET_OK)
 		return NULL;
 
 	/* No-op */
@@ -702,18 +9863,20 @@ static PyObject *py_slp_set_property(PyObject *self, PyObject *args)
  * Interface function for SLPParseSrvURL().
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
+ * @param args	The arguments, positional or by keyword:
  * 				srvurl: The URL string to be parsed.
  * @return	The tuple consisting of the SLPSrvURL structure members.
  */
-static PyObject *py_slp_parse_srvurl(PyObject *self, PyObject *args)
+static PyObject *py_slp_parse_srvurl(PyObject *self, SLP_FASTCALL_ARGS)
 {
+	static char *kwlist[] = { "srvurl", NULL };
 	char *srvurl;
 	SLPSrvURL *parsedurl = NULL;
 	PyObject *ret;
 	SLPError err;
 	
-	if (!PyArg_ParseTuple(args, "z", &srvurl))
+	if (slp_parse_args(SLP_FASTCALL_PASS, "z:SLPParseSrvURL", kwlist,
+				&srvurl) != RET_OK)
 		return NULL;
 	
 	if((err = SLPParseSrvURL(srvurl, &parsedurl)) != SLP_OK) {
@@ -736,13 +9899,14 @@ static PyObject *py_slp_parse_srvurl(PyObject *self, PyObject *args)
  * Interface function for SLPEscape().
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
+ * @param args	The arguments, positional or by keyword:
  * 				unescaped: The string to be escaped.
  * 				istag: Check for bad characters.
  * @return	The escaped string.
  */
-static PyObject *py_slp_escape(PyObject *self, PyObject *args)
+static PyObject *py_slp_escape(PyObject *self, SLP_FASTCALL_ARGS)
 {
+	static char *kwlist[] = { "unescaped", "istag", NULL };
 	char *unescaped;
 	char *escaped;
 	PyObject *ret;
@@ -750,7 +9914,8 @@ static PyObject *py_slp_escape(PyObject *self, PyObject *args)
 	SLPBoolean istag;
 	SLPError err;
 	
-	if (!PyArg_ParseTuple(args, "si", &unescaped, &py_istag))
+	if (slp_parse_args(SLP_FASTCALL_PASS, "sO:SLPEscape", kwlist,
+				&unescaped, &py_istag) != RET_OK)
 		return NULL;
 	
 	istag = PyObject_IsTrue(py_istag);
@@ -770,13 +9935,14 @@ static PyObject *py_slp_escape(PyObject *self, PyObject *args)
  * Interface function for SLPUnescape().
  *
  * @param self	Unused. Mandated by the Python C API.
- * @param args	PyObject wrapping the arguments:
+ * @param args	The arguments, positional or by keyword:
  * 				escaped: The string to be un-escaped.
  * 				istag: Check for bad characters.
  * @return	The un-escaped string.
  */
-static PyObject *py_slp_unescape(PyObject *self, PyObject *args)
+static PyObject *py_slp_unescape(PyObject *self, SLP_FASTCALL_ARGS)
 {
+	static char *kwlist[] = { "escaped", "istag", NULL };
 	char *unescaped;
 	char *escaped;
 	PyObject *ret;
@@ -784,7 +9950,8 @@ static PyObject *py_slp_unescape(PyObject *self, PyObject *args)
 	SLPBoolean istag;
 	SLPError err;
 	
-	if (!PyArg_ParseTuple(args, "si", &escaped, &py_istag))
+	if (slp_parse_args(SLP_FASTCALL_PASS, "sO:SLPUnescape", kwlist,
+				&escaped, &py_istag) != RET_OK)
 		return NULL;
 	
 	istag = PyObject_IsTrue(py_istag);
@@ -800,29 +9967,560 @@ static PyObject *py_slp_unescape(PyObject *self, PyObject *args)
 	return ret;
 }
 
+/* Number of the mappings encode_attrs() remembers. */
+#define ENCODE_CACHE_SIZE	64
+
+/**
+ * Growable buffer of an attribute list being encoded.
+ */
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t alloc;
+} attr_buf_t;
+
+/**
+ * One attribute list remembered by encode_attrs(), protected by the GIL. The
+ * entry holds a reference to the mapping so that its identity is not reused.
+ * With a version it stays valid while the version given with the mapping is
+ * the same. Otherwise the items of the mapping are kept (only if all the
+ * values are immutable) and it stays valid while the items are the same.
+ */
+typedef struct {
+	PyObject *mapping;
+	PyObject *version;
+	PyObject *items;
+	PyObject *encoded;
+} encode_cache_t;
+
+static encode_cache_t encode_cache[ENCODE_CACHE_SIZE];
+
+/**
+ * Appends bytes to the buffer.
+ *
+ * @param buf	The buffer.
+ * @param str	The bytes.
+ * @param n		Number of the bytes.
+ * @return	RET_OK on success, RET_ERROR with an exception raised if out of
+ * 			memory.
+ */
+static int attr_buf_put(attr_buf_t *buf, const char *str, size_t n)
+{
+	size_t alloc;
+	char *grown;
+
+	if (buf->len + n + 1 > buf->alloc) {
+		for (alloc = buf->alloc ? buf->alloc : 256; alloc < buf->len + n + 1;
+				alloc *= 2)
+			;
+		if (!(grown = realloc(buf->buf, alloc))) {
+			PyErr_NoMemory();
+			return RET_ERROR;
+		}
+		buf->buf = grown;
+		buf->alloc = alloc;
+	}
+	memcpy(buf->buf + buf->len, str, n);
+	buf->len += n;
+
+	return RET_OK;
+}
+
+/**
+ * Appends a string to the buffer with the reserved characters of RFC 2608
+ * escaped as \XX, in one pass.
+ *
+ * @param buf		The buffer.
+ * @param str		The UTF-8 string.
+ * @param n			Length of the string.
+ * @param istag		Whether the string is an attribute tag: the bad tag
+ * 					characters ('*', '_', CR, LF and HTAB) are refused.
+ * @return	RET_OK on success, RET_ERROR with an exception raised otherwise.
+ */
+static int attr_buf_escape(attr_buf_t *buf, const char *str, size_t n,
+		int istag)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned char c;
+	char esc[3];
+	size_t start = 0;
+	size_t i;
+	PyObject *tag;
+
+	for (i = 0; i < n; i++) {
+		c = (unsigned char) str[i];
+		if (istag && (c == '*' || c == '_' || c == '\r' || c == '\n' ||
+					c == '\t')) {
+			/* No %.*s before python 3.12: format a string object. */
+			if (!(tag = slp_string(str, n)))
+				return RET_ERROR;
+#if PY_MAJOR_VERSION >= 3
+			PyErr_Format(PyExc_ValueError, "Invalid character in the "
+					"attribute tag \"%U\"", tag);
+#else
+			PyErr_Format(PyExc_ValueError, "Invalid character in the "
+					"attribute tag \"%s\"", PyString_AS_STRING(tag));
+#endif
+			Py_DECREF(tag);
+			return RET_ERROR;
+		}
+		if (c >= 0x20 && c != 0x7f && !strchr("(),\\!<=>~", c))
+			continue;
+		esc[0] = '\\';
+		esc[1] = hex[c >> 4];
+		esc[2] = hex[c & 0xf];
+		if (attr_buf_put(buf, str + start, i - start) != RET_OK ||
+				attr_buf_put(buf, esc, 3) != RET_OK)
+			return RET_ERROR;
+		start = i + 1;
+	}
+
+	return attr_buf_put(buf, str + start, n - start);
+}
+
+/**
+ * Appends the UTF-8 form of a python string to the buffer, escaped.
+ *
+ * @param buf		The buffer.
+ * @param obj		The object, converted by str() if not a string.
+ * @param istag		See attr_buf_escape().
+ * @return	RET_OK on success, RET_ERROR with an exception raised otherwise.
+ */
+static int attr_buf_string(attr_buf_t *buf, PyObject *obj, int istag)
+{
+	PyObject *str;
+	const char *s;
+	Py_ssize_t n;
+	int ret = RET_ERROR;
+
+#if PY_MAJOR_VERSION >= 3
+	if (!(str = PyUnicode_Check(obj) ? (Py_INCREF(obj), obj) :
+				PyObject_Str(obj)))
+		return RET_ERROR;
+	if ((s = PyUnicode_AsUTF8AndSize(str, &n)))
+		ret = attr_buf_escape(buf, s, n, istag);
+#else
+	if (PyUnicode_Check(obj))
+		str = PyUnicode_AsUTF8String(obj);
+	else if (PyString_Check(obj))
+		Py_INCREF(str = obj);
+	else
+		str = PyObject_Str(obj);
+	if (!str)
+		return RET_ERROR;
+	if (PyString_AsStringAndSize(str, (char **) &s, &n) == 0)
+		ret = attr_buf_escape(buf, s, n, istag);
+#endif
+	Py_DECREF(str);
+
+	return ret;
+}
+
+/**
+ * Appends one attribute value to the buffer: booleans as true or false,
+ * integers in decimal, bytes (python 3) and bytearrays as opaque values
+ * (\FF followed by the escaped bytes), anything else as an escaped string.
+ *
+ * @param buf	The buffer.
+ * @param value	The value.
+ * @return	RET_OK on success, RET_ERROR with an exception raised otherwise.
+ */
+static int attr_buf_value(attr_buf_t *buf, PyObject *value)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const unsigned char *bytes;
+	Py_ssize_t n;
+	Py_ssize_t i;
+	char esc[3];
+
+	if (PyBool_Check(value))
+		return value == Py_True ? attr_buf_put(buf, "true", 4) :
+			attr_buf_put(buf, "false", 5);
+#if PY_MAJOR_VERSION >= 3
+	if (PyBytes_Check(value) || PyByteArray_Check(value)) {
+		bytes = (const unsigned char *) (PyBytes_Check(value) ?
+				PyBytes_AS_STRING(value) : PyByteArray_AS_STRING(value));
+		n = PyBytes_Check(value) ? PyBytes_GET_SIZE(value) :
+			PyByteArray_GET_SIZE(value);
+#else
+	if (PyByteArray_Check(value)) {
+		bytes = (const unsigned char *) PyByteArray_AS_STRING(value);
+		n = PyByteArray_GET_SIZE(value);
+#endif
+		if (attr_buf_put(buf, "\\FF", 3) != RET_OK)
+			return RET_ERROR;
+		esc[0] = '\\';
+		for (i = 0; i < n; i++) {
+			esc[1] = hex[bytes[i] >> 4];
+			esc[2] = hex[bytes[i] & 0xf];
+			if (attr_buf_put(buf, esc, 3) != RET_OK)
+				return RET_ERROR;
+		}
+		return RET_OK;
+	}
+
+	/* The integers have no reserved characters to escape. */
+	return attr_buf_string(buf, value, 0);
+}
+
+/**
+ * Encodes the items of an attribute mapping to the SLP wire format:
+ * "(tag=value),(tag=value1,value2),keyword". A None value or an empty
+ * list makes a keyword attribute, a list or a tuple a multi-valued one.
+ *
+ * @param items	List of the (tag, value) tuples.
+ * @return	New reference to the encoded string, NULL with an exception
+ * 			raised on error.
+ */
+static PyObject *attr_encode(PyObject *items)
+{
+	attr_buf_t buf = { NULL, 0, 0 };
+	PyObject *item;
+	PyObject *value;
+	PyObject *elem;
+	PyObject *ret = NULL;
+	Py_ssize_t i;
+	Py_ssize_t j;
+	int failed;
+	int multi;
+
+	for (i = 0; i < PyList_GET_SIZE(items); i++) {
+		item = PyList_GET_ITEM(items, i);
+		if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+			PyErr_SetString(PyExc_TypeError, "The attribute items must be "
+					"(tag, value) pairs");
+			goto out;
+		}
+		value = PyTuple_GET_ITEM(item, 1);
+		multi = PyList_Check(value) || PyTuple_Check(value);
+		if ((i && attr_buf_put(&buf, ",", 1) != RET_OK) ||
+				(value != Py_None && !(multi && !PySequence_Size(value)) &&
+				 attr_buf_put(&buf, "(", 1) != RET_OK) ||
+				attr_buf_string(&buf, PyTuple_GET_ITEM(item, 0), 1) != RET_OK)
+			goto out;
+		if (value == Py_None || (multi && !PySequence_Size(value)))
+			continue;
+		if (attr_buf_put(&buf, "=", 1) != RET_OK)
+			goto out;
+		if (!multi) {
+			if (attr_buf_value(&buf, value) != RET_OK)
+				goto out;
+		} else {
+			for (j = 0; j < PySequence_Fast_GET_SIZE(value); j++) {
+				/* str() of a list item may change the list. */
+				Py_INCREF(elem = PySequence_Fast_GET_ITEM(value, j));
+				failed = (j && attr_buf_put(&buf, ",", 1) != RET_OK) ||
+					attr_buf_value(&buf, elem) != RET_OK;
+				Py_DECREF(elem);
+				if (failed)
+					goto out;
+			}
+		}
+		if (attr_buf_put(&buf, ")", 1) != RET_OK)
+			goto out;
+	}
+	ret = slp_string(buf.buf ? buf.buf : "", buf.len);
+out:
+	free(buf.buf);
+
+	return ret;
+}
+
+/**
+ * Tells whether the attribute value cannot change behind the back of
+ * encode_attrs(): None, booleans, numbers, strings, bytes and tuples of them.
+ *
+ * @param value	The value.
+ * @return	Non-zero if immutable.
+ */
+static int attr_value_frozen(PyObject *value)
+{
+	Py_ssize_t i;
+
+	if (PyTuple_Check(value)) {
+		for (i = 0; i < PyTuple_GET_SIZE(value); i++)
+			if (PyTuple_Check(PyTuple_GET_ITEM(value, i)) ||
+					!attr_value_frozen(PyTuple_GET_ITEM(value, i)))
+				return 0;
+		return 1;
+	}
+
+	return value == Py_None || PyBool_Check(value) || PyLong_Check(value) ||
+#if PY_MAJOR_VERSION < 3
+		PyInt_Check(value) || PyString_Check(value) ||
+#endif
+		PyFloat_Check(value) || PyUnicode_Check(value) ||
+		PyBytes_Check(value);
+}
+
+/**
+ * Tells whether two attribute values encode the same: they have the same
+ * type and compare equal (True and 1 compare equal, but encode differently).
+ *
+ * @param a	The first value.
+ * @param b	The second value.
+ * @return	1 if the same, 0 if not, -1 with an exception raised on error.
+ */
+static int attr_value_same(PyObject *a, PyObject *b)
+{
+	Py_ssize_t i;
+	int same;
+
+	if (a == b)
+		return 1;
+	if (Py_TYPE(a) != Py_TYPE(b))
+		return 0;
+	/* 0.0 and -0.0 compare equal, but encode differently. */
+	if (PyFloat_CheckExact(a))
+		return PyFloat_AS_DOUBLE(a) == PyFloat_AS_DOUBLE(b) &&
+			signbit(PyFloat_AS_DOUBLE(a)) == signbit(PyFloat_AS_DOUBLE(b));
+	if (!PyTuple_Check(a))
+		return PyObject_RichCompareBool(a, b, Py_EQ);
+	if (PyTuple_GET_SIZE(a) != PyTuple_GET_SIZE(b))
+		return 0;
+	for (i = 0; i < PyTuple_GET_SIZE(a); i++)
+		if ((same = attr_value_same(PyTuple_GET_ITEM(a, i),
+						PyTuple_GET_ITEM(b, i))) != 1)
+			return same;
+
+	return 1;
+}
+
+/**
+ * Tells whether the items of a mapping are the same as the remembered ones,
+ * in the same order.
+ *
+ * @param items		The current items.
+ * @param cached	The remembered items.
+ * @return	1 if the same, 0 if not, -1 with an exception raised on error.
+ */
+static int attr_items_same(PyObject *items, PyObject *cached)
+{
+	PyObject *a;
+	PyObject *b;
+	Py_ssize_t i;
+	int same;
+
+	if (PyList_GET_SIZE(items) != PyList_GET_SIZE(cached))
+		return 0;
+	for (i = 0; i < PyList_GET_SIZE(items); i++) {
+		a = PyList_GET_ITEM(items, i);
+		b = PyList_GET_ITEM(cached, i);
+		if (!PyTuple_Check(a) || PyTuple_GET_SIZE(a) != 2)
+			return 0;
+		if ((same = attr_value_same(PyTuple_GET_ITEM(a, 0),
+						PyTuple_GET_ITEM(b, 0))) != 1 ||
+				(same = attr_value_same(PyTuple_GET_ITEM(a, 1),
+						PyTuple_GET_ITEM(b, 1))) != 1)
+			return same;
+	}
+
+	return 1;
+}
+
+/**
+ * Returns the items of the mapping as a list.
+ *
+ * @param mapping	The mapping.
+ * @return	New reference to the list of the (tag, value) tuples, NULL with an
+ * 			exception raised on error.
+ */
+static PyObject *attr_items(PyObject *mapping)
+{
+	PyObject *items;
+	PyObject *list;
+
+	if (PyDict_Check(mapping))
+		return PyDict_Items(mapping);
+	if (!(items = PyMapping_Items(mapping)) || PyList_CheckExact(items))
+		return items;
+	list = PySequence_List(items);
+	Py_DECREF(items);
+
+	return list;
+}
+
+/**
+ * Encodes an attribute mapping to an attribute list for SLPReg(), see
+ * attr_encode(). The result is remembered per mapping object, see
+ * encode_cache_t, so that encoding the same mapping again (on each
+ * re-registration) is a lookup.
+ *
+ * @param self	Unused. Mandated by the Python C API.
+ * @param args	The arguments, positional or by keyword:
+ * 				attrs: The mapping of the attribute tags to their values.
+ * 				version: Any object changed by the caller whenever it
+ * 				changes the mapping, None (the default) to compare the items
+ * 				of the mapping with the remembered ones instead.
+ * @return	The attribute list, NULL + exception raised on error.
+ */
+static PyObject *py_slp_encode_attrs(PyObject *self, SLP_FASTCALL_ARGS)
+{
+	static char *kwlist[] = { "attrs", "version", NULL };
+	encode_cache_t *slot;
+	encode_cache_t old;
+	PyObject *mapping;
+	PyObject *version = Py_None;
+	PyObject *items = NULL;
+	PyObject *cached_version;
+	PyObject *cached_items;
+	PyObject *encoded;
+	PyObject *ret = NULL;
+	Py_ssize_t i;
+	int frozen = 1;
+	int same = 0;
+
+	if (slp_parse_args(SLP_FASTCALL_PASS, "O|O:encode_attrs", kwlist,
+				&mapping, &version) != RET_OK)
+		return NULL;
+	if (!PyMapping_Check(mapping)) {
+		PyErr_SetString(PyExc_TypeError, "attrs must be a mapping");
+		return NULL;
+	}
+	if (version == Py_None)
+		version = NULL;
+
+	slot = &encode_cache[((uintptr_t) mapping >> 4) % ENCODE_CACHE_SIZE];
+	if (!version && !(items = attr_items(mapping)))
+		return NULL;
+	if (slot->mapping == mapping) {
+		/* The comparisons may run python code calling encode_attrs() for
+		 * another mapping of the slot: work on own references. */
+		Py_XINCREF(cached_version = slot->version);
+		Py_XINCREF(cached_items = slot->items);
+		Py_INCREF(encoded = slot->encoded);
+		if (version && cached_version)
+			same = PyObject_RichCompareBool(cached_version, version, Py_EQ);
+		else if (!version && cached_items)
+			same = attr_items_same(items, cached_items);
+		Py_XDECREF(cached_version);
+		Py_XDECREF(cached_items);
+		if (same > 0) {
+			ret = encoded;
+			goto out;
+		}
+		Py_DECREF(encoded);
+		if (same < 0)
+			goto out;
+	}
+
+	if (!items && !(items = attr_items(mapping)))
+		goto out;
+	if (!(ret = attr_encode(items)))
+		goto out;
+	for (i = 0; !version && frozen && i < PyList_GET_SIZE(items); i++)
+		frozen = attr_value_frozen(PyTuple_GET_ITEM(
+					PyList_GET_ITEM(items, i), 1));
+	/* Freeing the old entry may run python code too: done last. */
+	old = *slot;
+	memset(slot, 0, sizeof(encode_cache_t));
+	if (version || frozen) {
+		Py_INCREF(slot->mapping = mapping);
+		Py_XINCREF(slot->version = version);
+		if (!version)
+			Py_INCREF(slot->items = items);
+		Py_INCREF(slot->encoded = ret);
+	}
+	Py_XDECREF(old.mapping);
+	Py_XDECREF(old.version);
+	Py_XDECREF(old.items);
+	Py_XDECREF(old.encoded);
+out:
+	Py_XDECREF(items);
+
+	return ret;
+}
+
 /* The methods table. TODO: Add the Python description strings. */
 static PyMethodDef slp_methods[] = {
 	/* handle functions */
-	{ "SLPOpen", py_slp_open, METH_VARARGS, NULL },
-	{ "SLPClose", py_slp_close, METH_VARARGS, NULL },
+	{ "SLPOpen", (PyCFunction) py_slp_open,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPClose", (PyCFunction) py_slp_close,
+		SLP_FASTCALL_FLAGS, NULL },
 	/* service location functions */
-	{ "SLPFindSrvs", py_slp_findsrvs, METH_VARARGS, NULL },
-	{ "SLPFindSrvTypes", py_slp_findsrvtypes, METH_VARARGS, NULL },
-	{ "SLPFindAttrs", py_slp_findattrs, METH_VARARGS, NULL },
+	{ "SLPFindSrvs", (PyCFunction) py_slp_findsrvs,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPFindSrvTypes", (PyCFunction) py_slp_findsrvtypes,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPFindAttrs", (PyCFunction) py_slp_findattrs,
+		SLP_FASTCALL_FLAGS, NULL },
+	/* service location functions returning lists, no python callbacks */
+	{ "find_srvs_list", (PyCFunction) py_slp_findsrvs_list,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "find_srvtypes_list", (PyCFunction) py_slp_findsrvtypes_list,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "find_attrs_list", (PyCFunction) py_slp_findattrs_list,
+		SLP_FASTCALL_FLAGS, NULL },
+	/* hedged queries */
+	{ "find_srvs_hedged", (PyCFunction) py_slp_findsrvs_hedged,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "hedge_stats", py_slp_hedge_stats, METH_NOARGS, NULL },
+	{ "iter_srvs", (PyCFunction) py_slp_iter_srvs,
+		SLP_FASTCALL_FLAGS, NULL },
+	/* discovery cache */
+	{ "cache_configure", (PyCFunction) py_slp_cache_configure,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "cache_stats", py_slp_cache_stats, METH_NOARGS, NULL },
+	{ "cache_clear", (PyCFunction) py_slp_cache_clear,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "cache_share", (PyCFunction) py_slp_cache_share,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "cache_save", (PyCFunction) py_slp_cache_save,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "cache_load", (PyCFunction) py_slp_cache_load,
+		SLP_FASTCALL_FLAGS, NULL },
+#if PY_VERSION_HEX >= 0x03050000
+	/* asyncio functions returning awaitables */
+	{ "aio_find_srvs", (PyCFunction) py_slp_aio_findsrvs,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "aio_find_attrs", (PyCFunction) py_slp_aio_findattrs,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "aio_reg", (PyCFunction) py_slp_aio_reg,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "aio_dereg", (PyCFunction) py_slp_aio_dereg,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "aio_set_workers", (PyCFunction) py_slp_aio_set_workers,
+		SLP_FASTCALL_FLAGS, NULL },
+#endif
 	/* service registration functions */
-	{ "SLPReg", py_slp_reg, METH_VARARGS, NULL },
-	{ "SLPDereg", py_slp_dereg, METH_VARARGS, NULL },
-	{ "SLPDelAttrs", py_slp_delattrs, METH_VARARGS, NULL },
+	{ "SLPReg", (PyCFunction) py_slp_reg,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPDereg", (PyCFunction) py_slp_dereg,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPDelAttrs", (PyCFunction) py_slp_delattrs,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "reg_many", (PyCFunction) py_slp_reg_many,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "reg_update", (PyCFunction) py_slp_reg_update,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "dereg_all", (PyCFunction) py_slp_dereg_all,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "dereg_matching", (PyCFunction) py_slp_dereg_matching,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "dereg_on_exit", (PyCFunction) py_slp_dereg_on_exit,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "refresh_configure", (PyCFunction) py_slp_refresh_configure,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "refresh_stats", py_slp_refresh_stats, METH_NOARGS, NULL },
 	/* configuration functions */
 	{ "SLPGetRefreshInterval", py_slp_get_refresh_interval,
-		METH_VARARGS, NULL },
-	{ "SLPFindScopes", py_slp_find_scopes, METH_VARARGS, NULL },
-	{ "SLPGetProperty", py_slp_get_property, METH_VARARGS, NULL },
-	{ "SLPSetProperty", py_slp_set_property, METH_VARARGS, NULL },
+		METH_NOARGS, NULL },
+	{ "SLPFindScopes", (PyCFunction) py_slp_find_scopes,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPGetProperty", (PyCFunction) py_slp_get_property,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPSetProperty", (PyCFunction) py_slp_set_property,
+		SLP_FASTCALL_FLAGS, NULL },
 	/* parsing functions */
-	{ "SLPParseSrvURL", py_slp_parse_srvurl, METH_VARARGS, NULL },
-	{ "SLPEscape", py_slp_escape, METH_VARARGS, NULL },
-	{ "SLPUnescape", py_slp_unescape, METH_VARARGS, NULL },
+	{ "SLPParseSrvURL", (PyCFunction) py_slp_parse_srvurl,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPEscape", (PyCFunction) py_slp_escape,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "SLPUnescape", (PyCFunction) py_slp_unescape,
+		SLP_FASTCALL_FLAGS, NULL },
+	{ "encode_attrs", (PyCFunction) py_slp_encode_attrs,
+		SLP_FASTCALL_FLAGS, NULL },
 	/* SLPFree() not implemented. */
 	{ NULL, NULL, 0, NULL }
 };
@@ -834,6 +10532,12 @@ static PyMethodDef slp_methods[] = {
 		Py_DECREF(__o); \
 	} while (0)
 
+#if PY_MAJOR_VERSION >= 3
+#define MOD_INIT_ERROR	return NULL
+#else
+#define MOD_INIT_ERROR	return
+#endif
+
 #if PY_MAJOR_VERSION >= 3
 static struct PyModuleDef slpmodule = {
 	PyModuleDef_HEAD_INIT,
@@ -844,6 +10548,29 @@ static struct PyModuleDef slpmodule = {
 };
 #endif
 
+/**
+ * Registers slp_at_exit() with the atexit module.
+ *
+ * @return	RET_OK on success, RET_ERROR with an exception raised otherwise.
+ */
+static int slp_atexit_register(void)
+{
+	PyObject *atexit;
+	PyObject *func;
+	PyObject *ret = NULL;
+
+	if (!(atexit = PyImport_ImportModule("atexit")))
+		return RET_ERROR;
+	if ((func = PyCFunction_New(&slp_at_exit_def, NULL))) {
+		ret = PyObject_CallMethod(atexit, "register", "O", func);
+		Py_DECREF(func);
+	}
+	Py_DECREF(atexit);
+	Py_XDECREF(ret);
+
+	return ret ? RET_OK : RET_ERROR;
+}
+
 #if PY_MAJOR_VERSION >= 3
 PyMODINIT_FUNC PyInit_slp(void)
 {
@@ -857,6 +10584,38 @@ PyMODINIT_FUNC initslp(void)
 
 	m = Py_InitModule("slp", slp_methods);
 #endif
+#if PY_VERSION_HEX < 0x03070000
+	/* The callbacks re-acquire the GIL with PyGILState_Ensure(). */
+	PyEval_InitThreads();
+#endif
+	if (!m || PyType_Ready(&SLPHandle_Type) < 0)
+		MOD_INIT_ERROR;
+	if (PyType_Ready(&SLPHandlePool_Type) < 0 ||
+			PyType_Ready(&SLPHandleLease_Type) < 0 ||
+			PyType_Ready(&SLPSrvIterator_Type) < 0 ||
+			PyType_Ready(&SLPWatcher_Type) < 0)
+		MOD_INIT_ERROR;
+#if PY_VERSION_HEX >= 0x03050000
+	if (PyType_Ready(&SLPAioNotifier_Type) < 0 ||
+			PyType_Ready(&SLPOperation_Type) < 0)
+		MOD_INIT_ERROR;
+	Py_INCREF(&SLPOperation_Type);
+	PyModule_AddObject(m, "Operation", (PyObject *) &SLPOperation_Type);
+	pthread_once(&aio_hooks_once, aio_hooks_install);
+#endif
+	Py_INCREF(&SLPHandle_Type);
+	PyModule_AddObject(m, "Handle", (PyObject *) &SLPHandle_Type);
+	Py_INCREF(&SLPHandlePool_Type);
+	PyModule_AddObject(m, "HandlePool", (PyObject *) &SLPHandlePool_Type);
+	Py_INCREF(&SLPHandleLease_Type);
+	PyModule_AddObject(m, "HandleLease", (PyObject *) &SLPHandleLease_Type);
+	Py_INCREF(&SLPWatcher_Type);
+	PyModule_AddObject(m, "Watcher", (PyObject *) &SLPWatcher_Type);
+	pthread_once(&cache_hooks_once, cache_hooks_install);
+	pthread_once(&reg_hooks_once, reg_hooks_install);
+	if (slp_atexit_register() != RET_OK)
+		MOD_INIT_ERROR;
+
 	/* Now add some named variables */
 	ADD_INT_VAR(m, "SLP_LIFETIME_MAXIMUM", SLP_LIFETIME_MAXIMUM);
 	ADD_INT_VAR(m, "SLP_LIFETIME_DEFAULT", SLP_LIFETIME_DEFAULT);
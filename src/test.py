@@ -1,6 +1,11 @@
 #!/usr/bin/python
 
+import os
+import select
 import sys
+import tempfile
+import threading
+import time
 import slp
 
 def service_callback(h, srvurl, lifetime, errcode, data):
@@ -102,5 +107,590 @@ if count == 0:
 
 ############
 
+failures = 0
+
+def check(what, ok):
+    global failures
+    if ok:
+        print("OK: " + what)
+    else:
+        print("FAILED: " + what)
+        failures += 1
+
+def raises(exc, func, *args, **kwargs):
+    try:
+        func(*args, **kwargs)
+    except exc:
+        return True
+    except Exception:
+        return False
+    return False
+
+print("Testing encode_attrs")
+
+if sys.version_info[0] < 3:
+    opaque = bytearray(b"\x00\xff")
+else:
+    opaque = b"\x00\xff"
+
+check("encode_attrs escapes the reserved characters",
+    slp.encode_attrs({"s": "(a)\\!<=>~, b"}) ==
+    "(s=\\28a\\29\\5C\\21\\3C\\3D\\3E\\7E\\2C b)")
+check("encode_attrs encodes the multi-valued attributes",
+    slp.encode_attrs({"c": [1, "x", 3]}) == "(c=1,x,3)")
+check("encode_attrs encodes the keywords",
+    slp.encode_attrs({"kw": None}) == "kw" and
+    slp.encode_attrs({"kw": []}) == "kw")
+check("encode_attrs encodes the booleans",
+    slp.encode_attrs({"t": True}) == "(t=true)" and
+    slp.encode_attrs({"f": False}) == "(f=false)")
+check("encode_attrs encodes the opaque values",
+    slp.encode_attrs({"o": opaque}) == "(o=\\FF\\00\\FF)")
+check("encode_attrs rejects the invalid tags",
+    raises(ValueError, slp.encode_attrs, {"a*": 1}) and
+    raises(ValueError, slp.encode_attrs, {"a_b": 1}))
+try:
+    slp.encode_attrs({"bad_tag": 1})
+    message = ""
+except ValueError as e:
+    message = str(e)
+check("encode_attrs names the invalid tag", '"bad_tag"' in message)
+check("encode_attrs rejects the non mappings",
+    raises(TypeError, slp.encode_attrs, 1))
+
+attrs = {"a": 1}
+slp.encode_attrs(attrs)
+attrs["a"] = 2
+check("encode_attrs sees a changed value", slp.encode_attrs(attrs) == "(a=2)")
+attrs["a"] = [1]
+slp.encode_attrs(attrs)
+attrs["a"].append(2)
+check("encode_attrs sees a changed list",
+    slp.encode_attrs(attrs) == "(a=1,2)")
+encoded = slp.encode_attrs(attrs, version=1)
+attrs["a"].append(3)
+check("encode_attrs reuses the list of the same version",
+    slp.encode_attrs(attrs, version=1) == encoded)
+check("encode_attrs encodes again for a new version",
+    slp.encode_attrs(attrs, version=2) == "(a=1,2,3)")
+
+############
+
+regSrvUrl = testSrvUrl + testSrvHost
+registered = slp.refresh_stats()["registrations"] > 0
+
+if not registered:
+    print("Skipping the registry tests: " + regSrvUrl + " is not registered")
+
+print("Testing the handles")
+
+with slp.Handle("en") as h:
+    check("a handle knows its language and mode",
+        h.lang == "en" and not h.isasync and not h.closed)
+    check("a handle finds the scopes", bool(slp.SLPFindScopes(h)))
+check("a handle is closed when leaving the with block", h.closed)
+check("a closed handle is refused", raises(ValueError, slp.SLPFindScopes, h))
+slp.SLPClose(h)
+check("a handle may be closed twice", h.closed)
+
+if registered:
+    shared = []
+
+    def shared_lookup():
+        shared.append(slp.find_srvs_list(hslp, testSrvUrl))
+
+    threads = [threading.Thread(target=shared_lookup) for i in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    check("the threads sharing a handle take turns on it",
+        len(shared) == 4 and
+        all(regSrvUrl in [u for u, lifetime in found] for found in shared))
+
+print("Testing the handle pools")
+
+pool = slp.HandlePool(1, "en", False, max_size=2)
+check("a pool opens its handles up front",
+    pool.stats["open"] == 1 and pool.stats["idle"] == 1)
+lease = pool.acquire()
+check("a lease holds a handle of the pool",
+    isinstance(lease.handle, slp.Handle))
+second = pool.acquire()
+check("a pool opens more handles under load", pool.stats["open"] == 2)
+check("a pool refuses more than max_size handles",
+    raises(RuntimeError, pool.acquire, timeout=0.1))
+handle = lease.handle
+second.release()
+lease.release()
+with pool.acquire() as h:
+    check("a thread gets back the handle it released", h is handle)
+    if registered:
+        check("the handles of a pool find the services",
+            regSrvUrl in [u for u, lifetime in
+                slp.find_srvs_list(h, testSrvUrl)])
+check("the leases give back their handles", pool.stats["idle"] == 2)
+pool.close()
+check("a closed pool is refused", raises(ValueError, pool.acquire))
+
+print("Testing iter_srvs")
+
+check("iter_srvs rejects an invalid handle",
+    raises(TypeError, slp.iter_srvs, None, testSrvUrl))
+check("iter_srvs rejects a bad buffer size",
+    raises(ValueError, slp.iter_srvs, hslp, testSrvUrl, maxsize=0))
+if registered:
+    check("iter_srvs yields the registered service",
+        regSrvUrl in [u for u, lifetime in slp.iter_srvs(hslp, testSrvUrl)])
+    it = slp.iter_srvs(hslp, testSrvUrl, maxsize=1)
+    next(it)
+    it.close()
+    check("iter_srvs gives the handle back once closed",
+        regSrvUrl in [u for u, lifetime in
+            slp.find_srvs_list(hslp, testSrvUrl)])
+
+if registered and hasattr(slp, "aio_find_srvs"):
+    import asyncio
+
+    print("Testing the asyncio operations")
+
+    loop = asyncio.new_event_loop()
+
+    def aio_run(func, *args, **kwargs):
+        # The operations belong to the running loop: start them from it.
+        ops = []
+        loop.call_soon(lambda: ops.append(
+            asyncio.ensure_future(func(*args, **kwargs))))
+        loop.run_until_complete(asyncio.sleep(0))
+        return loop.run_until_complete(ops[0])
+
+    aioSrvUrl = testSrvUrl + "://127.0.0.6"
+    check("aio_find_srvs finds the services",
+        regSrvUrl in [u for u, lifetime in
+            aio_run(slp.aio_find_srvs, hslp, testSrvUrl)])
+    aio_run(slp.aio_reg, hslp, aioSrvUrl, slp.SLP_LIFETIME_DEFAULT,
+        attrs="(aio=1)")
+    check("aio_reg registers the service",
+        aio_run(slp.aio_find_attrs, hslp, aioSrvUrl) == ["(aio=1)"])
+    aio_run(slp.aio_dereg, hslp, aioSrvUrl)
+    check("aio_dereg deregisters the service",
+        aioSrvUrl not in [u for u, lifetime in
+            aio_run(slp.aio_find_srvs, hslp, testSrvUrl)])
+    check("aio_set_workers rejects a bad number of workers",
+        raises(ValueError, slp.aio_set_workers, 0))
+    loop.close()
+
+if registered:
+    print("Testing the asynchronous handles")
+
+    def async_callback(h, srvurl, lifetime, errcode, found):
+        if errcode == slp.SLP_OK:
+            found.append(srvurl)
+        elif errcode == slp.SLP_LAST_CALL:
+            found.append(None)
+        return True
+
+    ahslp = slp.SLPOpen("en", True)
+    found = []
+    slp.SLPFindSrvs(ahslp, testSrvUrl, None, None, async_callback, found)
+    slp.SLPFindSrvs(ahslp, testSrvUrl, None, None, async_callback, found)
+    check("the asynchronous handle queues the operations",
+        ahslp.pending == 2)
+    end = time.time() + 30
+    while found.count(None) < 2 and time.time() < end:
+        select.select([ahslp.fileno()], [], [], 1)
+        ahslp.process_events()
+    check("process_events runs the callbacks of every operation",
+        found.count(regSrvUrl) == 2 and found.count(None) == 2)
+    check("the asynchronous handle has no operation left",
+        ahslp.pending == 0)
+    slp.SLPClose(ahslp)
+
+if registered:
+    print("Testing the batched callbacks")
+
+    def batch_callback(h, results, errcode, batches):
+        batches.append((list(results), errcode))
+        return True
+
+    batches = []
+    slp.SLPFindSrvs(hslp, testSrvUrl, None, None, batch_callback, batches,
+        batch_size=1)
+    check("SLPFindSrvs passes the results in batches",
+        all(len(results) <= 1 for results, errcode in batches) and
+        regSrvUrl in [u for results, errcode in batches
+            for u, lifetime in results])
+    check("the last batch comes with SLP_LAST_CALL",
+        batches[-1][1] == slp.SLP_LAST_CALL and
+        [errcode for results, errcode in batches[:-1]] ==
+        [slp.SLP_OK] * (len(batches) - 1))
+    batches = []
+    slp.SLPFindAttrs(hslp, regSrvUrl, None, None, batch_callback, batches,
+        flush_interval=60)
+    check("SLPFindAttrs passes the attribute lists in one batch",
+        len(batches) == 1 and batches[0] == (["(desc=test)"],
+            slp.SLP_LAST_CALL))
+    ahslp = slp.SLPOpen("en", True)
+    check("the asynchronous handles refuse the batches",
+        raises(ValueError, slp.SLPFindSrvs, ahslp, testSrvUrl, None, None,
+            batch_callback, [], batch_size=1))
+    slp.SLPClose(ahslp)
+
+if registered:
+    print("Testing the discovery cache")
+
+    def cached_callback(h, srvurl, lifetime, errcode, found):
+        if errcode == slp.SLP_OK:
+            found.append(srvurl)
+        return True
+
+    slp.cache_configure(enabled=True)
+    slp.cache_clear()
+    stats = slp.cache_stats()
+    first = slp.find_srvs_list(hslp, testSrvUrl)
+    second = slp.find_srvs_list(hslp, testSrvUrl)
+    check("the cache answers a repeated query",
+        slp.cache_stats()["misses"] == stats["misses"] + 1 and
+        slp.cache_stats()["hits"] == stats["hits"] + 1)
+    check("the cache keeps the services found",
+        sorted(u for u, lifetime in first) ==
+        sorted(u for u, lifetime in second))
+    check("the cached lifetimes are reduced by the age of the entry",
+        all(lifetime <= dict(first)[u] for u, lifetime in second))
+    found = []
+    slp.SLPFindSrvs(hslp, testSrvUrl, None, None, cached_callback, found)
+    check("SLPFindSrvs is answered from the cache",
+        regSrvUrl in found and
+        slp.cache_stats()["hits"] == stats["hits"] + 2)
+    slp.cache_clear()
+    check("cache_clear drops the entries", slp.cache_stats()["entries"] == 0)
+    slp.cache_configure(enabled=False)
+    slp.find_srvs_list(hslp, testSrvUrl)
+    check("the disabled cache is not used",
+        slp.cache_stats()["entries"] == 0)
+
+print("Testing the negative cache")
+
+missingSrvType = "service:pyslp-missing"
+slp.cache_configure(enabled=True, negative_ttl=60)
+slp.cache_clear()
+stats = slp.cache_stats()
+check("an unknown service type is not found",
+    slp.find_srvs_list(hslp, missingSrvType) == [] and
+    slp.find_srvs_list(hslp, missingSrvType) == [])
+check("the empty result is cached",
+    slp.cache_stats()["negative_entries"] == 1 and
+    slp.cache_stats()["negative_hits"] == stats["negative_hits"] + 1)
+slp.cache_clear(negative_only=True)
+check("cache_clear drops the negative entries",
+    slp.cache_stats()["negative_entries"] == 0)
+slp.cache_configure(enabled=False, negative_ttl=0)
+
+if registered:
+    print("Testing the watchers")
+
+    watchSrvUrl = testSrvUrl + "://127.0.0.7"
+    changes = []
+    with slp.Watcher(testSrvUrl, interval=0.5) as watcher:
+        generation = watcher.wait(0, timeout=10)
+        check("the watcher publishes the services found",
+            generation >= 1 and
+            regSrvUrl in [u for u, lifetime in watcher.services()])
+        watcher.subscribe(lambda added, removed:
+            changes.append((added, removed)))
+        slp.SLPReg(hslp, watchSrvUrl, slp.SLP_LIFETIME_DEFAULT, None,
+            "(desc=watch)", True, reg_callback, None)
+        end = time.time() + 10
+        while not changes and time.time() < end:
+            watcher.wait(watcher.generation, timeout=1)
+        check("the watcher reports the new services",
+            [[u for u, lifetime in added] for added, removed in changes] ==
+            [[watchSrvUrl]])
+        slp.SLPDereg(hslp, watchSrvUrl, reg_callback, None)
+        end = time.time() + 10
+        while len(changes) < 2 and time.time() < end:
+            watcher.wait(watcher.generation, timeout=1)
+        check("the watcher reports the services gone",
+            len(changes) == 2 and
+            [u for u, lifetime in changes[1][1]] == [watchSrvUrl])
+    check("the watcher stops when leaving the with block", watcher.closed)
+
+if registered and hasattr(os, "fork"):
+    print("Testing the cache shared between processes")
+
+    shared = tempfile.mktemp()
+    slp.cache_configure(enabled=True)
+    slp.cache_clear()
+    slp.cache_share(shared, slots=64, slot_size=1024)
+    check("cache_share attaches the file",
+        slp.cache_stats()["shared"] == shared)
+    pid = os.fork()
+    if pid == 0:
+        # The child runs the query for both processes.
+        slp.find_srvs_list(slp.SLPOpen("en", False), testSrvUrl)
+        os._exit(0)
+    os.waitpid(pid, 0)
+    hits = slp.cache_stats()["shared_hits"]
+    check("a process reads the results found by another one",
+        regSrvUrl in [u for u, lifetime in
+            slp.find_srvs_list(hslp, testSrvUrl)] and
+        slp.cache_stats()["shared_hits"] == hits + 1)
+    slp.cache_share(None)
+    check("cache_share(None) detaches the file",
+        slp.cache_stats()["shared"] is None)
+    slp.cache_configure(enabled=False)
+    os.unlink(shared)
+
+def attr_set(attrs):
+    return sorted(",".join(attrs).split(","))
+
+if registered:
+    print("Testing the attribute subsets served from the cache")
+
+    attrSrvUrl = testSrvUrl + "://127.0.0.4"
+    slp.SLPReg(hslp, attrSrvUrl, slp.SLP_LIFETIME_DEFAULT, None,
+        "(a=1),(ab=2),(b=3)", True, reg_callback, None)
+    slp.cache_configure(enabled=True, attr_ttl=60)
+    full = slp.find_attrs_list(hslp, attrSrvUrl)
+    check("find_attrs_list finds the attributes",
+        attr_set(full) == ["(a=1)", "(ab=2)", "(b=3)"])
+    projections = slp.cache_stats()["projections"]
+    check("find_attrs_list selects the requested attributes",
+        attr_set(slp.find_attrs_list(hslp, attrSrvUrl, None, "b")) ==
+        ["(b=3)"])
+    check("find_attrs_list selects the attributes matching a wildcard",
+        attr_set(slp.find_attrs_list(hslp, attrSrvUrl, None, "a*")) ==
+        ["(a=1)", "(ab=2)"])
+    check("find_attrs_list finds nothing for an unknown attribute",
+        slp.find_attrs_list(hslp, attrSrvUrl, None, "zz") == [])
+    check("find_attrs_list answers the subsets from the cache",
+        slp.cache_stats()["projections"] == projections + 3)
+    slp.cache_configure(enabled=False)
+    slp.SLPDereg(hslp, attrSrvUrl, reg_callback, None)
+
+if registered:
+    print("Testing the stale entries and the coalesced queries")
+
+    slp.cache_configure(enabled=True, max_ttl=1, stale_ttl=60)
+    slp.cache_clear()
+    slp.find_srvs_list(hslp, testSrvUrl)
+    time.sleep(1.5)
+    stale = slp.cache_stats()["stale_hits"]
+    check("an expired entry is served while stale",
+        regSrvUrl in [u for u, lifetime in
+            slp.find_srvs_list(hslp, testSrvUrl)] and
+        slp.cache_stats()["stale_hits"] == stale + 1)
+    slp.cache_configure(enabled=True, max_ttl=0, stale_ttl=0)
+    slp.cache_clear()
+
+    # Each query looks the other one up from its callback while both run.
+    filters = ["(desc=*)", "(desc=test)"]
+    started = [threading.Event(), threading.Event()]
+    crossed = {}
+
+    def cross_lookup(mine, other):
+        h1 = slp.SLPOpen("en", False)
+        h2 = slp.SLPOpen("en", False)
+
+        def callback(h, srvurl, lifetime, errcode, data):
+            if errcode == slp.SLP_OK and mine not in crossed:
+                crossed[mine] = []
+                started[mine].set()
+                started[other].wait(10)
+                crossed[mine] = slp.find_srvs_list(h2, testSrvUrl, None,
+                    filters[other])
+            return True
+
+        slp.SLPFindSrvs(h1, testSrvUrl, None, filters[mine], callback, None)
+        slp.SLPClose(h1)
+        slp.SLPClose(h2)
+
+    threads = [threading.Thread(target=cross_lookup, args=(0, 1)),
+        threading.Thread(target=cross_lookup, args=(1, 0))]
+    for t in threads:
+        t.daemon = True
+        t.start()
+    for t in threads:
+        t.join(30)
+    check("the queries looking each other up from their callbacks finish",
+        not [t for t in threads if t.is_alive()] and
+        all(crossed.get(i) for i in range(2)))
+    slp.cache_configure(enabled=False)
+
+if registered:
+    print("Testing the early stopped queries")
+
+    limitSrvUrl = testSrvUrl + "://127.0.0.8"
+    slp.SLPReg(hslp, limitSrvUrl, slp.SLP_LIFETIME_DEFAULT, None,
+        "(desc=limit)", True, reg_callback, None)
+    results, partial = slp.find_srvs_list(hslp, testSrvUrl, limit=1)
+    check("find_srvs_list stops at the limit",
+        len(results) == 1 and partial is True)
+    results, partial = slp.find_srvs_list(hslp, testSrvUrl, limit=100,
+        deadline=30)
+    check("find_srvs_list runs to the end below the limit",
+        regSrvUrl in [u for u, lifetime in results] and
+        limitSrvUrl in [u for u, lifetime in results] and partial is False)
+    def limit_callback(h, srvurl, lifetime, errcode, calls):
+        calls.append(errcode)
+        return True
+
+    calls = []
+    check("SLPFindSrvs reports the early stop",
+        slp.SLPFindSrvs(hslp, testSrvUrl, None, None, limit_callback, calls,
+            limit=1) is True)
+    check("the callback gets SLP_LAST_CALL after the limit",
+        calls == [slp.SLP_OK, slp.SLP_LAST_CALL])
+    check("a negative limit is refused",
+        raises(ValueError, slp.find_srvs_list, hslp, testSrvUrl, limit=-1))
+    slp.SLPDereg(hslp, limitSrvUrl, reg_callback, None)
+
+if registered:
+    print("Testing the hedged queries")
+
+    queries = slp.hedge_stats()["queries"]
+    check("find_srvs_hedged finds the services",
+        regSrvUrl in [u for u, lifetime in
+            slp.find_srvs_hedged(hslp, testSrvUrl)])
+    check("find_srvs_hedged finds the services with an immediate hedge",
+        regSrvUrl in [u for u, lifetime in
+            slp.find_srvs_hedged(hslp, testSrvUrl, delay=0)])
+    check("find_srvs_hedged finds the services with one attempt per scope",
+        regSrvUrl in [u for u, lifetime in
+            slp.find_srvs_hedged(hslp, testSrvUrl, "DEFAULT",
+                per_scope=True)])
+    check("hedge_stats counts the hedged queries",
+        slp.hedge_stats()["queries"] == queries + 3)
+    check("find_srvs_hedged rejects a bad percentile",
+        raises(ValueError, slp.find_srvs_hedged, hslp, testSrvUrl,
+            percentile=101))
+
+print("Testing reg_many")
+
+check("reg_many rejects a non sequence", raises(TypeError, slp.reg_many, 1))
+check("reg_many rejects a malformed registration",
+    raises(TypeError, slp.reg_many, [(testSrvUrl + testSrvHost,)]))
+check("reg_many rejects a bad number of workers",
+    raises(ValueError, slp.reg_many, [], workers=0))
+if registered:
+    manyUrls = [testSrvUrl + "://127.0.1." + str(i) for i in range(3)]
+    check("reg_many registers every service",
+        slp.reg_many([(u, slp.SLP_LIFETIME_DEFAULT, "(x=1)")
+            for u in manyUrls], workers=2) == [slp.SLP_OK] * 3)
+    found = [u for u, lifetime in slp.find_srvs_list(hslp, testSrvUrl)]
+    check("reg_many registrations are found",
+        all(u in found for u in manyUrls))
+    for u in manyUrls:
+        slp.SLPDereg(hslp, u, reg_callback, None)
+
+if registered:
+    print("Testing the cache snapshots")
+
+    snapshot = tempfile.mktemp()
+    slp.cache_configure(enabled=True)
+    slp.cache_clear()
+    slp.find_srvs_list(hslp, testSrvUrl)
+    check("cache_save saves the cache entries",
+        slp.cache_save(snapshot) == 1)
+    slp.cache_clear()
+    slp.cache_load(snapshot)
+    restored = slp.cache_stats()["restored"]
+    check("the loaded snapshot serves the saved results",
+        regSrvUrl in [u for u, lifetime in
+            slp.find_srvs_list(hslp, testSrvUrl)])
+    check("the saved entry is restored once",
+        slp.cache_stats()["restored"] == restored + 1)
+    slp.cache_load(None)
+    slp.cache_configure(enabled=False)
+    os.unlink(snapshot)
+    check("cache_load rejects a file which is not a snapshot",
+        raises(OSError, slp.cache_load, sys.argv[0]))
+
+if registered:
+    print("Testing reg_update")
+
+    check("reg_update sends nothing for the same attributes",
+        slp.reg_update(hslp, regSrvUrl, "(desc=test)") is False)
+    check("reg_update sends the new attributes",
+        slp.reg_update(hslp, regSrvUrl, "(desc=test),(a=1),(ab=2),(b=3)")
+        is True)
+    check("reg_update ignores the order of the attributes",
+        slp.reg_update(hslp, regSrvUrl, "(b=3),(ab=2),(a=1),(desc=test)")
+        is False)
+    check("reg_update removes the dropped attributes",
+        slp.reg_update(hslp, regSrvUrl, "(a=1),(ab=2),(b=3)") is True and
+        slp.reg_update(hslp, regSrvUrl, "(a=1),(ab=2),(b=3)") is False)
+    check("reg_update leaves the service with the new attributes",
+        attr_set(slp.find_attrs_list(hslp, regSrvUrl)) ==
+        ["(a=1)", "(ab=2)", "(b=3)"])
+
+if registered:
+    print("Testing the deduplicated discovery")
+
+    def collect_callback(h, srvurl, lifetime, errcode, found):
+        if errcode == slp.SLP_OK:
+            found.append(srvurl)
+        return True
+
+    found = []
+    slp.SLPFindSrvs(hslp, testSrvUrl, None, None, collect_callback, found,
+        dedupe=True)
+    check("SLPFindSrvs passes each URL once with dedupe",
+        found.count(regSrvUrl) == 1)
+    found = []
+    slp.SLPFindSrvs(hslp, testSrvUrl, None, None, collect_callback, found,
+        deadline=30, dedupe=True)
+    check("SLPFindSrvs passes the URLs found before the deadline with dedupe",
+        found.count(regSrvUrl) == 1)
+    check("find_srvs_list lists each URL once with dedupe",
+        [u for u, lifetime in slp.find_srvs_list(hslp, testSrvUrl,
+            dedupe=True)].count(regSrvUrl) == 1)
+
+if registered:
+    print("Testing the refresh of the registrations")
+
+    check("refresh is off by default", not slp.refresh_stats()["enabled"])
+    refreshUrl = testSrvUrl + "://127.0.0.5"
+    slp.SLPReg(hslp, refreshUrl, 4, None, "(desc=refresh)", True,
+        reg_callback, None)
+    refreshes = slp.refresh_stats()["refreshes"]
+    slp.refresh_configure(enabled=True)
+    time.sleep(5)
+    check("the refresh thread re-registers the services",
+        slp.refresh_stats()["refreshes"] > refreshes)
+    check("the refreshed service outlives its lifetime",
+        refreshUrl in [u for u, lifetime in
+            slp.find_srvs_list(hslp, testSrvUrl)])
+    slp.refresh_configure(enabled=False)
+    slp.SLPDereg(hslp, refreshUrl, reg_callback, None)
+
+print("Testing dereg_all and dereg_matching")
+
+check("dereg_all rejects a bad number of workers",
+    raises(ValueError, slp.dereg_all, workers=0))
+check("dereg_all rejects a negative deadline",
+    raises(ValueError, slp.dereg_all, deadline=-1))
+check("dereg_matching rejects a missing pattern",
+    raises(TypeError, slp.dereg_matching, None))
+check("dereg_matching rejects a bad number of workers",
+    raises(ValueError, slp.dereg_matching, testSrvUrl, workers=100000))
+if registered:
+    check("dereg_matching does not match another service type",
+        slp.dereg_matching("service:noth") == [])
+    check("dereg_matching does not match another URL",
+        slp.dereg_matching(testSrvUrl + "://127.0.0.2") == [])
+    check("dereg_matching matches the URLs of the service type",
+        slp.dereg_matching(testSrvUrl) == [(regSrvUrl, slp.SLP_OK)])
+    check("dereg_matching forgets the deregistered URLs",
+        slp.refresh_stats()["registrations"] == 0)
+    check("dereg_matching deregisters the services",
+        regSrvUrl not in [u for u, lifetime in
+            slp.find_srvs_list(hslp, testSrvUrl)])
+
+############
+
 slp.SLPClose(hslp);
 
+if failures:
+    sys.exit(str(failures) + " test(s) failed")
+